@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* A LockingX request with a timeout asks the server to wait for conflicting
+   locks to be released, rather than failing straight away. Such a request
+   is kept on a queue, and no reply is sent until its locks can be taken or
+   the timeout expires; other requests from the client are served in the
+   meantime. The process waiting is sent a message when locks on the file
+   are released (see locking.c), and each request is tried again then. */
+
+#include "blocking.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "reply.h"
+#include "server.h"
+#include "smb.h"
+#include "util.h"
+
+/* a LockingX request timeout meaning to wait forever */
+#define WAIT_FOREVER 0xFFFFFFFF
+
+struct blocking_lock {
+	char *inbuf; /* copy of the request */
+	int fnum;
+	long long expires; /* or -1 to wait forever */
+	long long retry;   /* when to try again if not woken before */
+	struct blocking_lock *next;
+};
+
+static struct blocking_lock *queue = NULL;
+
+/* set if requests can wait; not in event mode, where a process has no
+   way of being woken */
+static bool enabled = false;
+
+/* set when a message says that locks have been released */
+static bool woken = false;
+
+static long long now_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/****************************************************************************
+allow LockingX requests to wait for locks to be released
+****************************************************************************/
+void blocking_locks_init(void)
+{
+	enabled = true;
+}
+
+/****************************************************************************
+whether a LockingX request that fails can wait for its locks to be
+released. Requests that are part of a chain are answered straight away.
+****************************************************************************/
+bool blocking_lock_allowed(char *inbuf)
+{
+	return enabled && IVAL(inbuf, smb_vwv4) != 0 && chain_size == 0 &&
+	       CVAL(inbuf, smb_vwv0) == 0xFF;
+}
+
+/****************************************************************************
+queue a LockingX request that failed, to be tried again when locks on the
+file are released
+****************************************************************************/
+void push_blocking_lock(char *inbuf, int fnum)
+{
+	struct blocking_lock *b = checked_malloc(sizeof(struct blocking_lock));
+	uint32_t timeout = IVAL(inbuf, smb_vwv4);
+	struct blocking_lock **p;
+	int len = smb_len(inbuf) + 4;
+
+	b->inbuf = checked_malloc(len);
+	memcpy(b->inbuf, inbuf, len);
+	b->fnum = fnum;
+	b->retry = now_msecs() + BLOCKING_LOCK_RETRY_MSECS;
+	if (timeout == WAIT_FOREVER) {
+		b->expires = -1;
+	} else {
+		b->expires = now_msecs() + timeout;
+	}
+	b->next = NULL;
+
+	/* requests are tried again in the order they arrived */
+	for (p = &queue; *p != NULL; p = &(*p)->next)
+		;
+	*p = b;
+
+	DEBUG("queued blocking lock fnum=%d timeout=%u\n", fnum, timeout);
+}
+
+/****************************************************************************
+send the reply to a queued request and free it. It must already have been
+taken off the queue.
+****************************************************************************/
+static void reply_blocking_lock(struct blocking_lock *b, int eclass,
+                                uint32_t ecode)
+{
+	char outbuf[smb_size + 2 * 2];
+
+	construct_reply_common(b->inbuf, outbuf);
+	if (eclass == 0) {
+		set_message(outbuf, 2, 0, true);
+		CVAL(outbuf, smb_vwv0) = 0xFF;
+	} else {
+		error_packet(b->inbuf, outbuf, eclass, ecode, __LINE__);
+	}
+
+	free(b->inbuf);
+	free(b);
+
+	send_smb(Client, outbuf);
+}
+
+/****************************************************************************
+cancel a queued request on a file that has the same locks as the given
+LockingX request, for LOCKING_ANDX_CANCEL_LOCK. Returns false if there is
+none.
+****************************************************************************/
+bool cancel_blocking_lock(char *inbuf, int fnum)
+{
+	int num_locks = SVAL(inbuf, smb_vwv7);
+	char *locks = smb_buf(inbuf) + 10 * SVAL(inbuf, smb_vwv6);
+	struct blocking_lock **p, *b;
+	char *b_locks;
+
+	for (p = &queue; (b = *p) != NULL; p = &b->next) {
+		b_locks = smb_buf(b->inbuf) + 10 * SVAL(b->inbuf, smb_vwv6);
+		if (b->fnum == fnum && SVAL(b->inbuf, smb_vwv7) == num_locks &&
+		    memcmp(b_locks, locks, 10 * num_locks) == 0) {
+			*p = b->next;
+			DEBUG("cancelled blocking lock fnum=%d\n", fnum);
+			reply_blocking_lock(b, ERRDOS, ERRlock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/****************************************************************************
+remove the queued requests on a file that is being closed, failing them if
+reply is true
+****************************************************************************/
+void remove_blocking_locks(int fnum, bool reply)
+{
+	struct blocking_lock **p = &queue, *b;
+
+	while ((b = *p) != NULL) {
+		if (b->fnum != fnum) {
+			p = &b->next;
+			continue;
+		}
+		*p = b->next;
+		if (reply) {
+			reply_blocking_lock(b, ERRDOS, ERRlock);
+		} else {
+			free(b->inbuf);
+			free(b);
+		}
+	}
+}
+
+/****************************************************************************
+another process has released locks; the queued requests are tried again
+****************************************************************************/
+void blocking_lock_wake(void)
+{
+	woken = true;
+}
+
+/****************************************************************************
+how long to wait for a request from the client, in milli seconds, before
+the queued requests need to be tried again; at most timeout, unless it is
+zero (no timeout)
+****************************************************************************/
+int blocking_lock_wait(int timeout)
+{
+	long long now = now_msecs(), due;
+	struct blocking_lock *b;
+
+	for (b = queue; b != NULL; b = b->next) {
+		due = b->retry;
+		if (b->expires >= 0 && b->expires < due) {
+			due = b->expires;
+		}
+		due -= now;
+		if (due < 1) {
+			due = 1;
+		}
+		if (timeout <= 0 || due < timeout) {
+			timeout = due;
+		}
+	}
+
+	return timeout;
+}
+
+/****************************************************************************
+try the queued requests again if they have been woken or are due, sending
+the replies to any that succeed or have timed out
+****************************************************************************/
+void process_blocking_locks(void)
+{
+	struct blocking_lock **p = &queue, *b;
+	long long now = now_msecs();
+	bool wake = woken, expired;
+	uint32_t ecode = 0;
+	int eclass;
+
+	woken = false;
+
+	while ((b = *p) != NULL) {
+		expired = b->expires >= 0 && now >= b->expires;
+		if (!wake && !expired && now < b->retry) {
+			p = &b->next;
+			continue;
+		}
+		if (!lockingX_locks(b->inbuf, b->fnum, !expired, &eclass,
+		                    &ecode)) {
+			if (ecode == ERRlock && !expired) {
+				b->retry = now + BLOCKING_LOCK_RETRY_MSECS;
+				p = &b->next;
+				continue;
+			}
+		} else {
+			eclass = 0;
+		}
+		*p = b->next;
+		DEBUG("answering blocking lock fnum=%d eclass=%d\n", b->fnum,
+		      eclass);
+		reply_blocking_lock(b, eclass, ecode);
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+
+/* how often a blocking lock request is tried again even if this process has
+   not been told the locks it is waiting for were released, in case they
+   were held by a local process or one that died */
+#define BLOCKING_LOCK_RETRY_MSECS 1000
+
+void blocking_locks_init(void);
+bool blocking_lock_allowed(char *inbuf);
+void push_blocking_lock(char *inbuf, int fnum);
+bool cancel_blocking_lock(char *inbuf, int fnum);
+void remove_blocking_locks(int fnum, bool reply);
+void blocking_lock_wake(void);
+int blocking_lock_wait(int timeout);
+void process_blocking_locks(void);
@@ -12,34 +12,40 @@
 #include "dir.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "byteorder.h"
 #include "guards.h" /* IWYU pragma: keep */
 #include "mangle.h"
+#include "metacache.h"
 #include "server.h"
+#include "shareindex.h"
 #include "smb.h"
+#include "statpool.h"
 #include "strfunc.h"
 #include "util.h"
+#include "watch.h"
 
 /* max number of directories open at once */
 /* note that with the new directory code this no longer requires a
    file handle per directory, but large numbers do use more memory */
 #define MAXDIR 64
 
-#define DIRCACHESIZE 20
-
 static uint32_t dircounter = 0;
 
 #define NUMDIRPTRS 256
 
-static struct dptr_struct {
+struct dptr_struct {
 	int pid;
 	int cnum;
 	uint32_t lastused;
@@ -52,27 +58,80 @@ static struct dptr_struct {
 	uint16_t attr; /* Field only used for lanman2 trans2_findfirst/next
 	                searches */
 	char *path;
-} dirptrs[NUMDIRPTRS];
+};
+
+/* Each client session has its own table of dir ptrs; dirptrs and dptrs_open
+   refer to the one belonging to the session currently being served. */
+struct dptr_table {
+	struct dptr_struct dirptrs[NUMDIRPTRS];
+	int dptrs_open;
+};
 
+static struct dptr_table *current_table = NULL;
+static struct dptr_struct *dirptrs = NULL;
 static int dptrs_open = 0;
 
 /****************************************************************************
-initialise the dir array
+allocate and initialise a new dir array
 ****************************************************************************/
-void init_dptrs(void)
+void *dptr_table_new(void)
 {
-	static bool dptrs_init = false;
+	struct dptr_table *table = checked_calloc(1, sizeof(struct dptr_table));
 	int i;
 
-	if (dptrs_init)
-		return;
 	for (i = 0; i < NUMDIRPTRS; i++) {
-		dirptrs[i].valid = false;
-		dirptrs[i].wcard = NULL;
-		dirptrs[i].ptr = NULL;
-		string_init(&dirptrs[i].path, "");
+		table->dirptrs[i].valid = false;
+		table->dirptrs[i].wcard = NULL;
+		table->dirptrs[i].ptr = NULL;
+		string_init(&table->dirptrs[i].path, "");
 	}
-	dptrs_init = true;
+	table->dptrs_open = 0;
+
+	return table;
+}
+
+/****************************************************************************
+make a dir array the current one
+****************************************************************************/
+void dptr_table_select(void *p)
+{
+	if (current_table != NULL)
+		current_table->dptrs_open = dptrs_open;
+
+	current_table = p;
+	dirptrs = current_table->dirptrs;
+	dptrs_open = current_table->dptrs_open;
+}
+
+/****************************************************************************
+free the current dir array, closing any dptrs that are still open
+****************************************************************************/
+void dptr_table_free(void)
+{
+	int i;
+
+	dptr_close(-1);
+	for (i = 0; i < NUMDIRPTRS; i++)
+		string_free(&dirptrs[i].path);
+
+	free(current_table);
+	current_table = NULL;
+	dirptrs = NULL;
+	dptrs_open = 0;
+}
+
+/****************************************************************************
+count the dptrs in use in the current dir array
+****************************************************************************/
+int dptr_count(void)
+{
+	int i, result = 0;
+
+	for (i = 0; i < NUMDIRPTRS; i++)
+		if (dirptrs[i].valid)
+			result++;
+
+	return result;
 }
 
 /****************************************************************************
@@ -462,7 +521,8 @@ bool get_dir_entry(int cnum, char *mask, int dirtype, char *fname, int *size,
 		pstrcpy(filename, dname);
 
 		if (strcmp(filename, mask) != 0) {
-			name_map_mangle(filename, true, CONN_SHARE(cnum));
+			dir_entry_name_83(Connections[cnum].dirptr, dname,
+			                  filename, CONN_SHARE(cnum));
 			if (!mask_match(filename, mask, false)) {
 				continue;
 			}
@@ -473,6 +533,11 @@ bool get_dir_entry(int cnum, char *mask, int dirtype, char *fname, int *size,
 			continue;
 		}
 
+		/* directories always have the aDIR attribute */
+		if ((dirtype & aDIR) == 0 && dir_entry_type(dname) == DT_DIR) {
+			continue;
+		}
+
 		pstrcpy(fname, filename);
 		*path = 0;
 		pstrcpy(path, Connections[cnum].dirpath);
@@ -481,7 +546,8 @@ bool get_dir_entry(int cnum, char *mask, int dirtype, char *fname, int *size,
 		pstrcpy(pathreal, path);
 		pstrcat(path, fname);
 		pstrcat(pathreal, dname);
-		if (stat(pathreal, &sbuf) != 0) {
+		if (dir_entry_stat(Connections[cnum].dirptr, dname, pathreal,
+		                   &sbuf) != 0) {
 			DEBUG("Couldn't stat 1 [%s]\n", path);
 			continue;
 		}
@@ -505,12 +571,28 @@ bool get_dir_entry(int cnum, char *mask, int dirtype, char *fname, int *size,
 	return found;
 }
 
+/* A snapshot of the names in a directory. Each name in data is preceded by
+   a byte holding its d_type from readdir(), or DT_UNKNOWN. */
 typedef struct {
 	int pos;
 	int numentries;
 	int mallocsize;
 	char *data;
 	char *current;
+	int *offsets; /* offset in data of each entry, for seek_dir() */
+	int offsets_size;
+	int fd; /* the directory, for fstatat(); -1 if not open */
+
+	/* if true, the entries are read from the index of the share rather
+	   than from data */
+	bool indexed;
+	struct shareindex_dir index;
+	char *name; /* copy of the entry last read, after its d_type */
+
+	/* metadata of upcoming entries, being read by the stat pool */
+	struct stat_job *prefetch;
+	int prefetch_count, prefetch_next;
+	char *prefetch_paths;
 } Dir;
 
 /*******************************************************************
@@ -518,10 +600,39 @@ open a directory
 ********************************************************************/
 void *open_dir(int cnum, char *name)
 {
+	struct shareindex_dir index;
 	Dir *dirp;
 	struct dirent *de;
-	DIR *d = opendir(name);
-	int used = 0;
+	DIR *d;
+	int fd, used = 0;
+
+	if (shareindex_open_dir(CONN_SHARE(cnum), name, &index)) {
+		dirp = checked_calloc(1, sizeof(Dir));
+		dirp->numentries = index.count;
+		dirp->fd = -1;
+		dirp->indexed = true;
+		dirp->index = index;
+		dirp->name = checked_malloc(sizeof(pstring) + 1);
+		return (void *) dirp;
+	}
+
+	/* Keep a descriptor for the directory so that entries can be
+	   stat()ed relative to it, without building up the full path. If we
+	   have run out of descriptors, fall back to using paths. */
+	fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		int fd2 = dup(fd);
+		d = fd2 >= 0 ? fdopendir(fd2) : NULL;
+		if (d == NULL) {
+			if (fd2 >= 0)
+				close(fd2);
+			close(fd);
+			fd = -1;
+			d = opendir(name);
+		}
+	} else {
+		d = opendir(name);
+	}
 
 	if (d == NULL) {
 		return NULL;
@@ -529,17 +640,32 @@ void *open_dir(int cnum, char *name)
 	dirp = checked_malloc(sizeof(Dir));
 	dirp->pos = dirp->numentries = dirp->mallocsize = 0;
 	dirp->data = dirp->current = NULL;
+	dirp->offsets = NULL;
+	dirp->offsets_size = 0;
+	dirp->fd = fd;
+	dirp->indexed = false;
+	dirp->name = NULL;
+	dirp->prefetch = NULL;
+	dirp->prefetch_count = dirp->prefetch_next = 0;
+	dirp->prefetch_paths = NULL;
 
 	while ((de = readdir(d)) != NULL) {
-		int l = strlen(de->d_name) + 1;
+		int l = strlen(de->d_name) + 2;
 
 		if (used + l > dirp->mallocsize) {
-			int s = MAX(used + l, used + 2000);
+			int s = MAX(used + l, MAX(dirp->mallocsize * 2, 2000));
 			dirp->data = checked_realloc(dirp->data, s);
 			dirp->mallocsize = s;
 			dirp->current = dirp->data;
 		}
-		pstrcpy(dirp->data + used, de->d_name);
+		if (dirp->numentries >= dirp->offsets_size) {
+			dirp->offsets_size = MAX(dirp->offsets_size * 2, 64);
+			dirp->offsets = checked_realloc(
+			    dirp->offsets, dirp->offsets_size * sizeof(int));
+		}
+		dirp->offsets[dirp->numentries] = used;
+		dirp->data[used] = de->d_type;
+		pstrcpy(dirp->data + used + 1, de->d_name);
 		used += l;
 		dirp->numentries++;
 	}
@@ -556,7 +682,12 @@ void close_dir(void *p)
 	Dir *dirp = (Dir *) p;
 	if (!dirp)
 		return;
+	dir_prefetch_end(p);
+	if (dirp->fd >= 0)
+		close(dirp->fd);
 	free(dirp->data);
+	free(dirp->offsets);
+	free(dirp->name);
 	free(dirp);
 }
 
@@ -565,19 +696,196 @@ read from a directory
 ********************************************************************/
 char *read_dir_name(void *p)
 {
+	const char *name;
 	char *ret;
 	Dir *dirp = (Dir *) p;
 
+	/* callers may change the name, so they get a copy rather than a
+	   pointer into the index, which is read-only */
+	if (dirp && dirp->indexed && dirp->pos < dirp->numentries) {
+		name = shareindex_dir_name(&dirp->index, dirp->pos++);
+		dirp->name[0] = name[-1];
+		pstrcpy(dirp->name + 1, name);
+		return dirp->name + 1;
+	}
+
 	if (!dirp || !dirp->current || dirp->pos >= dirp->numentries)
 		return NULL;
 
-	ret = dirp->current;
-	dirp->current = skip_string(dirp->current, 1);
+	ret = dirp->current + 1;
+	dirp->current = skip_string(ret, 1);
 	dirp->pos++;
 
 	return ret;
 }
 
+/*******************************************************************
+get the type of a directory entry (one of the DT_* values from
+readdir(), or DT_UNKNOWN). dname must have been returned by
+read_dir_name()
+********************************************************************/
+int dir_entry_type(char *dname)
+{
+	return (unsigned char) dname[-1];
+}
+
+/*******************************************************************
+find the number in the index of an entry of an indexed directory.
+dname must have been returned by read_dir_name()
+********************************************************************/
+static int dir_index_entry(Dir *dirp, char *dname)
+{
+	/* usually the entry that was read last */
+	if (dirp->pos > 0 && dname == dirp->name + 1 &&
+	    !strcmp(dname, shareindex_dir_name(&dirp->index, dirp->pos - 1))) {
+		return dirp->pos - 1;
+	}
+
+	return shareindex_dir_find(&dirp->index, dname);
+}
+
+/*******************************************************************
+get the name of a directory entry as shown to clients that need 8.3
+names. dname must have been returned by read_dir_name()
+********************************************************************/
+void dir_entry_name_83(void *p, char *dname, char *name,
+                       const struct share *share)
+{
+	Dir *dirp = (Dir *) p;
+	int i;
+
+	if (dirp->indexed && (i = dir_index_entry(dirp, dname)) >= 0) {
+		pstrcpy(name, shareindex_dir_name_83(&dirp->index, i));
+		return;
+	}
+
+	pstrcpy(name, dname);
+	name_map_mangle(name, true, share);
+}
+
+/*******************************************************************
+stat a directory entry. dname must have been returned by
+read_dir_name(); pathreal is the path to the entry, which is used if the
+directory could not be kept open
+********************************************************************/
+int dir_entry_stat(void *p, char *dname, char *pathreal, struct stat *st)
+{
+	Dir *dirp = (Dir *) p;
+	struct stat_job *job;
+	int i;
+
+	if (dirp->indexed) {
+		i = dir_index_entry(dirp, dname);
+		if (i < 0) {
+			errno = ENOENT;
+			return -1;
+		}
+		shareindex_dir_stat(&dirp->index, i, st);
+		return 0;
+	}
+
+	/* entries are listed in order, so search forward from the last one */
+	for (; dirp->prefetch_next < dirp->prefetch_count;
+	     dirp->prefetch_next++) {
+		job = &dirp->prefetch[dirp->prefetch_next];
+		if (job->name > dname) {
+			break;
+		} else if (job->name < dname || !statpool_wait(job)) {
+			continue;
+		}
+		dirp->prefetch_next++;
+		if (job->result != 0) {
+			errno = job->error;
+			return job->result;
+		}
+		*st = job->st;
+		prefetched_dosattrib(st, job->attrib, job->attrib_len);
+		return 0;
+	}
+
+	if (dirp->fd >= 0)
+		return fstatat(dirp->fd, dname, st, 0);
+
+	return stat(pathreal, st);
+}
+
+/*******************************************************************
+start reading the metadata of the next count entries that match mask and
+dirtype, so that dir_entry_stat() does not have to wait for each one.
+dirpath is the path of the directory. This must be ended with
+dir_prefetch_end() before the working directory changes.
+********************************************************************/
+void dir_prefetch(void *p, char *dirpath, char *mask, int dirtype, int count)
+{
+	Dir *dirp = (Dir *) p;
+	bool needslash;
+	char *s, *path;
+	int i, n = 0, pos, len = 0;
+
+	dir_prefetch_end(p);
+	if (!dirp || dirp->fd < 0) {
+		return;
+	}
+
+	count = MIN(count, DIR_PREFETCH_MAX);
+	if (count <= 0) {
+		return;
+	}
+
+	dirp->prefetch = checked_calloc(count, sizeof(struct stat_job));
+	for (s = dirp->current, pos = dirp->pos;
+	     pos < dirp->numentries && n < count;
+	     s = skip_string(s + 1, 1), pos++) {
+		if ((dirtype & aDIR) == 0 && (unsigned char) s[0] == DT_DIR) {
+			continue;
+		}
+		if (!mask_match(s + 1, mask, true)) {
+			continue;
+		}
+		dirp->prefetch[n++].name = s + 1;
+		len += strlen(s + 1) + 1;
+	}
+
+	/* the DOS attributes are read by path */
+	needslash = dirpath[strlen(dirpath) - 1] != '/';
+	len += n * (strlen(dirpath) + 1);
+	path = dirp->prefetch_paths = checked_malloc(MAX(len, 1));
+	for (i = 0; i < n; i++) {
+		dirp->prefetch[i].dirfd = dirp->fd;
+		dirp->prefetch[i].path = path;
+		path += snprintf(path, len - PTR_DIFF(path, dirp->prefetch_paths),
+		                 "%s%s%s", dirpath, needslash ? "/" : "",
+		                 dirp->prefetch[i].name) +
+		        1;
+	}
+
+	dirp->prefetch_count = n;
+	dirp->prefetch_next = 0;
+
+	if (!statpool_submit(dirp->prefetch, n)) {
+		dir_prefetch_end(p);
+	}
+}
+
+/*******************************************************************
+stop reading metadata in advance, and discard anything not yet used
+********************************************************************/
+void dir_prefetch_end(void *p)
+{
+	Dir *dirp = (Dir *) p;
+
+	if (!dirp || dirp->prefetch == NULL) {
+		return;
+	}
+
+	statpool_cancel(dirp->prefetch);
+	free(dirp->prefetch);
+	free(dirp->prefetch_paths);
+	dirp->prefetch = NULL;
+	dirp->prefetch_paths = NULL;
+	dirp->prefetch_count = dirp->prefetch_next = 0;
+}
+
 /*******************************************************************
 seek a dir
 ********************************************************************/
@@ -588,14 +896,11 @@ bool seek_dir(void *p, int pos)
 	if (!dirp)
 		return false;
 
-	if (pos < dirp->pos) {
-		dirp->current = dirp->data;
-		dirp->pos = 0;
+	dirp->pos = MAX(0, MIN(pos, dirp->numentries));
+	if (dirp->pos < dirp->numentries && !dirp->indexed) {
+		dirp->current = dirp->data + dirp->offsets[dirp->pos];
 	}
 
-	while (dirp->pos < pos && read_dir_name(p))
-		;
-
 	return dirp->pos == pos;
 }
 
@@ -618,79 +923,315 @@ int tell_dir(void *p)
  * -------------------------------------------------------------------------- **
  */
 
-typedef struct {
+typedef struct dir_cache_entry {
+	struct dir_cache_entry *hash_next;
+	struct dir_cache_entry *lru_prev, *lru_next;
+	uint32_t hash;
+	size_t size; /* allocated size, including strings */
 	char *path;
 	char *name;
-	char *dname;
+	char *dname; /* NULL if the name was not found */
 	const struct share *share;
+	struct dir_version version;
 } dir_cache_entry;
 
-static dir_cache_entry *dir_cache[DIRCACHESIZE];
-static int dir_cache_head = 0, dir_cache_tail = 0;
+static int dir_cache_size = DIR_CACHE_DEFAULT_SIZE;
+static int dir_cache_count = 0;
+static dir_cache_entry **dir_cache_hash = NULL;
+static unsigned int dir_cache_hash_mask = 0;
+/* lru_next of the head is the most recently used entry, lru_prev of the
+   head is the least recently used */
+static dir_cache_entry dir_cache_lru = {NULL, &dir_cache_lru, &dir_cache_lru};
+static struct dir_cache_stats dir_cache_stats;
 
 /* ------------------------------------------------------------------------ **
- * Add an entry to the directory cache.
+ * Set the maximum number of entries in the directory cache. Zero disables
+ * the cache. Must be called before the cache is first used.
  * ------------------------------------------------------------------------ **/
-void dir_cache_add(char *path, char *name, char *dname,
-                   const struct share *share)
+void dir_cache_set_size(int size)
+{
+	dir_cache_size = size;
+}
+
+/* ------------------------------------------------------------------------ **
+ * Get the directory cache hit, miss and eviction counts.
+ * ------------------------------------------------------------------------ **/
+void dir_cache_get_stats(struct dir_cache_stats *stats)
+{
+	*stats = dir_cache_stats;
+}
+
+static uint32_t dir_cache_hashfn(const char *path, const char *name,
+                                 const struct share *share)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t) (uintptr_t) share;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) path; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+	hash = (hash ^ '/') * 16777619u;
+	for (p = (const unsigned char *) name; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	return hash;
+}
+
+static void dir_cache_unlink(dir_cache_entry *entry)
+{
+	dir_cache_entry **e;
+
+	for (e = &dir_cache_hash[entry->hash & dir_cache_hash_mask];
+	     *e != entry; e = &(*e)->hash_next)
+		;
+	*e = entry->hash_next;
+
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+	--dir_cache_count;
+}
+
+static void dir_cache_link(dir_cache_entry *entry)
+{
+	dir_cache_entry **bucket =
+	    &dir_cache_hash[entry->hash & dir_cache_hash_mask];
+
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	entry->lru_prev = &dir_cache_lru;
+	entry->lru_next = dir_cache_lru.lru_next;
+	entry->lru_next->lru_prev = entry;
+	dir_cache_lru.lru_next = entry;
+	++dir_cache_count;
+}
+
+/* ------------------------------------------------------------------------ **
+ * Whether a cached entry for a directory that had version cached is still up
+ * to date, now that it has version now. If the directory is being watched,
+ * its generation counter is checked first, since that does not need a
+ * stat(); but it can change without the names in the directory changing,
+ * so the mtime is checked as well if it has been read.
+ * ------------------------------------------------------------------------ **/
+static bool dir_version_matches(const struct dir_version *cached,
+                                const struct dir_version *now)
+{
+	if (cached->watched && now->watched && cached->gen == now->gen) {
+		return true;
+	}
+
+	return cached->mtime.tv_nsec != -1 && now->mtime.tv_nsec != -1 &&
+	       cached->mtime.tv_sec == now->mtime.tv_sec &&
+	       cached->mtime.tv_nsec == now->mtime.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------ **
+ * Read the mtime of a directory into version. Returns false if it does not
+ * exist.
+ * ------------------------------------------------------------------------ **/
+static bool dir_version_stat(char *path, struct dir_version *version)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+
+	/* the mtime only has limited resolution. If the directory changed
+	   very recently, it may change again without the mtime changing,
+	   which would make an entry stale without us noticing. */
+	version->mtime = st.st_mtim;
+	if (st.st_mtim.tv_sec >= time(NULL) - 1) {
+		version->mtime.tv_nsec = -1;
+	}
+
+	return true;
+}
+
+/* ------------------------------------------------------------------------ **
+ * Add an entry to our own cache.
+ * ------------------------------------------------------------------------ **/
+static void dir_cache_insert(char *path, char *name, char *dname,
+                             const struct share *share,
+                             const struct dir_version *version)
 {
-	int pathlen, namelen, new_head;
-	dir_cache_entry *entry;
+	int pathlen, namelen, dnamelen;
+	dir_cache_entry *entry = NULL;
+	size_t size;
+
+	if (dir_cache_size <= 0)
+		return;
+
+	if (dir_cache_hash == NULL) {
+		unsigned int buckets = 16;
+		while (buckets < (unsigned int) dir_cache_size)
+			buckets *= 2;
+		dir_cache_hash =
+		    checked_calloc(buckets, sizeof(dir_cache_entry *));
+		dir_cache_hash_mask = buckets - 1;
+	}
+
+	pathlen = strlen(path) + 1;
+	namelen = strlen(name) + 1;
+	dnamelen = dname != NULL ? strlen(dname) + 1 : 0;
+	size = sizeof(dir_cache_entry) + pathlen + namelen + dnamelen;
+
+	/* Reuse the least recently used entry if the cache is full. */
+	if (dir_cache_count >= dir_cache_size) {
+		entry = dir_cache_lru.lru_prev;
+		dir_cache_unlink(entry);
+		++dir_cache_stats.evictions;
+		if (entry->size < size) {
+			entry = checked_realloc(entry, size);
+			entry->size = size;
+		}
+	} else {
+		entry = checked_malloc(size);
+		entry->size = size;
+	}
 
-	/* Allocate the structure & string space in one go so that it can be
-	 * freed in one call to free().
+	/* The strings are stored after the structure so that the entry can
+	 * be freed in one call to free().
 	 */
-	pathlen =
-	    strlen(path) + 1; /* Bytes required to store path (with nul). */
-	namelen =
-	    strlen(name) + 1; /* Bytes required to store name (with nul). */
-	entry = checked_malloc(sizeof(dir_cache_entry) + pathlen + namelen +
-	                       strlen(dname) + 1);
-
-	/* Set pointers correctly and load values. */
 	entry->path = pstrcpy((char *) &entry[1], path);
 	entry->name = pstrcpy(&(entry->path[pathlen]), name);
-	entry->dname = pstrcpy(&(entry->name[namelen]), dname);
+	entry->dname = NULL;
+	if (dname != NULL)
+		entry->dname = pstrcpy(&(entry->name[namelen]), dname);
 	entry->share = share;
+	entry->version = *version;
+	entry->hash = dir_cache_hashfn(path, name, share);
 
-	/* Add the new entry to the cache. Free up an entry if needed. */
-	new_head = (dir_cache_head + 1) % DIRCACHESIZE;
-	if (new_head == dir_cache_tail) {
-		free(dir_cache[dir_cache_tail]);
-		dir_cache_tail = (dir_cache_tail + 1) % DIRCACHESIZE;
-	}
-	dir_cache[new_head] = entry;
-	dir_cache_head = new_head;
-	DEBUG("Added dir cache entry %s %s -> %s\n", path, name, dname);
+	dir_cache_link(entry);
+	DEBUG("Added dir cache entry %s %s -> %s\n", path, name,
+	      dname != NULL ? dname : "(not found)");
 }
 
 /* ------------------------------------------------------------------------ **
- * Search for an entry to the directory cache.
- *
- *  Output: The dname string of the located entry, or NULL if the entry was
- *          not found.
+ * Add an entry to the directory cache, and to the cache shared with other
+ * processes. dname is the real name of the file in the directory, or NULL
+ * to record that no file matches name. version must have been filled in by
+ * dir_cache_check() before the directory was searched for the name.
+ * ------------------------------------------------------------------------ **/
+void dir_cache_add(char *path, char *name, char *dname,
+                   const struct share *share,
+                   const struct dir_version *version)
+{
+	/* version is not filled in when there is no cache */
+	if (dir_cache_size <= 0 && !metacache_enabled())
+		return;
+	/* there is no way of knowing if it changes */
+	if (!version->watched && version->mtime.tv_nsec == -1)
+		return;
+
+	metacache_put_name(path, name, share, version, dname);
+	dir_cache_insert(path, name, dname, share, version);
+}
+
+/* ------------------------------------------------------------------------ **
+ * Move an entry to the front of the LRU list.
+ * ------------------------------------------------------------------------ **/
+static void dir_cache_touch(dir_cache_entry *entry)
+{
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+	entry->lru_prev = &dir_cache_lru;
+	entry->lru_next = dir_cache_lru.lru_next;
+	entry->lru_next->lru_prev = entry;
+	dir_cache_lru.lru_next = entry;
+}
+
+/* ------------------------------------------------------------------------ **
+ * Search for an entry in the directory cache, and then in the cache shared
+ * with other processes (see metacache.c); a hit in the shared cache is
+ * added to our own.
  *
- *  Notes:  This uses a linear search, which is is okay because of
- *          the small size of the cache.
+ *  Output: true if an entry was found, in which case *dname is set to the
+ *          real name of the file, or NULL if the cache recorded that no
+ *          file matches name. false if there is no valid entry, in which
+ *          case version is filled in, ready to pass to dir_cache_add(),
+ *          unless neither cache is enabled.
  * ------------------------------------------------------------------------ **
  */
-char *dir_cache_check(char *path, char *name, const struct share *share)
-{
-	dir_cache_entry *entry;
-	int idx;
-
-	for (idx = dir_cache_head; idx != dir_cache_tail;
-	     idx = (idx + DIRCACHESIZE - 1) % DIRCACHESIZE) {
-		entry = dir_cache[idx];
-		if (entry->share == share && 0 == strcmp(name, entry->name) &&
-		    0 == strcmp(path, entry->path)) {
-			DEBUG("Got dir cache hit on %s %s -> %s\n", path, name,
-			      entry->dname);
-			return entry->dname;
+bool dir_cache_check(char *path, char *name, const struct share *share,
+                     char **dname, struct dir_version *version)
+{
+	static pstring shared_dname;
+	struct dir_version shared_version;
+	dir_cache_entry *entry = NULL;
+	bool have_mtime = false;
+	uint32_t hash;
+
+	/* nothing to look in, and nothing to be added to */
+	if (dir_cache_size <= 0 && !metacache_enabled())
+		return false;
+
+	/* the generation must be read before looking up the entry, so that
+	   a change made while the directory is being searched for a missing
+	   name makes the entry stale */
+	version->watched = watch_generation(share, path, &version->gen);
+	version->mtime.tv_sec = 0;
+	version->mtime.tv_nsec = -1;
+
+	if (dir_cache_count > 0) {
+		hash = dir_cache_hashfn(path, name, share);
+		for (entry = dir_cache_hash[hash & dir_cache_hash_mask];
+		     entry != NULL; entry = entry->hash_next) {
+			if (entry->hash == hash && entry->share == share &&
+			    0 == strcmp(name, entry->name) &&
+			    0 == strcmp(path, entry->path)) {
+				break;
+			}
 		}
 	}
 
-	return NULL;
+	/* something in the directory changed, or it is not being watched;
+	   the entry is still good if the names in it have not changed */
+	if (entry != NULL && !dir_version_matches(&entry->version, version)) {
+		have_mtime = dir_version_stat(path, version);
+		if (have_mtime &&
+		    dir_version_matches(&entry->version, version)) {
+			entry->version = *version;
+		} else {
+			dir_cache_unlink(entry);
+			free(entry);
+			entry = NULL;
+		}
+	}
+
+	if (entry != NULL) {
+		dir_cache_touch(entry);
+
+		DEBUG("Got dir cache hit on %s %s -> %s\n", path, name,
+		      entry->dname != NULL ? entry->dname : "(not found)");
+		++dir_cache_stats.hits;
+		*dname = entry->dname;
+		return true;
+	}
+
+	if (metacache_get_name(path, name, share, &shared_version,
+	                       shared_dname, sizeof(shared_dname))) {
+		if (!have_mtime &&
+		    !dir_version_matches(&shared_version, version)) {
+			have_mtime = dir_version_stat(path, version);
+		}
+		if (dir_version_matches(&shared_version, version)) {
+			DEBUG("Got shared cache hit on %s %s -> %s\n", path,
+			      name, *shared_dname != '\0' ? shared_dname :
+			      "(not found)");
+			++dir_cache_stats.hits;
+			++dir_cache_stats.shared_hits;
+			*dname = *shared_dname != '\0' ? shared_dname : NULL;
+			dir_cache_insert(path, name, *dname, share, version);
+			return true;
+		}
+	}
+
+	/* dir_cache_add() needs the mtime if the generation cannot be used */
+	if (!version->watched && !have_mtime) {
+		dir_version_stat(path, version);
+	}
+	++dir_cache_stats.misses;
+	return false;
 }
 
 /* ------------------------------------------------------------------------ **
@@ -698,23 +1239,16 @@ char *dir_cache_check(char *path, char *name, const struct share *share)
  * ------------------------------------------------------------------------ **/
 void dir_cache_flush(const struct share *share)
 {
-	dir_cache_entry *entry;
-	int idx, new_tail = dir_cache_head;
-
-	for (idx = dir_cache_head; idx != dir_cache_tail;
-	     idx = (idx + DIRCACHESIZE - 1) % DIRCACHESIZE) {
-		entry = dir_cache[idx];
-		dir_cache[idx] = NULL;
+	dir_cache_entry *entry, *next;
 
+	for (entry = dir_cache_lru.lru_next; entry != &dir_cache_lru;
+	     entry = next) {
+		next = entry->lru_next;
 		if (entry->share == share) {
+			dir_cache_unlink(entry);
 			free(entry);
-		} else {
-			dir_cache[new_tail] = entry;
-			new_tail = (new_tail + DIRCACHESIZE - 1) % DIRCACHESIZE;
 		}
 	}
-
-	dir_cache_tail = new_tail;
 }
 
 /* -------------------------------------------------------------------------- **
@@ -16,7 +16,10 @@
 struct share;
 struct stat;
 
-void init_dptrs(void);
+void *dptr_table_new(void);
+void dptr_table_select(void *p);
+void dptr_table_free(void);
+int dptr_count(void);
 char *dptr_path(int key);
 char *dptr_wcard(int key);
 bool dptr_set_wcard(int key, char *wcard);
@@ -37,8 +40,39 @@ bool get_dir_entry(int cnum, char *mask, int dirtype, char *fname, int *size,
 void *open_dir(int cnum, char *name);
 void close_dir(void *p);
 char *read_dir_name(void *p);
+int dir_entry_type(char *dname);
+void dir_entry_name_83(void *p, char *dname, char *name,
+                       const struct share *share);
+int dir_entry_stat(void *p, char *dname, char *pathreal, struct stat *st);
+void dir_prefetch(void *p, char *dirpath, char *mask, int dirtype, int count);
+void dir_prefetch_end(void *p);
 bool seek_dir(void *p, int pos);
 int tell_dir(void *p);
-void dir_cache_add(char *path, char *name, char *dname, const struct share *);
-char *dir_cache_check(char *path, char *name, const struct share *);
+
+/* maximum number of entries whose metadata is read in advance */
+#define DIR_PREFETCH_MAX 512
+
+/* default and largest maximum number of entries in the directory cache */
+#define DIR_CACHE_DEFAULT_SIZE 1024
+#define DIR_CACHE_MAX_SIZE     1048576
+
+struct dir_cache_stats {
+	unsigned long hits, misses, evictions;
+	unsigned long shared_hits; /* hits found in the shared cache */
+};
+
+/* what a directory contained when an entry for it was cached; see
+   dir_cache_check() */
+struct dir_version {
+	bool watched; /* the directory is watched; gen is valid (see watch.c) */
+	uint32_t gen;
+	struct timespec mtime; /* tv_nsec is -1 if too recent to be trusted */
+};
+
+void dir_cache_set_size(int size);
+void dir_cache_get_stats(struct dir_cache_stats *stats);
+void dir_cache_add(char *path, char *name, char *dname, const struct share *,
+                   const struct dir_version *version);
+bool dir_cache_check(char *path, char *name, const struct share *,
+                     char **dname, struct dir_version *version);
 void dir_cache_flush(const struct share *);
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* DOS clients send names in the wrong case, or as mangled 8.3 names, so
+   most lookups miss the initial stat() in unix_convert() and have to search
+   the directory for a matching name. This module keeps an index of the
+   names in recently searched directories, hashed by case-folded name and
+   by mangled name, so that the search does not have to scan every entry.
+   An index is thrown away when the modification time of its directory
+   changes. */
+
+#include "dirindex.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "config.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "mangle.h"
+#include "smb.h"
+#include "strfunc.h"
+#include "util.h"
+
+/* number of directories to keep indexes for */
+#define DIRINDEX_MAX_DIRS 16
+
+/* the kinds of key in the index */
+#define KEY_NAME    0 /* name as it appears in directory listings */
+#define KEY_MANGLED 1 /* mangled 8.3 version of a long name */
+
+struct dirindex_key {
+	uint32_t hash;
+	int kind;
+	int entry;   /* index of the directory entry */
+	int key_ofs; /* offset of folded key in strings */
+};
+
+struct dirindex {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	/* true if the directory may have changed without its mtime
+	   changing, in which case the index must be rebuilt before use */
+	bool racy;
+	unsigned int last_used;
+
+	int *entries; /* offsets of directory entry names in strings */
+	int num_entries;
+	struct dirindex_key *keys;
+	int num_keys;
+	int *slots; /* open addressed hash table of key indexes, or -1 */
+	unsigned int num_slots;
+
+	char *strings;
+	int strings_len, strings_size;
+};
+
+static struct dirindex *indexes[DIRINDEX_MAX_DIRS];
+static unsigned int use_counter;
+
+/****************************************************************************
+fold a name to upper case and return a hash of the result
+****************************************************************************/
+static uint32_t fold_name(char *name)
+{
+	uint32_t hash = 2166136261u;
+	unsigned char *p;
+
+	for (p = (unsigned char *) name; *p; p++) {
+		*p = toupper(*p);
+		hash = (hash ^ *p) * 16777619u;
+	}
+
+	return hash;
+}
+
+/****************************************************************************
+copy a string into the index string space, returning its offset
+****************************************************************************/
+static int add_string(struct dirindex *idx, const char *s)
+{
+	int len = strlen(s) + 1;
+	int result = idx->strings_len;
+
+	if (idx->strings_len + len > idx->strings_size) {
+		idx->strings_size = MAX(idx->strings_size * 2,
+		                        idx->strings_len + len + 1024);
+		idx->strings = checked_realloc(idx->strings, idx->strings_size);
+	}
+	memcpy(idx->strings + result, s, len);
+	idx->strings_len += len;
+
+	return result;
+}
+
+/****************************************************************************
+add a key for the given directory entry; folds the key in place
+****************************************************************************/
+static void add_key(struct dirindex *idx, int *keys_size, char *key, int kind,
+                    int entry)
+{
+	struct dirindex_key *k;
+
+	if (idx->num_keys >= *keys_size) {
+		*keys_size = MAX(*keys_size * 2, 64);
+		idx->keys = checked_realloc(
+		    idx->keys, *keys_size * sizeof(struct dirindex_key));
+	}
+
+	k = &idx->keys[idx->num_keys++];
+	k->hash = fold_name(key);
+	k->kind = kind;
+	k->entry = entry;
+	k->key_ofs = add_string(idx, key);
+}
+
+/****************************************************************************
+find the first key of the given kind matching an already folded name.
+Returns the key index, or -1
+****************************************************************************/
+static int find_key(struct dirindex *idx, const char *folded, uint32_t hash,
+                    int kind)
+{
+	unsigned int mask = idx->num_slots - 1;
+	unsigned int i;
+
+	for (i = hash & mask; idx->slots[i] >= 0; i = (i + 1) & mask) {
+		struct dirindex_key *k = &idx->keys[idx->slots[i]];
+		if (k->hash == hash && k->kind == kind &&
+		    !strcmp(idx->strings + k->key_ofs, folded)) {
+			return idx->slots[i];
+		}
+	}
+
+	return -1;
+}
+
+/****************************************************************************
+build the hash table from the list of keys
+****************************************************************************/
+static void build_slots(struct dirindex *idx)
+{
+	unsigned int mask;
+	int i;
+
+	idx->num_slots = 16;
+	while (idx->num_slots < (unsigned int) idx->num_keys * 2) {
+		idx->num_slots *= 2;
+	}
+	mask = idx->num_slots - 1;
+	idx->slots = checked_malloc(idx->num_slots * sizeof(int));
+	memset(idx->slots, 0xff, idx->num_slots * sizeof(int));
+
+	for (i = 0; i < idx->num_keys; i++) {
+		struct dirindex_key *k = &idx->keys[i];
+		unsigned int j;
+
+		/* if more than one entry has the same key, a directory scan
+		   finds the first one, so that is the one we keep */
+		if (find_key(idx, idx->strings + k->key_ofs, k->hash,
+		             k->kind) >= 0) {
+			continue;
+		}
+
+		for (j = k->hash & mask; idx->slots[j] >= 0; j = (j + 1) & mask)
+			;
+		idx->slots[j] = i;
+	}
+}
+
+/****************************************************************************
+free a directory index
+****************************************************************************/
+static void free_index(struct dirindex *idx)
+{
+	if (idx == NULL) {
+		return;
+	}
+	free(idx->entries);
+	free(idx->keys);
+	free(idx->slots);
+	free(idx->strings);
+	free(idx);
+}
+
+/****************************************************************************
+read a directory and build an index of its contents
+****************************************************************************/
+static struct dirindex *build_index(char *path, struct stat *st,
+                                    const struct share *share)
+{
+	struct dirindex *idx;
+	struct dirent *de;
+	int entries_size = 0, keys_size = 0;
+	pstring name2;
+	DIR *d;
+
+	d = opendir(path);
+	if (d == NULL) {
+		return NULL;
+	}
+
+	idx = checked_calloc(1, sizeof(struct dirindex));
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->mtime = st->st_mtim;
+	/* the mtime only has limited resolution; if the directory changed
+	   very recently, it may change again without the mtime changing */
+	idx->racy = st->st_mtim.tv_sec >= time(NULL) - 1;
+
+	while ((de = readdir(d)) != NULL) {
+		int entry, len;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+
+		if (idx->num_entries >= entries_size) {
+			entries_size = MAX(entries_size * 2, 64);
+			idx->entries = checked_realloc(
+			    idx->entries, entries_size * sizeof(int));
+		}
+		entry = idx->num_entries++;
+		idx->entries[entry] = add_string(idx, de->d_name);
+
+		/* match the names that scan_directory() compares against */
+		pstrcpy(name2, de->d_name);
+		name_map_mangle(name2, false, share);
+		if (!is_8_3(name2, true)) {
+			pstring mangled;
+			pstrcpy(mangled, name2);
+			mangle_name_83(mangled, sizeof(pstring) - 1);
+			add_key(idx, &keys_size, mangled, KEY_MANGLED, entry);
+		}
+		add_key(idx, &keys_size, name2, KEY_NAME, entry);
+
+		/* "FOO." can be matched as "FOO" */
+		len = strlen(name2);
+		if (lp_strip_dot() && len > 1 && name2[len - 1] == '.') {
+			name2[len - 1] = 0;
+			add_key(idx, &keys_size, name2, KEY_NAME, entry);
+		}
+	}
+
+	closedir(d);
+
+	build_slots(idx);
+
+	DEBUG("indexed %s: %d entries, %d keys\n", path, idx->num_entries,
+	      idx->num_keys);
+
+	return idx;
+}
+
+/****************************************************************************
+get an up to date index for the given directory
+****************************************************************************/
+static struct dirindex *get_index(char *path, const struct share *share)
+{
+	struct dirindex *idx;
+	struct stat st;
+	int i, slot = 0;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		return NULL;
+	}
+
+	for (i = 0; i < DIRINDEX_MAX_DIRS; i++) {
+		idx = indexes[i];
+		if (idx == NULL) {
+			slot = i;
+			continue;
+		}
+		if (idx->dev == st.st_dev && idx->ino == st.st_ino) {
+			if (!idx->racy &&
+			    idx->mtime.tv_sec == st.st_mtim.tv_sec &&
+			    idx->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+				idx->last_used = ++use_counter;
+				return idx;
+			}
+			slot = i;
+			break;
+		}
+		if (indexes[slot] != NULL &&
+		    idx->last_used < indexes[slot]->last_used) {
+			slot = i;
+		}
+	}
+
+	/* replace the stale or least recently used index */
+	free_index(indexes[slot]);
+	indexes[slot] = idx = build_index(path, &st, share);
+	if (idx != NULL) {
+		idx->last_used = ++use_counter;
+	}
+
+	return idx;
+}
+
+/****************************************************************************
+find the first directory entry matching an already folded name, or -1
+****************************************************************************/
+static int find_entry(struct dirindex *idx, char *folded, bool mangled)
+{
+	uint32_t hash = fold_name(folded);
+	int k1, k2;
+
+	k1 = find_key(idx, folded, hash, KEY_NAME);
+	k2 = mangled ? find_key(idx, folded, hash, KEY_MANGLED) : -1;
+
+	/* keys are in directory order; prefer the earlier entry */
+	if (k1 < 0 && k2 < 0) {
+		return -1;
+	} else if (k1 < 0 || (k2 >= 0 && k2 < k1)) {
+		return idx->keys[k2].entry;
+	} else {
+		return idx->keys[k1].entry;
+	}
+}
+
+/****************************************************************************
+look up a name in a directory, ignoring case. If the name could be a mangled
+name, mangled names of the directory entries are matched as well. If found,
+name is replaced with the real name of the entry and true is returned.
+****************************************************************************/
+bool dirindex_lookup(char *path, char *name, const struct share *share)
+{
+	struct dirindex *idx;
+	pstring folded;
+	int entry, len;
+
+	idx = get_index(path, share);
+	if (idx == NULL) {
+		return false;
+	}
+
+	pstrcpy(folded, name);
+	entry = find_entry(idx, folded, is_mangled(name));
+
+	/* "FOO." can match "FOO" */
+	len = strlen(folded);
+	if (entry < 0 && lp_strip_dot() && len > 1 && folded[len - 1] == '.') {
+		folded[len - 1] = 0;
+		entry = find_entry(idx, folded, false);
+	}
+
+	if (entry < 0) {
+		return false;
+	}
+
+	pstrcpy(name, idx->strings + idx->entries[entry]);
+	return true;
+}
@@ -9,20 +9,116 @@
  * FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+/* Byte range locks are kept in a table in memory shared by all the server
+   processes, which gives the semantics Windows clients expect: a lock
+   belongs to the file handle and client process id that took it, locks on
+   one handle are not lost when another handle to the same file is closed,
+   and locked ranges cannot be read or written through other handles.
+   Locks can also be mirrored as OFD locks, so that local processes using
+   fcntl() locks see them. If the table cannot be created, locks are taken
+   with fcntl() alone.
+
+   A process waiting for a lock to be released records the port of its
+   message socket (see message.c) against the file, and is sent a message
+   when ranges of the file are next unlocked. */
+
 #include "locking.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include "guards.h" /* IWYU pragma: keep */
+#include "message.h"
 #include "server.h"
 #include "smb.h"
 #include "util.h"
 
+/* fcntl command used to set and clear locks. POSIX locks belong to the
+   process, which is fine while every client has its own process but means
+   that clients served by the same process never conflict with each other;
+   OFD locks belong to the open file description instead. */
+static int setlk_cmd = F_SETLK;
+
+/* number of hash chains of locked files; must be a power of two */
+#define LOCK_HASH_SIZE 4096
+
+/* maximum number of locked files and locked ranges */
+#define LOCK_MAX_FILES  4096
+#define LOCK_MAX_RANGES 65536
+
+/* maximum number of processes waiting for locks on one file; any more have
+   to find out for themselves */
+#define LOCK_MAX_WAITERS 8
+
+/* A locked range. end is one past the last byte, so a zero length lock has
+   start == end. */
+struct lock_range {
+	uint64_t start, end;
+	uint32_t file_id;  /* the file handle it was taken through */
+	uint16_t lock_pid; /* client process id */
+	int type;          /* F_RDLCK or F_WRLCK */
+	int mirror_type;   /* type of the OFD lock, see map_lock_type() */
+	pid_t pid;         /* server process */
+	int fd;
+	int next; /* next range of the file by start, or in the free list */
+};
+
+struct locked_file {
+	dev_t dev;
+	ino_t ino;
+	int ranges; /* first range, or -1 */
+	int next;   /* next file in the hash chain or the free list, or -1 */
+	uint16_t waiters[LOCK_MAX_WAITERS]; /* message ports, or 0 */
+};
+
+struct lock_table {
+	pthread_mutex_t lock;
+	uint32_t last_file_id;
+	int free_files, free_ranges;
+	int chains[LOCK_HASH_SIZE];
+	/* number of ranges locked in the files of each chain; read without
+	   the lock so that reads and writes of files nobody has locked do
+	   not need it */
+	volatile unsigned int chain_ranges[LOCK_HASH_SIZE];
+	struct locked_file files[LOCK_MAX_FILES];
+	struct lock_range ranges[LOCK_MAX_RANGES];
+};
+
+static struct lock_table *table = NULL;
+
+/* if true, locks are also taken as OFD locks */
+static bool mirror_locks = false;
+
+/****************************************************************************
+ Use OFD locks instead of POSIX locks. Returns false if not supported.
+****************************************************************************/
+bool locking_use_ofd(void)
+{
+#ifdef F_OFD_SETLK
+	setlk_cmd = F_OFD_SETLK;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/****************************************************************************
+ Whether locks are taken with fcntl() alone, since there is no lock table
+****************************************************************************/
+bool locking_fcntl_only(void)
+{
+	return table == NULL;
+}
+
 static bool fcntl_lock(int fd, int op, uint32_t offset, uint32_t count,
                        int type)
 {
@@ -133,51 +229,742 @@ static int map_lock_type(struct open_file *fsp, int lock_type)
 }
 
 /****************************************************************************
- Utility function called by locking requests.
+ Create the shared lock table. Must be called before any server processes
+ are forked. If mirror is true, locks are also taken as OFD locks.
+****************************************************************************/
+bool locking_init(bool mirror)
+{
+	pthread_mutexattr_t attr;
+	int i;
+
+	if (mirror && !locking_use_ofd()) {
+		ERROR("locking_init: OFD locks not supported\n");
+		return false;
+	}
+	mirror_locks = mirror;
+
+	table = mmap(NULL, sizeof(struct lock_table), PROT_READ | PROT_WRITE,
+	             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		WARNING("locking_init: mmap: %s; using fcntl() locks\n",
+		        strerror(errno));
+		table = NULL;
+		return true;
+	}
+
+	/* see oplock_init() */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&table->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	for (i = 0; i < LOCK_HASH_SIZE; i++) {
+		table->chains[i] = -1;
+	}
+	for (i = 0; i < LOCK_MAX_FILES; i++) {
+		table->files[i].next = i + 1 < LOCK_MAX_FILES ? i + 1 : -1;
+	}
+	for (i = 0; i < LOCK_MAX_RANGES; i++) {
+		table->ranges[i].next = i + 1 < LOCK_MAX_RANGES ? i + 1 : -1;
+	}
+	table->free_files = 0;
+	table->free_ranges = 0;
+
+	return true;
+}
+
+static void lock_table(void)
+{
+	if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&table->lock);
+	}
+}
+
+static void unlock_table(void)
+{
+	pthread_mutex_unlock(&table->lock);
+}
+
+static unsigned int chain_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t) ino;
+
+	return (unsigned int) (h ^ (h >> 29)) & (LOCK_HASH_SIZE - 1);
+}
+
+static bool process_dead(pid_t pid)
+{
+	return pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/****************************************************************************
+ Find the entry for a file in the lock table, optionally creating it.
+ Returns -1 if not found or there is no room.
+****************************************************************************/
+static int find_file(dev_t dev, ino_t ino, bool create)
+{
+	unsigned int chain = chain_hash(dev, ino);
+	struct locked_file *f;
+	int i;
+
+	for (i = table->chains[chain]; i != -1; i = f->next) {
+		f = &table->files[i];
+		if (f->dev == dev && f->ino == ino) {
+			return i;
+		}
+	}
+
+	if (!create || table->free_files == -1) {
+		return -1;
+	}
+
+	i = table->free_files;
+	f = &table->files[i];
+	table->free_files = f->next;
+	f->dev = dev;
+	f->ino = ino;
+	f->ranges = -1;
+	memset(f->waiters, 0, sizeof(f->waiters));
+	f->next = table->chains[chain];
+	table->chains[chain] = i;
+
+	return i;
+}
+
+/****************************************************************************
+ Free the entry for a file once it has no locks left
+****************************************************************************/
+static void release_file_if_unused(int file)
+{
+	struct locked_file *f = &table->files[file];
+	int *link = &table->chains[chain_hash(f->dev, f->ino)];
+
+	if (f->ranges != -1) {
+		return;
+	}
+
+	while (*link != file) {
+		link = &table->files[*link].next;
+	}
+	*link = f->next;
+	f->next = table->free_files;
+	table->free_files = file;
+}
+
+/****************************************************************************
+ Take the range that *link points to out of its file's list, without
+ freeing it
+****************************************************************************/
+static int unlink_range(struct locked_file *f, int *link)
+{
+	int i = *link;
+
+	*link = table->ranges[i].next;
+	--table->chain_ranges[chain_hash(f->dev, f->ino)];
+
+	return i;
+}
+
+/****************************************************************************
+ Put a range in its file's list, after any others with the same start so
+ that stacked locks are unlocked in the order they were taken
+****************************************************************************/
+static void link_range(struct locked_file *f, int i)
+{
+	struct lock_range *r = &table->ranges[i];
+	int *link = &f->ranges;
+
+	while (*link != -1 && table->ranges[*link].start <= r->start) {
+		link = &table->ranges[*link].next;
+	}
+	r->next = *link;
+	*link = i;
+	++table->chain_ranges[chain_hash(f->dev, f->ino)];
+}
+
+static void free_range(int i)
+{
+	table->ranges[i].next = table->free_ranges;
+	table->free_ranges = i;
+}
+
+/****************************************************************************
+ Remove the range that *link points to
+****************************************************************************/
+static void remove_range(struct locked_file *f, int *link)
+{
+	free_range(unlink_range(f, link));
+}
+
+/****************************************************************************
+ Remove the ranges left behind by server processes that have died, to make
+ room in a full table
+****************************************************************************/
+static void purge_dead(void)
+{
+	struct locked_file *f;
+	int i, file, next, *link;
+
+	for (i = 0; i < LOCK_HASH_SIZE; i++) {
+		for (next = table->chains[i]; next != -1;) {
+			file = next;
+			f = &table->files[file];
+			next = f->next;
+			link = &f->ranges;
+			while (*link != -1) {
+				if (process_dead(table->ranges[*link].pid)) {
+					remove_range(f, link);
+				} else {
+					link = &table->ranges[*link].next;
+				}
+			}
+			release_file_if_unused(file);
+		}
+	}
+}
+
+static bool same_owner(struct lock_range *r, uint32_t file_id,
+                       uint16_t lock_pid)
+{
+	return r->file_id == file_id && r->lock_pid == lock_pid;
+}
+
+/****************************************************************************
+ Whether an existing lock stops a new one being taken. Read locks can
+ overlap, and the owner of a write lock can take read locks inside it.
+****************************************************************************/
+static bool lock_conflicts(struct lock_range *r, int lock_type,
+                           uint32_t file_id, uint16_t lock_pid)
+{
+	if (r->type == F_RDLCK && lock_type == F_RDLCK) {
+		return false;
+	}
+	return !(r->type == F_WRLCK && lock_type == F_RDLCK &&
+	         same_owner(r, file_id, lock_pid));
+}
+
+/****************************************************************************
+ Whether an existing lock stops a read (F_RDLCK) or write (F_WRLCK). The
+ owner of a lock can read and write the range, but nobody can write to a
+ range with a read lock.
+****************************************************************************/
+static bool io_conflicts(struct lock_range *r, int lock_type,
+                         uint32_t file_id, uint16_t lock_pid)
+{
+	if (r->type == F_RDLCK && lock_type == F_RDLCK) {
+		return false;
+	}
+	if (r->type == F_RDLCK && lock_type == F_WRLCK) {
+		return true;
+	}
+	return !same_owner(r, file_id, lock_pid);
+}
+
+/****************************************************************************
+ Look for a lock on a file that conflicts with the given range. Ranges are
+ kept in order of their start, so the search stops at the end of the
+ range. A zero length range only overlaps ranges strictly around it.
+****************************************************************************/
+static bool find_conflict(struct locked_file *f, uint64_t start, uint64_t end,
+                          int lock_type, uint32_t file_id, uint16_t lock_pid,
+                          bool io)
+{
+	int *link = &f->ranges;
+	struct lock_range *r;
+	bool conflict;
+
+	while (*link != -1) {
+		r = &table->ranges[*link];
+		if (r->start >= end) {
+			break;
+		}
+		if (io) {
+			conflict = io_conflicts(r, lock_type, file_id,
+			                        lock_pid);
+		} else {
+			conflict = lock_conflicts(r, lock_type, file_id,
+			                          lock_pid);
+		}
+		if (start >= r->end || !conflict) {
+			link = &r->next;
+		} else if (process_dead(r->pid)) {
+			remove_range(f, link);
+		} else {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/****************************************************************************
+ Take OFD locks again for the ranges held through an fd that overlap a
+ range just unlocked, since unlocking clears the whole range. Read locks
+ go first so that they do not replace parts of overlapping write locks.
+****************************************************************************/
+static void mirror_restore(struct locked_file *f, int fd, uint64_t start,
+                           uint64_t end)
+{
+	static const int types[] = {F_RDLCK, F_WRLCK};
+	struct lock_range *r;
+	pid_t pid = getpid();
+	int i, t;
+
+	for (t = 0; t < 2; t++) {
+		for (i = f->ranges; i != -1; i = r->next) {
+			r = &table->ranges[i];
+			if (r->start >= end) {
+				break;
+			}
+			if (r->pid == pid && r->fd == fd && r->start < r->end &&
+			    start < r->end && r->mirror_type == types[t]) {
+				fcntl_lock(fd, F_OFD_SETLK, r->start,
+				           r->end - r->start, r->mirror_type);
+			}
+		}
+	}
+}
+
+/****************************************************************************
+ Record that this process is waiting for locks on a file to be released
+****************************************************************************/
+static void add_waiter(struct locked_file *f)
+{
+	uint16_t port = message_port();
+	int i, slot = -1;
+
+	for (i = 0; port != 0 && i < LOCK_MAX_WAITERS; i++) {
+		if (f->waiters[i] == port) {
+			return;
+		}
+		if (f->waiters[i] == 0 && slot == -1) {
+			slot = i;
+		}
+	}
+	if (slot != -1) {
+		f->waiters[slot] = port;
+	}
+}
+
+/****************************************************************************
+ Take the list of processes waiting for locks on a file, which are woken
+ with wake_waiters() once the table is unlocked
+****************************************************************************/
+static void take_waiters(struct locked_file *f, uint16_t *waiters)
+{
+	memcpy(waiters, f->waiters, sizeof(f->waiters));
+	memset(f->waiters, 0, sizeof(f->waiters));
+}
+
+static void wake_waiters(uint16_t *waiters, dev_t dev, ino_t ino)
+{
+	int i;
+
+	for (i = 0; i < LOCK_MAX_WAITERS; i++) {
+		if (waiters[i] != 0) {
+			message_send(waiters[i], MSG_LOCK_WAKE, -1, dev, ino);
+		}
+	}
+}
+
+static uint32_t file_lock_id(struct open_file *fsp)
+{
+	if (fsp->lock_id == 0) {
+		if (++table->last_file_id == 0) {
+			++table->last_file_id;
+		}
+		fsp->lock_id = table->last_file_id;
+	}
+
+	return fsp->lock_id;
+}
+
+/****************************************************************************
+ Find the lock that an unlock removes. The range and owner must match
+ exactly; if a read and write lock are stacked, the write lock goes first.
+****************************************************************************/
+static int *find_lock(struct locked_file *f, uint64_t start, uint64_t end,
+                      uint32_t file_id, uint16_t lock_pid)
+{
+	struct lock_range *r;
+	int *link, *found = NULL;
+
+	for (link = &f->ranges; *link != -1; link = &r->next) {
+		r = &table->ranges[*link];
+		if (r->start > start) {
+			break;
+		}
+		if (r->start == start && r->end == end &&
+		    same_owner(r, file_id, lock_pid) &&
+		    (found == NULL || r->type == F_WRLCK)) {
+			found = link;
+			if (r->type == F_WRLCK) {
+				break;
+			}
+		}
+	}
+
+	return found;
+}
+
+static int *find_link(struct locked_file *f, int i)
+{
+	int *link = &f->ranges;
+
+	while (*link != i) {
+		link = &table->ranges[*link].next;
+	}
+
+	return link;
+}
+
+/****************************************************************************
+ Clear the OFD lock for a range that was unlocked, and take the locks again
+ for the ranges still held that overlap it
 ****************************************************************************/
+static void mirror_unlock(struct locked_file *f, int fd, struct lock_range *r)
+{
+	if (r->start < r->end) {
+		fcntl_lock(fd, F_OFD_SETLK, r->start, r->end - r->start,
+		           F_UNLCK);
+		mirror_restore(f, fd, r->start, r->end);
+	}
+}
 
-bool do_lock(int fnum, int cnum, uint32_t count, uint32_t offset, int lock_type,
-             int *eclass, uint32_t *ecode)
+/****************************************************************************
+ Apply the unlocks and then the locks of a request to the table, as one
+ transaction: if any of them fails, the table is left as it was.
+****************************************************************************/
+static bool table_locks(struct open_file *fsp, struct lock_spec *unlocks,
+                        int num_unlocks, struct lock_spec *locks,
+                        int num_locks, int lock_type, bool wait,
+                        uint32_t *ecode)
 {
+	uint16_t waiters[LOCK_MAX_WAITERS];
+	bool wake = false;
+	int fd = fsp->fd_ptr->fd;
+	int removed = -1, *added = NULL;
+	int num_added = 0, num_mirrored = 0;
+	struct lock_range *r;
+	struct locked_file *f;
+	uint64_t start, end;
+	uint32_t file_id;
+	int file, i, *link;
 	bool ok = false;
-	struct open_file *fsp = &Files[fnum];
 
-	if (count == 0) {
-		*eclass = ERRDOS;
-		*ecode = ERRnoaccess;
+	if (num_locks > 0) {
+		added = checked_malloc(num_locks * sizeof(int));
+	}
+
+	lock_table();
+	file_id = file_lock_id(fsp);
+
+	if (num_locks > 0 &&
+	    (table->free_ranges == -1 || table->free_files == -1)) {
+		purge_dead();
+	}
+	file = find_file(fsp->dev, fsp->ino, num_locks > 0);
+	if (file == -1) {
+		if (num_locks > 0) {
+			WARNING("lock table full\n");
+		} else {
+			*ecode = ERRnotlocked;
+		}
+		unlock_table();
+		free(added);
+		return num_locks == 0 && num_unlocks == 0;
+	}
+	f = &table->files[file];
+
+	/* unlocked ranges are kept on a list of their own until the locks
+	   have succeeded */
+	for (i = 0; i < num_unlocks; i++) {
+		start = unlocks[i].offset;
+		end = start + unlocks[i].count;
+		link = find_lock(f, start, end, file_id, unlocks[i].lock_pid);
+		if (link == NULL) {
+			DEBUG("no lock at offset %u count %u\n",
+			      unlocks[i].offset, unlocks[i].count);
+			*ecode = ERRnotlocked;
+			goto undo;
+		}
+		r = &table->ranges[unlink_range(f, link)];
+		r->next = removed;
+		removed = r - table->ranges;
+	}
+
+	/* each lock is added before the next is checked, since the ranges
+	   of one request can conflict with each other */
+	for (i = 0; i < num_locks; i++) {
+		start = locks[i].offset;
+		end = start + locks[i].count;
+		if (find_conflict(f, start, end, lock_type, file_id,
+		                  locks[i].lock_pid, false)) {
+			DEBUG("lock conflict at offset %u count %u\n",
+			      locks[i].offset, locks[i].count);
+			if (wait) {
+				add_waiter(f);
+			}
+			goto undo;
+		}
+		if (table->free_ranges == -1) {
+			WARNING("lock table full\n");
+			goto undo;
+		}
+		added[num_added] = table->free_ranges;
+		r = &table->ranges[table->free_ranges];
+		table->free_ranges = r->next;
+		r->start = start;
+		r->end = end;
+		r->file_id = file_id;
+		r->lock_pid = locks[i].lock_pid;
+		r->type = lock_type;
+		r->pid = getpid();
+		r->fd = fd;
+		r->mirror_type = map_lock_type(fsp, lock_type);
+		link_range(f, added[num_added]);
+		++num_added;
+	}
+
+	/* OFD locks go last, since a local process may hold a conflicting
+	   lock */
+	for (; mirror_locks && num_mirrored < num_added; num_mirrored++) {
+		r = &table->ranges[added[num_mirrored]];
+		if (r->start < r->end &&
+		    !fcntl_lock(fd, F_OFD_SETLK, r->start, r->end - r->start,
+		                r->mirror_type)) {
+			DEBUG("range is locked by a local process\n");
+			goto undo;
+		}
+		/* a read lock replaces an OFD write lock it is stacked on */
+		mirror_restore(f, fd, r->start, r->end);
+	}
+
+	if (removed != -1) {
+		take_waiters(f, waiters);
+		wake = true;
+	}
+	while (removed != -1) {
+		r = &table->ranges[removed];
+		removed = r->next;
+		free_range(r - table->ranges);
+		if (mirror_locks) {
+			mirror_unlock(f, fd, r);
+		}
+	}
+	ok = true;
+	goto out;
+
+undo:
+	while (removed != -1) {
+		i = removed;
+		removed = table->ranges[i].next;
+		link_range(f, i);
+	}
+	/* in reverse, so the ranges not yet mirrored are gone before any
+	   OFD locks are taken again */
+	while (num_added > 0) {
+		r = &table->ranges[added[--num_added]];
+		remove_range(f, find_link(f, r - table->ranges));
+		if (num_added < num_mirrored) {
+			mirror_unlock(f, fd, r);
+		}
+	}
+
+out:
+	release_file_if_unused(file);
+	unlock_table();
+	free(added);
+
+	if (wake) {
+		wake_waiters(waiters, fsp->dev, fsp->ino);
+	}
+
+	return ok;
+}
+
+/****************************************************************************
+ Apply the unlocks and then the locks of a request with fcntl(), for when
+ there is no lock table. If a lock fails, the locks already taken are
+ released again (X/Open spec).
+****************************************************************************/
+static bool fcntl_locks(struct open_file *fsp, struct lock_spec *unlocks,
+                        int num_unlocks, struct lock_spec *locks,
+                        int num_locks, int lock_type, uint32_t *ecode)
+{
+	int fd = fsp->fd_ptr->fd;
+	int i;
+
+	for (i = 0; i < num_unlocks; i++) {
+		if (!fcntl_lock(fd, setlk_cmd, unlocks[i].offset,
+		                unlocks[i].count, F_UNLCK)) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < num_locks; i++) {
+		/* fcntl() takes a zero count to mean the rest of the file */
+		if (locks[i].count == 0) {
+			*ecode = ERRnoaccess;
+			break;
+		}
+		if (!fcntl_lock(fd, setlk_cmd, locks[i].offset, locks[i].count,
+		                map_lock_type(fsp, lock_type))) {
+			break;
+		}
+	}
+
+	if (i < num_locks) {
+		while (--i >= 0) {
+			fcntl_lock(fd, setlk_cmd, locks[i].offset,
+			           locks[i].count, F_UNLCK);
+		}
 		return false;
 	}
 
-	if (OPEN_FNUM(fnum) && fsp->can_lock && (fsp->cnum == cnum))
-		ok = fcntl_lock(fsp->fd_ptr->fd, F_SETLK, offset, count,
-		                map_lock_type(fsp, lock_type));
+	return true;
+}
+
+/****************************************************************************
+ Unlock and then lock a set of ranges of a file, for a LockingX request.
+ All the locks are the same type. Either all of them succeed, or none of
+ them do, except that without the lock table a failed lock does not undo
+ the unlocks. If wait is true and a lock is held by another client, this
+ process is sent an MSG_LOCK_WAKE message when ranges of the file are next
+ unlocked.
+****************************************************************************/
+bool do_locks(int fnum, int cnum, struct lock_spec *unlocks, int num_unlocks,
+              struct lock_spec *locks, int num_locks, int lock_type,
+              bool wait, int *eclass, uint32_t *ecode)
+{
+	struct open_file *fsp = &Files[fnum];
+	bool ok = false;
+
+	*ecode = ERRlock;
+
+	if (OPEN_FNUM(fnum) && fsp->can_lock && (fsp->cnum == cnum)) {
+		if (table != NULL) {
+			ok = table_locks(fsp, unlocks, num_unlocks, locks,
+			                 num_locks, lock_type, wait, ecode);
+		} else {
+			ok = fcntl_locks(fsp, unlocks, num_unlocks, locks,
+			                 num_locks, lock_type, ecode);
+		}
+	}
 
 	if (!ok) {
 		*eclass = ERRDOS;
-		*ecode = ERRlock;
 		return false;
 	}
-	return true; /* Got lock */
+	if (num_locks > 0) {
+		fsp->fd_ptr->locked = true;
+	}
+	return true;
+}
+
+/****************************************************************************
+ Utility function called by locking requests.
+****************************************************************************/
+
+bool do_lock(int fnum, int cnum, uint16_t lock_pid, uint32_t count,
+             uint32_t offset, int lock_type, int *eclass, uint32_t *ecode)
+{
+	struct lock_spec lock = {lock_pid, offset, count};
+
+	return do_locks(fnum, cnum, NULL, 0, &lock, 1, lock_type, false,
+	                eclass, ecode);
 }
 
 /****************************************************************************
  Utility function called by unlocking requests.
 ****************************************************************************/
 
-bool do_unlock(int fnum, int cnum, uint32_t count, uint32_t offset, int *eclass,
-               uint32_t *ecode)
+bool do_unlock(int fnum, int cnum, uint16_t lock_pid, uint32_t count,
+               uint32_t offset, int *eclass, uint32_t *ecode)
 {
-	bool ok = false;
-	struct open_file *fsp = &Files[fnum];
+	struct lock_spec unlock = {lock_pid, offset, count};
 
-	if (OPEN_FNUM(fnum) && fsp->can_lock && (fsp->cnum == cnum))
-		ok = fcntl_lock(fsp->fd_ptr->fd, F_SETLK, offset, count,
-		                F_UNLCK);
+	return do_locks(fnum, cnum, &unlock, 1, NULL, 0, F_UNLCK, false,
+	                eclass, ecode);
+}
 
-	if (!ok) {
-		*eclass = ERRDOS;
-		*ecode = ERRlock;
+/****************************************************************************
+ Check whether a read (F_RDLCK) or write (F_WRLCK) of a range of a file is
+ blocked by a lock held by another client, file handle or client process.
+****************************************************************************/
+bool is_locked(int fnum, uint16_t lock_pid, uint32_t count, uint32_t offset,
+               int lock_type)
+{
+	struct open_file *fsp = &Files[fnum];
+	uint64_t start = offset, end = start + count;
+	bool locked = false;
+	int file;
+
+	/* without the table, locks are advisory */
+	if (table == NULL || count == 0 ||
+	    table->chain_ranges[chain_hash(fsp->dev, fsp->ino)] == 0) {
 		return false;
 	}
-	return true; /* Did unlock */
+
+	lock_table();
+	file = find_file(fsp->dev, fsp->ino, false);
+	if (file != -1) {
+		locked = find_conflict(&table->files[file], start, end,
+		                       lock_type, fsp->lock_id, lock_pid, true);
+		release_file_if_unused(file);
+	}
+	unlock_table();
+
+	return locked;
+}
+
+/****************************************************************************
+ Remove all the locks held through a file handle, which is being closed
+****************************************************************************/
+void release_file_locks(int fnum)
+{
+	struct open_file *fsp = &Files[fnum];
+	uint16_t waiters[LOCK_MAX_WAITERS];
+	struct locked_file *f;
+	bool removed = false;
+	int file, *link;
+
+	if (table == NULL || fsp->lock_id == 0) {
+		return;
+	}
+
+	lock_table();
+	file = find_file(fsp->dev, fsp->ino, false);
+	if (file == -1) {
+		unlock_table();
+		return;
+	}
+	f = &table->files[file];
+
+	link = &f->ranges;
+	while (*link != -1) {
+		if (table->ranges[*link].file_id == fsp->lock_id) {
+			remove_range(f, link);
+			removed = true;
+		} else {
+			link = &table->ranges[*link].next;
+		}
+	}
+
+	/* the fd may be shared with other handles to the same file */
+	if (removed && mirror_locks) {
+		fcntl_lock(fsp->fd_ptr->fd, F_OFD_SETLK, 0, 0, F_UNLCK);
+		mirror_restore(f, fsp->fd_ptr->fd, 0, UINT64_MAX);
+	}
+	if (removed) {
+		take_waiters(f, waiters);
+	}
+	release_file_if_unused(file);
+	unlock_table();
+
+	if (removed) {
+		wake_waiters(waiters, fsp->dev, fsp->ino);
+	}
 }
@@ -12,8 +12,23 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-bool do_lock(int fnum, int cnum, uint32_t count, uint32_t offset, int lock_type,
-             int *eclass, uint32_t *ecode);
-bool do_unlock(int fnum, int cnum, uint32_t count, uint32_t offset, int *eclass,
-               uint32_t *ecode);
+/* a range to lock or unlock */
+struct lock_spec {
+	uint16_t lock_pid; /* client process id */
+	uint32_t offset, count;
+};
+
+bool locking_init(bool mirror);
+bool do_locks(int fnum, int cnum, struct lock_spec *unlocks, int num_unlocks,
+              struct lock_spec *locks, int num_locks, int lock_type,
+              bool wait, int *eclass, uint32_t *ecode);
+bool do_lock(int fnum, int cnum, uint16_t lock_pid, uint32_t count,
+             uint32_t offset, int lock_type, int *eclass, uint32_t *ecode);
+bool do_unlock(int fnum, int cnum, uint16_t lock_pid, uint32_t count,
+               uint32_t offset, int *eclass, uint32_t *ecode);
+bool is_locked(int fnum, uint16_t lock_pid, uint32_t count, uint32_t offset,
+               int lock_type);
+void release_file_locks(int fnum);
 bool locking_end(void);
+bool locking_use_ofd(void);
+bool locking_fcntl_only(void);
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Server processes send each other messages over loopback UDP sockets, to
+   ask for an oplock to be broken or to say that something another process
+   is waiting for has happened. A process creates its socket the first time
+   it needs one, and records the port in the shared tables of open files and
+   locks for the others to find. */
+
+#include "message.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "blocking.h"
+#include "oplock.h"
+#include "util.h"
+
+/* the socket this process receives messages on */
+static int msg_socket = -1;
+static uint16_t msg_port;
+static pid_t msg_pid;
+
+/****************************************************************************
+the socket this process receives messages on, or -1
+****************************************************************************/
+int message_socket(void)
+{
+	return msg_pid == getpid() ? msg_socket : -1;
+}
+
+/****************************************************************************
+get the port of the socket for this process, creating it if needed.
+Returns 0 on failure.
+****************************************************************************/
+uint16_t message_port(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int fd;
+
+	if (msg_pid == getpid()) {
+		return msg_port;
+	}
+
+	/* a socket inherited from the parent is not ours */
+	if (msg_socket != -1) {
+		close(msg_socket);
+		msg_socket = -1;
+	}
+	msg_pid = getpid();
+	msg_port = 0;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		ERROR("message socket: %s\n", strerror(errno));
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	    getsockname(fd, (struct sockaddr *) &addr, &addr_len) != 0) {
+		ERROR("message socket: %s\n", strerror(errno));
+		close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	msg_socket = fd;
+	msg_port = ntohs(addr.sin_port);
+
+	return msg_port;
+}
+
+/****************************************************************************
+send a message to the process with the socket on the given port
+****************************************************************************/
+void message_send(uint16_t port, int type, int fnum, dev_t dev, ino_t ino)
+{
+	struct message msg;
+	struct sockaddr_in addr;
+
+	if (message_port() == 0) {
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.fnum = fnum;
+	msg.dev = dev;
+	msg.ino = ino;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (sendto(msg_socket, &msg, sizeof(msg), 0, (struct sockaddr *) &addr,
+	           sizeof(addr)) < 0) {
+		DEBUG("sendto port %d: %s\n", port, strerror(errno));
+	}
+}
+
+/****************************************************************************
+handle a message waiting on the socket
+****************************************************************************/
+void message_receive(void)
+{
+	struct message msg;
+
+	if (recv(msg_socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
+		return;
+	}
+
+	switch (msg.type) {
+	case MSG_OPLOCK_BREAK:
+		oplock_message(&msg);
+		break;
+	case MSG_LOCK_WAKE:
+		blocking_lock_wake();
+		break;
+	default:
+		/* only sent to wake the process up */
+		break;
+	}
+}
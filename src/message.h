@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* message types */
+#define MSG_OPLOCK_BREAK 1 /* break the oplock on a file */
+#define MSG_OPLOCK_WAKE  2 /* an oplock being waited for was released */
+#define MSG_LOCK_WAKE    3 /* locks on a file being waited for were released */
+
+struct message {
+	uint32_t type;
+	uint32_t fnum;
+	uint64_t dev, ino;
+};
+
+int message_socket(void);
+uint16_t message_port(void);
+void message_send(uint16_t port, int type, int fnum, dev_t dev, ino_t ino);
+void message_receive(void);
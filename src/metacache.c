@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Each server process has its own caches of the real names that the names
+   sent by clients resolve to (see dir.c) and of DOS attributes (see
+   server.c), which start out empty for every new client even though many
+   clients browse the same directories. This is a second level for both
+   caches, in memory shared by all the server processes, so that a lookup
+   made for one client is a cache hit for all of them.
+
+   The cache is a hash table with one entry per slot; an entry simply
+   replaces whatever was in its slot before. No locks are taken. Each entry
+   has a sequence number that is odd while the entry is being written.
+   A reader copies the entry and then checks that the sequence number was
+   even and did not change while it was copying, otherwise it counts as a
+   miss. A writer only writes an entry if it can change the sequence number
+   from even to odd, so a writer never waits either. Entries are checked
+   the same way as in the per-process caches: by the version of the
+   directory for names (see dir_cache_check()) and by the change time of
+   the file for DOS attributes. */
+
+#include "metacache.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dir.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "util.h"
+
+/* the kinds of entry */
+#define KIND_EMPTY  0
+#define KIND_NAME   1 /* real name of a file, or a name that was not found */
+#define KIND_ATTRIB 2 /* DOS attributes of a file */
+
+/* space for the key and value strings of an entry; makes an entry 256
+   bytes long */
+#define ENTRY_DATA_SIZE 216
+
+struct metacache_entry {
+	uint32_t seq; /* odd while the entry is being written */
+	uint32_t hash;
+	uint32_t gen;      /* KIND_NAME: generation of the directory */
+	int attrib;        /* KIND_ATTRIB */
+	uint16_t key_len;  /* bytes of data that are the key */
+	uint16_t name_len; /* KIND_NAME: bytes of data after the key */
+	uint8_t kind;
+	uint8_t found;     /* KIND_NAME: false if no file has the name */
+	uint8_t watched;   /* KIND_NAME: the directory was watched */
+	struct timespec time; /* directory mtime, or file ctime */
+	char data[ENTRY_DATA_SIZE];
+};
+
+static struct metacache_entry *entries = NULL;
+static unsigned int num_entries;
+
+/****************************************************************************
+create the shared cache with space for at least the given number of
+entries. Must be called before any server processes are forked.
+****************************************************************************/
+bool metacache_init(int size)
+{
+	size_t len;
+
+	for (num_entries = 16; num_entries < (unsigned int) size;
+	     num_entries *= 2)
+		;
+	len = num_entries * sizeof(struct metacache_entry);
+
+	entries = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (entries == MAP_FAILED) {
+		ERROR("metacache_init: mmap: %s\n", strerror(errno));
+		entries = NULL;
+		return false;
+	}
+
+	NOTICE("shared metadata cache of %u entries (%lu KiB)\n", num_entries,
+	       (unsigned long) (len / 1024));
+	return true;
+}
+
+/****************************************************************************
+whether there is a shared cache
+****************************************************************************/
+bool metacache_enabled(void)
+{
+	return entries != NULL;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len-- > 0) {
+		hash = (hash ^ *c++) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* A name key is the share, the directory path and the name. The share is
+   identified by its address, which is the same in every process since the
+   shares are all added before any processes are forked. */
+static int name_key(char *key, const char *path, const char *name,
+                    const void *share)
+{
+	size_t path_len = strlen(path) + 1, name_len = strlen(name) + 1;
+
+	if (sizeof(share) + path_len + name_len > ENTRY_DATA_SIZE) {
+		return -1;
+	}
+	memcpy(key, &share, sizeof(share));
+	memcpy(key + sizeof(share), path, path_len);
+	memcpy(key + sizeof(share) + path_len, name, name_len);
+
+	return sizeof(share) + path_len + name_len;
+}
+
+static int attrib_key(char *key, const struct stat *st)
+{
+	uint64_t ids[2] = {st->st_dev, st->st_ino};
+
+	memcpy(key, ids, sizeof(ids));
+
+	return sizeof(ids);
+}
+
+static struct metacache_entry *entry_slot(int kind, const char *key,
+                                          int key_len, uint32_t *hash)
+{
+	*hash = hash_bytes(2166136261u ^ kind, key, key_len);
+
+	return &entries[*hash & (num_entries - 1)];
+}
+
+/****************************************************************************
+copy the entry with the given key into *result. Returns false if there is
+none, or if it was being written at the time.
+****************************************************************************/
+static bool read_entry(int kind, const char *key, int key_len,
+                       struct metacache_entry *result)
+{
+	struct metacache_entry *e;
+	uint32_t hash, seq;
+
+	e = entry_slot(kind, key, key_len, &hash);
+
+	seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) != 0) {
+		return false;
+	}
+	memcpy(result, e, sizeof(*result));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+		return false;
+	}
+
+	return result->kind == kind && result->hash == hash &&
+	       result->key_len == key_len &&
+	       memcmp(result->data, key, key_len) == 0;
+}
+
+/****************************************************************************
+write an entry into its slot, unless another process is writing to the
+same slot at the time
+****************************************************************************/
+static void write_entry(struct metacache_entry *value)
+{
+	struct metacache_entry *e;
+	uint32_t hash, seq;
+
+	e = entry_slot(value->kind, value->data, value->key_len, &hash);
+
+	seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) != 0 ||
+	    !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, false,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	e->hash = hash;
+	e->kind = value->kind;
+	e->found = value->found;
+	e->watched = value->watched;
+	e->gen = value->gen;
+	e->key_len = value->key_len;
+	e->name_len = value->name_len;
+	e->attrib = value->attrib;
+	e->time = value->time;
+	memcpy(e->data, value->data, value->key_len + value->name_len);
+
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/****************************************************************************
+look up the real name of name in the directory path. Returns true if there
+is an entry, in which case dname is set to the real name, or to an empty
+string if no file has the name, and version to what the directory contained
+when the entry was added; the caller checks whether it is still up to date.
+****************************************************************************/
+bool metacache_get_name(const char *path, const char *name, const void *share,
+                        struct dir_version *version, char *dname,
+                        size_t dname_size)
+{
+	struct metacache_entry e;
+	char key[ENTRY_DATA_SIZE];
+	int key_len;
+
+	if (entries == NULL) {
+		return false;
+	}
+	key_len = name_key(key, path, name, share);
+	if (key_len < 0 || !read_entry(KIND_NAME, key, key_len, &e) ||
+	    e.name_len > dname_size) {
+		return false;
+	}
+
+	version->watched = e.watched;
+	version->gen = e.gen;
+	version->mtime = e.time;
+
+	if (!e.found) {
+		*dname = '\0';
+	} else {
+		memcpy(dname, e.data + key_len, e.name_len);
+		dname[e.name_len - 1] = '\0';
+	}
+
+	return true;
+}
+
+/****************************************************************************
+record the real name of name in the directory path, which had the given
+version; or that there is no such file if dname is NULL
+****************************************************************************/
+void metacache_put_name(const char *path, const char *name, const void *share,
+                        const struct dir_version *version, const char *dname)
+{
+	struct metacache_entry e;
+	size_t dname_len = dname != NULL ? strlen(dname) + 1 : 0;
+	int key_len;
+
+	if (entries == NULL) {
+		return;
+	}
+	key_len = name_key(e.data, path, name, share);
+	if (key_len < 0 || key_len + dname_len > ENTRY_DATA_SIZE) {
+		return;
+	}
+
+	e.kind = KIND_NAME;
+	e.key_len = key_len;
+	e.found = dname != NULL;
+	e.name_len = dname_len;
+	e.attrib = 0;
+	e.watched = version->watched;
+	e.gen = version->gen;
+	e.time = version->mtime;
+	if (dname != NULL) {
+		memcpy(e.data + e.key_len, dname, dname_len);
+	}
+
+	write_entry(&e);
+}
+
+/****************************************************************************
+look up the DOS attributes of the file with the given stat. Returns false
+if they are not known.
+****************************************************************************/
+bool metacache_get_attrib(const struct stat *st, int *attrib)
+{
+	struct metacache_entry e;
+	char key[ENTRY_DATA_SIZE];
+	int key_len;
+
+	if (entries == NULL) {
+		return false;
+	}
+	key_len = attrib_key(key, st);
+	if (!read_entry(KIND_ATTRIB, key, key_len, &e) ||
+	    e.time.tv_sec != st->st_ctim.tv_sec ||
+	    e.time.tv_nsec != st->st_ctim.tv_nsec) {
+		return false;
+	}
+
+	*attrib = e.attrib;
+	return true;
+}
+
+/****************************************************************************
+record the DOS attributes of the file with the given stat
+****************************************************************************/
+void metacache_put_attrib(const struct stat *st, int attrib)
+{
+	struct metacache_entry e;
+
+	if (entries == NULL) {
+		return;
+	}
+
+	e.kind = KIND_ATTRIB;
+	e.found = true;
+	e.watched = false;
+	e.gen = 0;
+	e.key_len = attrib_key(e.data, st);
+	e.name_len = 0;
+	e.attrib = attrib;
+	e.time = st->st_ctim;
+
+	write_entry(&e);
+}
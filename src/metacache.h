@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* most entries the cache can be asked for; 256 MiB */
+#define METACACHE_MAX_SIZE 1048576
+
+struct dir_version;
+struct stat;
+
+bool metacache_init(int size);
+bool metacache_enabled(void);
+bool metacache_get_name(const char *path, const char *name, const void *share,
+                        struct dir_version *version, char *dname,
+                        size_t dname_size);
+void metacache_put_name(const char *path, const char *name, const void *share,
+                        const struct dir_version *version, const char *dname);
+bool metacache_get_attrib(const struct stat *st, int *attrib);
+void metacache_put_attrib(const struct stat *st, int attrib);
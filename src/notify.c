@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Rather than listing a directory over and over to spot changes, a client
+   can ask to be told about them: TRANS2_FIND_NOTIFY_FIRST returns a handle
+   for a directory and a mask, and TRANS2_FIND_NOTIFY_NEXT returns the files
+   that have changed since, waiting up to a timeout for there to be some.
+   Each server process watches the directories its clients have handles for
+   with its own inotify(7) instance, and keeps the names of the files that
+   changed for each handle until the client asks for them. The instance
+   can't be the one watch.c has for the whole tree: each event is read only
+   once, by the watch thread in the main process, and it only records that
+   a directory changed, not which names changed.
+
+   A FIND_NOTIFY_NEXT request that finds no changes is kept with its handle,
+   and no reply is sent until there are changes or the timeout expires;
+   other requests from the client are served in the meantime. As with
+   blocking locks, this is not done in event mode, where requests are
+   always answered straight away. */
+
+#include "notify.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef linux
+#include <sys/inotify.h>
+#endif
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "smb.h"
+#include "strfunc.h"
+#include "system.h"
+#include "trans2.h"
+#include "util.h"
+
+/* a FIND_NOTIFY_NEXT timeout meaning to wait forever */
+#define WAIT_FOREVER 0xFFFFFFFF
+
+/* handles are numbered from here, as they were before they did anything */
+#define FIRST_HANDLE 257
+
+struct notify_table {
+	struct notify_handle *handles;
+	int next_handle;
+	struct notify_table *next;
+};
+
+/* all the tables, since an event for a directory may be for handles in any
+   of them when serving many clients in event mode */
+static struct notify_table *tables = NULL;
+static struct notify_table *current_table = NULL;
+
+/* set if requests can wait; not in event mode, where a process has no
+   way of being woken */
+static bool enabled = false;
+
+static int inotify_fd = -1;
+
+static long long now_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/****************************************************************************
+allow FIND_NOTIFY_NEXT requests to wait for changes
+****************************************************************************/
+void notify_init(void)
+{
+	enabled = true;
+}
+
+/****************************************************************************
+allocate the table of handles for a new session
+****************************************************************************/
+void *notify_table_new(void)
+{
+	struct notify_table *t = checked_calloc(1, sizeof(struct notify_table));
+
+	t->next_handle = FIRST_HANDLE;
+	t->next = tables;
+	tables = t;
+
+	return t;
+}
+
+/****************************************************************************
+make a session's table of handles the current one
+****************************************************************************/
+void notify_table_select(void *p)
+{
+	current_table = p;
+}
+
+static bool wd_in_use(int wd)
+{
+	struct notify_table *t;
+	struct notify_handle *h;
+
+	for (t = tables; t != NULL; t = t->next) {
+		for (h = t->handles; h != NULL; h = h->next) {
+			if (h->wd == wd) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void free_handle(struct notify_handle *h)
+{
+	int i;
+
+#ifdef linux
+	if (h->wd >= 0 && !wd_in_use(h->wd)) {
+		inotify_rm_watch(inotify_fd, h->wd);
+	}
+#endif
+	for (i = 0; i < h->num_names; i++) {
+		free(h->names[i]);
+	}
+	free(h->request);
+	free(h->path);
+	free(h->mask);
+	free(h);
+}
+
+/****************************************************************************
+free the current table of handles, without replying to waiting requests
+****************************************************************************/
+void notify_table_free(void)
+{
+	struct notify_table **p;
+	struct notify_handle *h;
+
+	if (current_table == NULL) {
+		return;
+	}
+
+	for (p = &tables; *p != current_table; p = &(*p)->next)
+		;
+	*p = current_table->next;
+
+	while ((h = current_table->handles) != NULL) {
+		current_table->handles = h->next;
+		free_handle(h);
+	}
+
+	free(current_table);
+	current_table = NULL;
+}
+
+#ifdef linux
+
+#define NOTIFY_MASK                                                            \
+	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |  \
+	 IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+static int add_watch(char *path)
+{
+	if (inotify_fd < 0) {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd < 0) {
+			WARNING("notify: inotify_init1: %s\n",
+			        strerror(errno));
+			return -1;
+		}
+	}
+
+	return inotify_add_watch(inotify_fd, path, NOTIFY_MASK);
+}
+
+#else
+
+static int add_watch(char *path)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
+
+/****************************************************************************
+start watching the directory path, relative to the connection, for changes
+to files that match mask. Returns the new handle, or -1 if the directory
+cannot be watched.
+****************************************************************************/
+int notify_open(int cnum, char *path, char *mask, uint16_t attr)
+{
+	struct notify_handle *h;
+	pstring fullpath;
+	int wd;
+
+	snprintf(fullpath, sizeof(fullpath), "%s/%s",
+	         Connections[cnum].connectpath, path);
+
+	wd = add_watch(fullpath);
+	if (wd < 0) {
+		DEBUG("can't watch %s: %s\n", fullpath, strerror(errno));
+		return -1;
+	}
+
+	h = checked_calloc(1, sizeof(struct notify_handle));
+	h->cnum = cnum;
+	h->path = checked_strdup(fullpath);
+	h->mask = checked_strdup(mask);
+	h->attr = attr;
+	h->wd = wd;
+
+	/* handles are 16 bits, and must not be reused while still open */
+	do {
+		h->handle = current_table->next_handle++;
+		if (current_table->next_handle > 0xFFFF) {
+			current_table->next_handle = FIRST_HANDLE;
+		}
+	} while (notify_find(h->handle, -1) != NULL);
+
+	h->next = current_table->handles;
+	current_table->handles = h;
+
+	DEBUG("handle %d watching %s for %s\n", h->handle, fullpath, mask);
+
+	return h->handle;
+}
+
+/****************************************************************************
+find an open handle on the given connection (or any, if cnum is -1)
+****************************************************************************/
+struct notify_handle *notify_find(int handle, int cnum)
+{
+	struct notify_handle *h;
+
+	if (current_table == NULL) {
+		return NULL;
+	}
+
+	for (h = current_table->handles; h != NULL; h = h->next) {
+		if (h->handle == handle && (cnum < 0 || h->cnum == cnum)) {
+			return h;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+forget the first n changes on a handle, once the client has been told
+about them. Changes whose names were not kept come last.
+****************************************************************************/
+void notify_consume(struct notify_handle *h, int n)
+{
+	int i, names = n < h->num_names ? n : h->num_names;
+
+	for (i = 0; i < names; i++) {
+		free(h->names[i]);
+	}
+	memmove(h->names, h->names + names,
+	        (h->num_names - names) * sizeof(char *));
+	h->num_names -= names;
+
+	h->num_lost -= n - names;
+	if (h->num_lost < 0) {
+		h->num_lost = 0;
+	}
+}
+
+static struct notify_handle *unlink_handle(struct notify_handle **p)
+{
+	struct notify_handle *h = *p;
+
+	*p = h->next;
+	h->next = NULL;
+
+	return h;
+}
+
+/****************************************************************************
+close a handle for SMBfindnclose, answering any request waiting on it.
+Returns false if there is no such handle.
+****************************************************************************/
+bool notify_close(int handle)
+{
+	struct notify_handle **p, *h;
+
+	if (current_table == NULL) {
+		return false;
+	}
+
+	for (p = &current_table->handles; *p != NULL; p = &(*p)->next) {
+		if ((*p)->handle == handle) {
+			break;
+		}
+	}
+	if (*p == NULL) {
+		return false;
+	}
+
+	h = unlink_handle(p);
+	if (h->request != NULL) {
+		send_find_notify_reply(h->request, h);
+	}
+	free_handle(h);
+
+	return true;
+}
+
+/****************************************************************************
+close all handles on a connection that is being closed
+****************************************************************************/
+void notify_closecnum(int cnum)
+{
+	struct notify_handle **p;
+
+	if (current_table == NULL) {
+		return;
+	}
+
+	p = &current_table->handles;
+	while (*p != NULL) {
+		if ((*p)->cnum == cnum) {
+			free_handle(unlink_handle(p));
+		} else {
+			p = &(*p)->next;
+		}
+	}
+}
+
+/****************************************************************************
+whether a FIND_NOTIFY_NEXT request that finds no changes can wait for some.
+Requests that are part of a chain are answered straight away.
+****************************************************************************/
+bool notify_wait_allowed(char *inbuf)
+{
+	return enabled && chain_size == 0;
+}
+
+/****************************************************************************
+keep a FIND_NOTIFY_NEXT request that found no changes, to be answered when
+there are some or it times out. A handle has at most one waiting request;
+if there is already one, it is answered now.
+****************************************************************************/
+void push_notify_request(char *inbuf, struct notify_handle *h,
+                         uint32_t timeout, int max_entries, int info_level,
+                         int max_data)
+{
+	int len = smb_len(inbuf) + 4;
+
+	if (h->request != NULL) {
+		send_find_notify_reply(h->request, h);
+		free(h->request);
+	}
+
+	h->request = checked_malloc(len);
+	memcpy(h->request, inbuf, len);
+	h->max_entries = max_entries;
+	h->info_level = info_level;
+	h->max_data = max_data;
+	if (timeout == WAIT_FOREVER) {
+		h->expires = -1;
+	} else {
+		h->expires = now_msecs() + timeout;
+	}
+
+	DEBUG("handle %d waiting for changes, timeout=%u\n", h->handle,
+	      timeout);
+}
+
+/****************************************************************************
+the inotify descriptor to wait on for changes, or -1
+****************************************************************************/
+int notify_fd(void)
+{
+	return inotify_fd;
+}
+
+static void add_change(struct notify_handle *h, const char *name)
+{
+	int i;
+
+	for (i = 0; i < h->num_names; i++) {
+		if (!strcmp(h->names[i], name)) {
+			return;
+		}
+	}
+
+	if (h->num_names < NOTIFY_MAX_NAMES) {
+		h->names[h->num_names++] = checked_strdup(name);
+	} else {
+		++h->num_lost;
+	}
+}
+
+#ifdef linux
+
+static void handle_event(struct inotify_event *ev)
+{
+	struct notify_table *t;
+	struct notify_handle *h;
+	pstring name;
+
+	for (t = tables; t != NULL; t = t->next) {
+		for (h = t->handles; h != NULL; h = h->next) {
+			if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+				/* events were lost */
+				++h->num_lost;
+				continue;
+			}
+			if (h->wd != ev->wd) {
+				continue;
+			}
+			if ((ev->mask & IN_IGNORED) != 0) {
+				/* the directory itself has gone */
+				h->wd = -1;
+				++h->num_lost;
+				continue;
+			}
+			if (ev->len == 0) {
+				continue;
+			}
+			pstrcpy(name, ev->name);
+			if (mask_match(name, h->mask, true)) {
+				add_change(h, ev->name);
+			}
+		}
+	}
+}
+
+/****************************************************************************
+read the pending inotify events, and record the changes for the handles
+watching the directories they are for
+****************************************************************************/
+void notify_receive(void)
+{
+	if (inotify_fd >= 0) {
+		sys_inotify_read(inotify_fd, handle_event);
+	}
+}
+
+#else
+
+void notify_receive(void)
+{
+}
+
+#endif
+
+/****************************************************************************
+how long to wait for a request from the client, in milli seconds, before a
+waiting request times out; at most timeout, unless it is zero (no timeout)
+****************************************************************************/
+int notify_wait(int timeout)
+{
+	struct notify_handle *h;
+	long long now, due;
+
+	if (current_table == NULL) {
+		return timeout;
+	}
+
+	now = now_msecs();
+	for (h = current_table->handles; h != NULL; h = h->next) {
+		if (h->request == NULL || h->expires < 0) {
+			continue;
+		}
+		due = h->expires - now;
+		if (due < 1) {
+			due = 1;
+		}
+		if (timeout <= 0 || due < timeout) {
+			timeout = due;
+		}
+	}
+
+	return timeout;
+}
+
+/****************************************************************************
+answer the waiting requests that now have changes to report, or have timed
+out
+****************************************************************************/
+void process_notify_requests(void)
+{
+	struct notify_handle *h;
+	long long now;
+
+	if (current_table == NULL) {
+		return;
+	}
+
+	now = now_msecs();
+	for (h = current_table->handles; h != NULL; h = h->next) {
+		if (h->request == NULL ||
+		    (h->num_names == 0 && h->num_lost == 0 &&
+		     (h->expires < 0 || now < h->expires))) {
+			continue;
+		}
+		DEBUG("answering notify request on handle %d\n", h->handle);
+		send_find_notify_reply(h->request, h);
+		free(h->request);
+		h->request = NULL;
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* most names of changed files kept for a handle until the client asks for
+   them; any more changes are only counted */
+#define NOTIFY_MAX_NAMES 64
+
+/* a TRANS2_FIND_NOTIFY_FIRST handle */
+struct notify_handle {
+	int handle;
+	int cnum;
+	char *path; /* full path of the directory being watched */
+	char *mask;
+	uint16_t attr;
+	int wd; /* inotify watch, or -1 if the directory went away */
+	char *names[NOTIFY_MAX_NAMES]; /* changed files, oldest first */
+	int num_names;
+	int num_lost; /* changes whose names were not kept */
+
+	/* a FIND_NOTIFY_NEXT request waiting for changes, or NULL */
+	char *request;
+	int max_entries, info_level, max_data;
+	long long expires; /* or -1 to wait forever */
+
+	struct notify_handle *next;
+};
+
+void notify_init(void);
+void *notify_table_new(void);
+void notify_table_select(void *p);
+void notify_table_free(void);
+int notify_open(int cnum, char *path, char *mask, uint16_t attr);
+struct notify_handle *notify_find(int handle, int cnum);
+void notify_consume(struct notify_handle *h, int n);
+bool notify_close(int handle);
+void notify_closecnum(int cnum);
+bool notify_wait_allowed(char *inbuf);
+void push_notify_request(char *inbuf, struct notify_handle *h,
+                         uint32_t timeout, int max_entries, int info_level,
+                         int max_data);
+int notify_fd(void);
+void notify_receive(void);
+int notify_wait(int timeout);
+void process_notify_requests(void);
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* An oplock lets a client cache a file it has open, and only send reads and
+   writes to the server once the cache needs to be written back. It is only
+   granted if the file is not open anywhere else, and must be broken before
+   the file is opened again, even by the same client. Each client is served
+   by its own process, so every open file is recorded in a table in memory
+   shared by all the server processes. A process that wants to open a file
+   held under an oplock by another process sends it a message (see
+   message.c); that process then sends an oplock break to its client, and
+   the opener waits until the client gives up the oplock, by releasing it or
+   by closing the file. If the oplock is held by the opener's own client,
+   the opener sends the break itself, and goes on processing the client's
+   requests while it waits. */
+
+#include "oplock.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "message.h"
+#include "server.h"
+#include "smb.h"
+#include "util.h"
+
+/* number of entries in the shared table; must be a power of two */
+#define OPLOCK_TABLE_SIZE 65536
+
+/* how often an oplock break message is sent again while waiting */
+#define OPLOCK_RETRY_MSECS 100
+
+/* An open file; kept in an open addressed hash table keyed by device and
+   inode, with no gaps between entries with the same hash */
+struct oplock_entry {
+	pid_t pid; /* 0 if the slot is empty */
+	int fnum;
+	int oplock;
+	uint16_t port;        /* where to send break messages */
+	uint16_t waiter_port; /* process to wake on release, or 0 */
+	dev_t dev;
+	ino_t ino;
+};
+
+struct oplock_table {
+	pthread_mutex_t lock;
+	/* set if the table ever filled up, in which case it no longer knows
+	   about every open file, so no more oplocks can be granted */
+	bool overflowed;
+	/* at least one slot is always kept empty, so that searches end */
+	unsigned int num_entries;
+	struct oplock_entry entries[OPLOCK_TABLE_SIZE];
+};
+
+static struct oplock_table *table = NULL;
+
+/****************************************************************************
+create the table of open files. Must be called before any server processes
+are forked.
+****************************************************************************/
+bool oplock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	table = mmap(NULL, sizeof(struct oplock_table), PROT_READ | PROT_WRITE,
+	             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		ERROR("oplock_init: mmap: %s\n", strerror(errno));
+		table = NULL;
+		return false;
+	}
+
+	/* robust, so that a process dying while it holds the lock does not
+	   hang the server; recursive, so that a signal that takes the server
+	   down while the lock is held can still close files */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&table->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return true;
+}
+
+static void lock_table(void)
+{
+	if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&table->lock);
+	}
+}
+
+static void unlock_table(void)
+{
+	pthread_mutex_unlock(&table->lock);
+}
+
+static unsigned int entry_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t) ino;
+
+	return (unsigned int) (h ^ (h >> 29)) & (OPLOCK_TABLE_SIZE - 1);
+}
+
+/****************************************************************************
+remove an entry, moving later entries back to fill the gap
+****************************************************************************/
+static void delete_entry(struct oplock_entry *e)
+{
+	unsigned int i = e - table->entries, j = i, k;
+
+	for (;;) {
+		j = (j + 1) & (OPLOCK_TABLE_SIZE - 1);
+		e = &table->entries[j];
+		if (e->pid == 0) {
+			break;
+		}
+		/* an entry can move back to i unless its hash is
+		   cyclically between i and j */
+		k = entry_hash(e->dev, e->ino);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		table->entries[i] = *e;
+		i = j;
+	}
+
+	table->entries[i].pid = 0;
+	--table->num_entries;
+}
+
+static bool process_dead(pid_t pid)
+{
+	return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/****************************************************************************
+remove all entries left behind by processes that have died
+****************************************************************************/
+static void purge_dead(void)
+{
+	unsigned int i = 0;
+	struct oplock_entry *e;
+
+	while (i < OPLOCK_TABLE_SIZE) {
+		e = &table->entries[i];
+		if (e->pid != 0 && process_dead(e->pid)) {
+			/* look at the entry moved into this slot */
+			delete_entry(e);
+			continue;
+		}
+		++i;
+	}
+}
+
+/****************************************************************************
+find an entry for a file opened by another process, or by this process as
+any fnum other than the given one. If oplocked is true, only an entry with
+an oplock is returned. Entries left behind by processes that have died are
+removed.
+****************************************************************************/
+static struct oplock_entry *find_holder(dev_t dev, ino_t ino, bool oplocked,
+                                        int fnum)
+{
+	unsigned int i = entry_hash(dev, ino);
+	pid_t pid = getpid();
+	struct oplock_entry *e;
+
+	for (;;) {
+		e = &table->entries[i];
+		if (e->pid == 0) {
+			return NULL;
+		}
+		if (e->dev == dev && e->ino == ino &&
+		    (e->pid != pid || e->fnum != fnum) &&
+		    (!oplocked || e->oplock != OPLOCK_NONE)) {
+			if (e->pid == pid || !process_dead(e->pid)) {
+				return e;
+			}
+			/* the next entry has moved into this slot */
+			delete_entry(e);
+			continue;
+		}
+		i = (i + 1) & (OPLOCK_TABLE_SIZE - 1);
+	}
+}
+
+/****************************************************************************
+find the entry for one of this process's files
+****************************************************************************/
+static struct oplock_entry *find_own(int fnum)
+{
+	struct open_file *fsp = &Files[fnum];
+	unsigned int i = entry_hash(fsp->dev, fsp->ino);
+	pid_t pid = getpid();
+	struct oplock_entry *e;
+
+	for (;; i = (i + 1) & (OPLOCK_TABLE_SIZE - 1)) {
+		e = &table->entries[i];
+		if (e->pid == 0) {
+			return NULL;
+		}
+		if (e->pid == pid && e->fnum == fnum && e->dev == fsp->dev &&
+		    e->ino == fsp->ino) {
+			return e;
+		}
+	}
+}
+
+/****************************************************************************
+send an oplock break to the client
+****************************************************************************/
+static void send_break(int fnum)
+{
+	char buf[smb_size + 8 * 2];
+
+	memset(buf, 0, sizeof(buf));
+	set_message(buf, 8, 0, true);
+	CVAL(buf, smb_com) = SMBlockingX;
+	SSVAL(buf, smb_tid, Files[fnum].cnum);
+	SSVAL(buf, smb_pid, 0xFFFF);
+	SSVAL(buf, smb_uid, 0);
+	SSVAL(buf, smb_mid, 0xFFFF);
+	CVAL(buf, smb_vwv0) = 0xFF;
+	SSVAL(buf, smb_vwv2, fnum);
+	CVAL(buf, smb_vwv3) = LOCKING_ANDX_OPLOCK_RELEASE;
+
+	DEBUG("sending oplock break for fnum=%d\n", fnum);
+	send_smb(Client, buf);
+}
+
+/****************************************************************************
+handle a message from another process asking for an oplock to be broken
+****************************************************************************/
+void oplock_message(struct message *msg)
+{
+	struct oplock_entry *e;
+	struct open_file *fsp;
+	bool need_break;
+
+	if (!OPEN_FNUM(msg->fnum)) {
+		return;
+	}
+
+	fsp = &Files[msg->fnum];
+	if (!fsp->in_oplock_table || fsp->dev != msg->dev ||
+	    fsp->ino != msg->ino || fsp->oplock_break_sent) {
+		return;
+	}
+
+	lock_table();
+	e = find_own(msg->fnum);
+	need_break = e != NULL && e->oplock != OPLOCK_NONE;
+	unlock_table();
+
+	if (need_break) {
+		fsp->oplock_break_sent = true;
+		send_break(msg->fnum);
+	}
+}
+
+/****************************************************************************
+break any oplocks held on a file, before opening it. Waits until the clients
+holding them have released them. That includes this process's own client,
+which may be opening a file it already has open under an oplock.
+****************************************************************************/
+void oplock_break_others(dev_t dev, ino_t ino)
+{
+	time_t deadline = time(NULL) + OPLOCK_BREAK_TIMEOUT;
+	struct oplock_entry *e;
+	uint16_t port;
+	int fnum;
+
+	if (table == NULL) {
+		return;
+	}
+
+	for (;;) {
+		lock_table();
+		e = find_holder(dev, ino, true, -1);
+		if (e == NULL) {
+			unlock_table();
+			return;
+		}
+		if (time(NULL) >= deadline) {
+			WARNING("process %ld did not release its oplock on "
+			        "fnum=%d\n",
+			        (long) e->pid, e->fnum);
+			e->oplock = OPLOCK_NONE;
+			unlock_table();
+			continue;
+		}
+		fnum = e->fnum;
+		if (e->pid == getpid()) {
+			unlock_table();
+			if (!Files[fnum].oplock_break_sent) {
+				Files[fnum].oplock_break_sent = true;
+				send_break(fnum);
+			}
+			wait_for_own_oplock_break(OPLOCK_RETRY_MSECS);
+			continue;
+		}
+		e->waiter_port = message_port();
+		port = e->port;
+		unlock_table();
+
+		/* sent again each time in case it was lost; the process
+		   only sends its client one break */
+		message_send(port, MSG_OPLOCK_BREAK, fnum, dev, ino);
+		wait_for_oplock_message(OPLOCK_RETRY_MSECS);
+	}
+}
+
+/****************************************************************************
+record that a file has been opened
+****************************************************************************/
+void oplock_add_file(int fnum)
+{
+	struct open_file *fsp = &Files[fnum];
+	struct oplock_entry *e;
+	unsigned int i;
+
+	if (table == NULL) {
+		return;
+	}
+
+	lock_table();
+	if (table->num_entries >= OPLOCK_TABLE_SIZE - 1) {
+		purge_dead();
+	}
+	if (table->num_entries < OPLOCK_TABLE_SIZE - 1) {
+		i = entry_hash(fsp->dev, fsp->ino);
+		while (table->entries[i].pid != 0) {
+			i = (i + 1) & (OPLOCK_TABLE_SIZE - 1);
+		}
+		e = &table->entries[i];
+		e->pid = getpid();
+		e->fnum = fnum;
+		e->oplock = OPLOCK_NONE;
+		e->port = 0;
+		e->waiter_port = 0;
+		e->dev = fsp->dev;
+		e->ino = fsp->ino;
+		++table->num_entries;
+		fsp->in_oplock_table = true;
+	} else if (!table->overflowed) {
+		WARNING("oplock table full; no more oplocks will be "
+		        "granted\n");
+		table->overflowed = true;
+	}
+	unlock_table();
+}
+
+/****************************************************************************
+give up the oplock held on a file, waking any process waiting for it
+****************************************************************************/
+static void release(int fnum, bool remove)
+{
+	struct open_file *fsp = &Files[fnum];
+	struct oplock_entry *e;
+	uint16_t waiter = 0;
+	int oplock = OPLOCK_NONE;
+
+	if (!fsp->in_oplock_table) {
+		return;
+	}
+
+	lock_table();
+	e = find_own(fnum);
+	if (e != NULL) {
+		oplock = e->oplock;
+		waiter = e->waiter_port;
+		e->oplock = OPLOCK_NONE;
+		e->waiter_port = 0;
+		if (remove) {
+			delete_entry(e);
+		}
+	}
+	unlock_table();
+
+	if (remove) {
+		fsp->in_oplock_table = false;
+	}
+	fsp->oplock_break_sent = false;
+
+	if (oplock != OPLOCK_NONE && waiter != 0) {
+		message_send(waiter, MSG_OPLOCK_WAKE, fnum, fsp->dev, fsp->ino);
+	}
+}
+
+/****************************************************************************
+record that a file has been closed
+****************************************************************************/
+void oplock_remove_file(int fnum)
+{
+	release(fnum, true);
+}
+
+/****************************************************************************
+the client has released its oplock on a file
+****************************************************************************/
+void oplock_release(int fnum)
+{
+	DEBUG("oplock released on fnum=%d\n", fnum);
+	release(fnum, false);
+}
+
+/****************************************************************************
+grant an oplock on a newly opened file if the client asked for one and the
+file is not open anywhere else, including as another fnum of this client.
+request is the oplock request from the open: EXCLUSIVE_OPLOCK, possibly
+with BATCH_OPLOCK. Returns true if an oplock was granted.
+****************************************************************************/
+bool oplock_grant(int fnum, int request)
+{
+	struct open_file *fsp = &Files[fnum];
+	struct oplock_entry *e;
+	bool granted = false;
+	uint16_t port;
+
+	/* breaks are sent as LockingX requests, which older clients do not
+	   understand */
+	if (!fsp->in_oplock_table || request == 0 ||
+	    Protocol < PROTOCOL_LANMAN1) {
+		return false;
+	}
+
+	port = message_port();
+	if (port == 0) {
+		return false;
+	}
+
+	lock_table();
+	if (!table->overflowed &&
+	    find_holder(fsp->dev, fsp->ino, false, fnum) == NULL) {
+		e = find_own(fnum);
+		if (e != NULL) {
+			e->oplock = (request & BATCH_OPLOCK) ? OPLOCK_BATCH
+			                                     : OPLOCK_EXCLUSIVE;
+			e->port = port;
+			granted = true;
+		}
+	}
+	unlock_table();
+
+	fsp->oplock_break_sent = false;
+	DEBUG("fnum=%d request=%d granted=%s\n", fnum, request,
+	      granted ? "yes" : "no");
+
+	return granted;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct message;
+
+/* oplock types */
+#define OPLOCK_NONE      0
+#define OPLOCK_EXCLUSIVE 1
+#define OPLOCK_BATCH     2
+
+/* seconds to wait for a client to release an oplock before giving up */
+#define OPLOCK_BREAK_TIMEOUT 30
+
+bool oplock_init(void);
+void oplock_message(struct message *msg);
+void oplock_break_others(dev_t dev, ino_t ino);
+void oplock_add_file(int fnum);
+void oplock_remove_file(int fnum);
+bool oplock_grant(int fnum, int request);
+void oplock_release(int fnum);
@@ -28,12 +28,14 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include "blocking.h"
 #include "byteorder.h"
 #include "config.h"
 #include "dir.h"
 #include "guards.h" /* IWYU pragma: keep */
 #include "locking.h"
 #include "mangle.h"
+#include "oplock.h"
 #include "server.h"
 #include "shares.h"
 #include "smb.h"
@@ -43,11 +45,15 @@
 #include "trans2.h"
 #include "util.h"
 #include "version.h"
+#include "watch.h"
 
 /* this macro should always be used to extract an fnum (smb_fid) from
 a packet to ensure chaining works correctly */
 #define GETFNUM(buf, where) (chain_fnum != -1 ? chain_fnum : SVAL(buf, where))
 
+/* size of the buffer used when copying files with SMBcopy */
+#define COPY_BUFSIZE (64 * 1024)
+
 /****************************************************************************
   reply to an special message
 ****************************************************************************/
@@ -298,7 +304,6 @@ int reply_sesssetup_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 	pstring smb_apasswd;
 	pstring smb_ntpasswd;
 	bool computer_id = false;
-	static bool done_sesssetup = false;
 
 	*smb_apasswd = 0;
 	*smb_ntpasswd = 0;
@@ -846,7 +851,7 @@ int reply_open(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -859,7 +864,7 @@ int reply_open(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -884,7 +889,10 @@ int reply_open(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	put_dos_date3(outbuf, smb_vwv2, mtime);
 	SIVAL(outbuf, smb_vwv4, size);
 	SSVAL(outbuf, smb_vwv6, rmode);
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+
+	if (oplock_grant(fnum, CORE_OPLOCK_REQUEST(inbuf))) {
+		CVAL(outbuf, smb_flg) |= CORE_OPLOCK_GRANTED;
+	}
 
 	return outsize;
 }
@@ -929,7 +937,7 @@ int reply_open_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -943,7 +951,7 @@ int reply_open_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -960,19 +968,9 @@ int reply_open_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 		return ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	/* The Samba version of this function had code to handle oplock
-	   requests. We don't support oplocks and just grant no oplock requests,
-	   which is compliant according to the CIFS draft spec:
-
-	   > Versions of the CIFS file sharing protocol including and newer
-	   > than the "LANMAN1.0" dialect support oplocks. (Note, however, that
-	   > an implementation, even of these later dialects, can implement
-	   > oplocks trivially by always refusing to grant them.)
-
-	   TODO: We can improve performance by granting a fake lock if the
-	   underlying filesystem is read-only (like a CD-ROM), or if we're
-	   feeling a bit bolder, if the file is read-only.
-	 */
+	if (oplock_grant(fnum, EXTENDED_OPLOCK_REQUEST(inbuf))) {
+		smb_action |= EXTENDED_OPLOCK_GRANTED;
+	}
 
 	set_message(outbuf, 15, 0, true);
 	SSVAL(outbuf, smb_vwv2, fnum);
@@ -1035,7 +1033,7 @@ int reply_mknew(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -1059,13 +1057,13 @@ int reply_mknew(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
 	outsize = set_message(outbuf, 1, 0, true);
 	SSVAL(outbuf, smb_vwv0, fnum);
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+	/* no oplock is granted on a newly created file */
 
 	DEBUG("new file %s\n", fname);
 	DEBUG("fname=%s fd=%d fnum=%d cnum=%d dmode=%d\n", fname,
@@ -1103,7 +1101,7 @@ int reply_ctemp(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -1121,7 +1119,7 @@ int reply_ctemp(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -1130,7 +1128,7 @@ int reply_ctemp(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	CVAL(smb_buf(outbuf), 0) = 4;
 	pstrcpy(smb_buf(outbuf) + 1, fname2);
 
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+	/* no oplock is granted on a newly created file */
 
 	DEBUG("created temp file %s\n", fname2);
 	DEBUG("fname=%s fd=%d fnum=%d cnum=%d dmode=%d\n", fname2,
@@ -1204,8 +1202,11 @@ int reply_unlink(char *inbuf, char *outbuf, int dum_size, int dum_bufsize)
 	if (!has_wild) {
 		pstrcat(directory, "/");
 		pstrcat(directory, mask);
-		if (can_delete(directory, cnum, dirtype) && !unlink(directory))
+		if (can_delete(directory, cnum, dirtype) &&
+		    !unlink(directory)) {
+			watch_changed(CONN_SHARE(cnum), directory);
 			count++;
+		}
 		if (!count)
 			exists = file_exist(directory, NULL);
 	} else {
@@ -1239,8 +1240,10 @@ int reply_unlink(char *inbuf, char *outbuf, int dum_size, int dum_bufsize)
 				         directory, dname);
 				if (!can_delete(fname, cnum, dirtype))
 					continue;
-				if (!unlink(fname))
+				if (!unlink(fname)) {
+					watch_changed(CONN_SHARE(cnum), fname);
 					count++;
+				}
 				DEBUG("doing unlink on %s\n", fname);
 			}
 			close_dir(dirptr);
@@ -1267,12 +1270,11 @@ int reply_unlink(char *inbuf, char *outbuf, int dum_size, int dum_bufsize)
 /****************************************************************************
 transfer some data between two fd's
 ****************************************************************************/
-static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
-                         int align)
+static int transfer_file(int infd, int outfd, int n, char *header, int headlen)
 {
 	static char *buf = NULL;
 	static int size = 0;
-	char *buf1, *abuf;
+	char *buf1;
 	int total = 0;
 
 	DEBUG("n=%d (head=%d)\n", n, headlen);
@@ -1283,7 +1285,7 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 	}
 
 	while (!buf && size > 0) {
-		buf = (char *) checked_realloc(buf, size + 8);
+		buf = (char *) checked_realloc(buf, size);
 		if (!buf)
 			size /= 2;
 	}
@@ -1293,8 +1295,6 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 		exit(1);
 	}
 
-	abuf = buf + (align % 8);
-
 	if (header)
 		n += headlen;
 
@@ -1311,7 +1311,7 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 			headlen = 0;
 			header = NULL;
 		} else {
-			buf1 = abuf;
+			buf1 = buf;
 		}
 
 		if (header && headlen > 0) {
@@ -1334,7 +1334,7 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 			/* if we can't write then dump excess data */
 			if (ret2 != ret)
 				transfer_file(infd, -1, n - (ret + headlen),
-				              NULL, 0, 0);
+				              NULL, 0);
 		}
 		if (ret <= 0 || ret2 != ret)
 			return total;
@@ -1343,6 +1343,41 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 	return total;
 }
 
+/****************************************************************************
+  send a reply header followed by n bytes of a file, starting at pos. The
+  length of the reply is already in the header, so if the file turns out to
+  be shorter than expected the remainder is padded with zeros
+****************************************************************************/
+static void send_file_data(int fnum, char *header, int hdr_len, uint32_t pos,
+                           int n)
+{
+	static char zeros[1024];
+	ssize_t ret;
+
+	ret = sys_sendfile(Client, Files[fnum].fd_ptr->fd, header, hdr_len,
+	                   pos, n);
+	if (ret < 0) {
+		ERROR("Error sending %d bytes of %s to client: %s\n", n,
+		      Files[fnum].name, strerror(errno));
+		exit_server("error writing to client");
+	}
+	count_request_bytes(0, hdr_len + n);
+
+	Files[fnum].pos = pos + ret;
+
+	if (ret < n) {
+		DEBUG("short read of %s at %u: %d < %d\n", Files[fnum].name,
+		      pos, (int) ret, n);
+	}
+	while (ret < n) {
+		int len = MIN(n - ret, sizeof(zeros));
+		if (write_data(Client, zeros, len) != len) {
+			exit_server("error writing to client");
+		}
+		ret += len;
+	}
+}
+
 /****************************************************************************
    reply to a readbraw (core+ protocol)
 ****************************************************************************/
@@ -1352,7 +1387,6 @@ int reply_readbraw(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	int nread = 0, size, sizeneeded;
 	uint32_t startpos;
 	char *header = outbuf;
-	int ret = 0;
 
 	cnum = SVAL(inbuf, smb_tid);
 	fnum = GETFNUM(inbuf, smb_vwv0);
@@ -1365,10 +1399,12 @@ int reply_readbraw(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	maxcount = MIN(65535, maxcount);
 	maxcount = MAX(mincount, maxcount);
 
-	if (!FNUM_OK(fnum, cnum) || !Files[fnum].can_read) {
+	if (!FNUM_OK(fnum, cnum) || !Files[fnum].can_read ||
+	    is_locked(fnum, SVAL(inbuf, smb_pid), maxcount, startpos,
+	              F_RDLCK)) {
 		DEBUG("fnum %d not open in readbraw - cache prime?\n", fnum);
 		_smb_setlen(header, 0);
-		transfer_file(0, Client, 0, header, 4, 0);
+		transfer_file(0, Client, 0, header, 4);
 		return -1;
 	}
 
@@ -1385,37 +1421,14 @@ int reply_readbraw(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 
 	nread = MIN(maxcount, (int) (size - startpos));
 
-	if (nread < mincount)
+	if (nread < mincount || nread < 0)
 		nread = 0;
 
 	DEBUG("fnum=%d cnum=%d start=%d max=%d min=%d nread=%d\n", fnum, cnum,
 	      startpos, maxcount, mincount, nread);
 
-#if UNSAFE_READRAW
-	{
-		int predict = 0;
-		_smb_setlen(header, nread);
-
-		if ((nread - predict) > 0)
-			seek_file(fnum, startpos + predict);
-
-		ret = transfer_file(fd, Client, nread - predict, header,
-		                    4 + predict, startpos + predict);
-	}
-
-	if (ret != nread + 4)
-		ERROR(
-		    "ERROR: file read failure on %s at %d for %d bytes (%d)\n",
-		    fname, startpos, nread, ret);
-
-#else
-	ret = read_file(fnum, header + 4, startpos, nread);
-	if (ret < mincount)
-		ret = 0;
-
-	_smb_setlen(header, ret);
-	transfer_file(0, Client, 0, header, 4 + ret, 0);
-#endif
+	_smb_setlen(header, nread);
+	send_file_data(fnum, header, 4, startpos, nread);
 
 	DEBUG("finished\n");
 	return -1;
@@ -1448,7 +1461,8 @@ int reply_lockread(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	numtoread = MIN(BUFFER_SIZE - outsize, numtoread);
 	data = smb_buf(outbuf) + 3;
 
-	if (!do_lock(fnum, cnum, numtoread, startpos, F_RDLCK, &eclass, &ecode))
+	if (!do_lock(fnum, cnum, SVAL(inbuf, smb_pid), numtoread, startpos,
+	             F_RDLCK, &eclass, &ecode))
 		return ERROR_CODE(eclass, ecode);
 
 	nread = read_file(fnum, data, startpos, numtoread);
@@ -1492,6 +1506,9 @@ int reply_read(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	numtoread = MIN(BUFFER_SIZE - outsize, numtoread);
 	data = smb_buf(outbuf) + 3;
 
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), numtoread, startpos, F_RDLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
+
 	if (numtoread > 0)
 		nread = read_file(fnum, data, startpos, numtoread);
 
@@ -1521,6 +1538,7 @@ int reply_read_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 	int smb_mincnt = SVAL(inbuf, smb_vwv6);
 	int cnum;
 	int nread = -1;
+	int outsize;
 	char *data;
 
 	cnum = SVAL(inbuf, smb_tid);
@@ -1529,9 +1547,38 @@ int reply_read_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 	CHECK_READ(fnum);
 	CHECK_ERROR(fnum);
 
-	set_message(outbuf, 12, 0, true);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), smb_maxcnt, smb_offs,
+	              F_RDLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
+
+	outsize = set_message(outbuf, 12, 0, true);
 	data = smb_buf(outbuf);
 
+	/* If this is the only command in the packet, the file data goes at
+	   the end of the reply, so it can be sent straight from the file. */
+	if (chain_size == 0 && CVAL(inbuf, smb_vwv0) == 0xFF) {
+		struct stat st;
+
+		if (fstat(Files[fnum].fd_ptr->fd, &st) != 0)
+			return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
+
+		nread = 0;
+		if (st.st_size > smb_offs)
+			nread = MIN(smb_maxcnt, st.st_size - smb_offs);
+
+		CVAL(outbuf, smb_vwv0) = 0xFF;
+		SSVAL(outbuf, smb_vwv5, nread);
+		SSVAL(outbuf, smb_vwv6, smb_offset(data, outbuf));
+		SSVAL(smb_buf(outbuf), -2, nread);
+		smb_setlen(outbuf, outsize + nread - 4);
+
+		DEBUG("fnum=%d cnum=%d min=%d max=%d nread=%d (sendfile)\n",
+		      fnum, cnum, smb_mincnt, smb_maxcnt, nread);
+
+		send_file_data(fnum, outbuf, outsize, smb_offs, nread);
+		return -1;
+	}
+
 	nread = read_file(fnum, data, smb_offs, smb_maxcnt);
 
 	if (nread < 0)
@@ -1589,11 +1636,11 @@ int reply_writebraw(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	CVAL(inbuf, smb_com) = SMBwritec;
 	CVAL(outbuf, smb_com) = SMBwritec;
 
-	if (seek_file(fnum, startpos) != startpos)
-		ERROR("couldn't seek to %ld in writebraw\n", startpos);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), tcount, startpos, F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
 
 	if (numtowrite > 0)
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	DEBUG("fnum=%d cnum=%d start=%ld num=%d wrote=%d sync=%d\n", fnum, cnum,
 	      startpos, numtowrite, nwritten, write_through);
@@ -1619,15 +1666,17 @@ int reply_writebraw(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	/* Even though this is not an smb message, smb_len
 	   returns the generic length of an smb message */
 	numtowrite = smb_len(inbuf);
+	count_request_bytes(4 + numtowrite, 0);
 
 	if (tcount > nwritten + numtowrite) {
 		DEBUG("Client overestimated the write %d %d %d\n", tcount,
 		      nwritten, numtowrite);
 	}
 
-	nwritten = transfer_file(Client, Files[fnum].fd_ptr->fd, numtowrite,
-	                         NULL, 0, startpos + nwritten);
+	nwritten = sys_recvfile(Client, Files[fnum].fd_ptr->fd,
+	                        startpos + nwritten, numtowrite);
 	total_written += nwritten;
+	Files[fnum].pos = startpos + total_written;
 
 	/* Set up outbuf to return the correct return */
 	outsize = set_message(outbuf, 1, 0, true);
@@ -1674,7 +1723,9 @@ int reply_writeunlock(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	startpos = IVAL(inbuf, smb_vwv2);
 	data = smb_buf(inbuf) + 3;
 
-	seek_file(fnum, startpos);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), numtowrite, startpos,
+	              F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
 
 	/* The special X/Open SMB protocol handling of
 	   zero length writes is *NOT* done for
@@ -1682,12 +1733,13 @@ int reply_writeunlock(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	if (numtowrite == 0)
 		nwritten = 0;
 	else
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if (((nwritten == 0) && (numtowrite != 0)) || (nwritten < 0))
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 
-	if (!do_unlock(fnum, cnum, numtowrite, startpos, &eclass, &ecode))
+	if (!do_unlock(fnum, cnum, SVAL(inbuf, smb_pid), numtowrite, startpos,
+	               &eclass, &ecode))
 		return ERROR_CODE(eclass, ecode);
 
 	outsize = set_message(outbuf, 1, 0, true);
@@ -1722,13 +1774,15 @@ int reply_write(char *inbuf, char *outbuf, int dum1, int dum2)
 	startpos = IVAL(inbuf, smb_vwv2);
 	data = smb_buf(inbuf) + 3;
 
-	seek_file(fnum, startpos);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), numtowrite, startpos,
+	              F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
 
 	/* X/Open SMB protocol says that if smb_vwv1 is
 	   zero then the file size should be extended or
 	   truncated to the size given in smb_vwv[2-3] */
 	if (numtowrite != 0) {
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 	} else {
 		nwritten = ftruncate(Files[fnum].fd_ptr->fd, startpos);
 	}
@@ -1772,7 +1826,8 @@ int reply_write_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 
 	data = smb_base(inbuf) + smb_doff;
 
-	seek_file(fnum, smb_offs);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), smb_dsize, smb_offs, F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
 
 	/* X/Open SMB protocol says that, unlike SMBwrite
 	   if the length is zero then NO truncation is
@@ -1781,7 +1836,7 @@ int reply_write_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 	if (smb_dsize == 0)
 		nwritten = 0;
 	else
-		nwritten = write_file(fnum, data, smb_dsize);
+		nwritten = write_file(fnum, data, smb_offs, smb_dsize);
 
 	if (((nwritten == 0) && (smb_dsize != 0)) || (nwritten < 0))
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
@@ -1809,10 +1864,12 @@ int reply_write_and_X(char *inbuf, char *outbuf, int length, int bufsize)
 int reply_lseek(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 {
 	int cnum, fnum;
-	uint32_t startpos;
-	int32_t res = -1;
-	int mode, umode;
+	int32_t startpos;
+	uint32_t offset;
+	off_t res;
+	int mode;
 	int outsize = 0;
+	struct stat st;
 
 	cnum = SVAL(inbuf, smb_tid);
 	fnum = GETFNUM(inbuf, smb_vwv0);
@@ -1821,30 +1878,39 @@ int reply_lseek(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	CHECK_ERROR(fnum);
 
 	mode = SVAL(inbuf, smb_vwv1) & 3;
-	startpos = IVAL(inbuf, smb_vwv2);
 
+	/* All file I/O is done with explicit offsets, so the file position
+	   is only bookkeeping that we track ourselves. The offset is only
+	   signed when it is relative to somewhere. */
 	switch (mode & 3) {
-	case 0:
-		umode = SEEK_SET;
-		break;
 	case 1:
-		umode = SEEK_CUR;
+		startpos = IVALS(inbuf, smb_vwv2);
+		res = Files[fnum].pos + startpos;
 		break;
 	case 2:
-		umode = SEEK_END;
+		if (fstat(Files[fnum].fd_ptr->fd, &st) != 0) {
+			return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
+		}
+		startpos = IVALS(inbuf, smb_vwv2);
+		res = st.st_size + startpos;
 		break;
 	default:
-		umode = SEEK_SET;
+		offset = IVAL(inbuf, smb_vwv2);
+		res = offset;
 		break;
 	}
 
-	res = lseek(Files[fnum].fd_ptr->fd, startpos, umode);
+	/* seeking before the start of the file leaves us at the start */
+	if (res < 0) {
+		res = 0;
+	}
 	Files[fnum].pos = res;
 
 	outsize = set_message(outbuf, 2, 0, true);
-	SIVALS(outbuf, smb_vwv0, res);
+	SIVAL(outbuf, smb_vwv0, res);
 
-	DEBUG("fnum=%d cnum=%d ofs=%d mode=%d\n", fnum, cnum, startpos, mode);
+	DEBUG("fnum=%d cnum=%d ofs=%lld mode=%d\n", fnum, cnum,
+	      (long long) res, mode);
 
 	return outsize;
 }
@@ -1944,9 +2010,11 @@ int reply_writeclose(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	mtime = make_unix_date3(inbuf + smb_vwv4);
 	data = smb_buf(inbuf) + 1;
 
-	seek_file(fnum, startpos);
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), numtowrite, startpos,
+	              F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
 
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	set_filetime(cnum, Files[fnum].name, mtime);
 
@@ -1987,7 +2055,8 @@ int reply_lock(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	DEBUG("fd=%d fnum=%d cnum=%d ofs=%d cnt=%d\n", Files[fnum].fd_ptr->fd,
 	      fnum, cnum, offset, count);
 
-	if (!do_lock(fnum, cnum, count, offset, F_WRLCK, &eclass, &ecode))
+	if (!do_lock(fnum, cnum, SVAL(inbuf, smb_pid), count, offset, F_WRLCK,
+	             &eclass, &ecode))
 		return ERROR_CODE(eclass, ecode);
 
 	return outsize;
@@ -2013,7 +2082,8 @@ int reply_unlock(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	count = IVAL(inbuf, smb_vwv1);
 	offset = IVAL(inbuf, smb_vwv3);
 
-	if (!do_unlock(fnum, cnum, count, offset, &eclass, &ecode))
+	if (!do_unlock(fnum, cnum, SVAL(inbuf, smb_pid), count, offset,
+	               &eclass, &ecode))
 		return ERROR_CODE(eclass, ecode);
 
 	DEBUG("fd=%d fnum=%d cnum=%d ofs=%d cnt=%d\n", Files[fnum].fd_ptr->fd,
@@ -2134,6 +2204,10 @@ int reply_mkdir(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	if (check_name(directory, cnum))
 		ret = mkdir(directory, unix_mode(cnum, aDIR));
 
+	if (ret == 0) {
+		watch_changed(CONN_SHARE(cnum), directory);
+	}
+
 	if (ret < 0) {
 		if ((errno == ENOENT) && bad_path) {
 			unix_ERR_class = ERRDOS;
@@ -2168,6 +2242,8 @@ int reply_rmdir(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 
 		dptr_closepath(directory, SVAL(inbuf, smb_pid));
 		ok = (rmdir(directory) == 0);
+		if (ok)
+			watch_changed(CONN_SHARE(cnum), directory);
 		if (!ok)
 			DEBUG("couldn't remove directory %s : %s\n", directory,
 			      strerror(errno));
@@ -2377,6 +2453,8 @@ int reply_mv(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 		if (resolve_wildcards(directory, newname) &&
 		    can_rename(directory, cnum) && !file_exist(newname, NULL) &&
 		    rename(directory, newname) == 0) {
+			watch_changed(CONN_SHARE(cnum), directory);
+			watch_changed(CONN_SHARE(cnum), newname);
 			count++;
 		}
 
@@ -2434,6 +2512,9 @@ int reply_mv(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 					continue;
 				}
 				if (rename(fname, destname) == 0) {
+					watch_changed(CONN_SHARE(cnum), fname);
+					watch_changed(CONN_SHARE(cnum),
+					              destname);
 					count++;
 				}
 				DEBUG("doing rename on %s -> %s\n", fname,
@@ -2467,10 +2548,11 @@ static bool copy_file(char *src, char *dest1, int cnum, int ofun, int count,
                       bool target_is_directory)
 {
 	int Access, action;
-	struct stat st;
-	int ret = 0;
+	struct stat st, st2;
+	off_t ret = 0, outpos = 0;
 	int fnum1, fnum2;
 	pstring dest;
+	char *buf;
 
 	pstrcpy(dest, dest1);
 	if (target_is_directory) {
@@ -2493,7 +2575,7 @@ static bool copy_file(char *src, char *dest1, int cnum, int ofun, int count,
 	                 &action);
 
 	if (!Files[fnum1].open) {
-		Files[fnum1].reserved = false;
+		free_file(fnum1);
 		return false;
 	}
 
@@ -2510,18 +2592,25 @@ static bool copy_file(char *src, char *dest1, int cnum, int ofun, int count,
 
 	if (!Files[fnum2].open) {
 		close_file(fnum1, false);
-		Files[fnum2].reserved = false;
+		free_file(fnum2);
 		return false;
 	}
 
-	if ((ofun & 3) == 1) {
-		lseek(Files[fnum2].fd_ptr->fd, 0, SEEK_END);
+	if ((ofun & 3) == 1 && fstat(Files[fnum2].fd_ptr->fd, &st2) == 0) {
+		outpos = st2.st_size;
 	}
 
-	if (st.st_size)
-		ret = transfer_file(Files[fnum1].fd_ptr->fd,
-		                    Files[fnum2].fd_ptr->fd, st.st_size, NULL,
-		                    0, 0);
+	buf = checked_malloc(COPY_BUFSIZE);
+	while (ret < st.st_size) {
+		int n = read_file(fnum1, buf, ret,
+		                  MIN(COPY_BUFSIZE, st.st_size - ret));
+		if (n <= 0 || pwrite_data(Files[fnum2].fd_ptr->fd, buf, n,
+		                          outpos + ret) != n) {
+			break;
+		}
+		ret += n;
+	}
+	free(buf);
 
 	close_file(fnum1, false);
 	close_file(fnum2, false);
@@ -2673,6 +2762,42 @@ int reply_setdir(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	return ERROR_CODE(ERRDOS, ERRnoaccess);
 }
 
+/****************************************************************************
+  apply the unlocks and locks of a LockingX request. If wait is true and a
+  lock is held by another client, this process is woken when it may have
+  been released; see do_locks().
+****************************************************************************/
+bool lockingX_locks(char *inbuf, int fnum, bool wait, int *eclass,
+                    uint32_t *ecode)
+{
+	unsigned char locktype = CVAL(inbuf, smb_vwv3);
+	uint16_t num_ulocks = SVAL(inbuf, smb_vwv6);
+	uint16_t num_locks = SVAL(inbuf, smb_vwv7);
+	int cnum = SVAL(inbuf, smb_tid);
+	char *data = smb_buf(inbuf);
+	struct lock_spec *ranges;
+	bool ok;
+	int i;
+
+	/* Data points at the beginning of the list of smb_unlkrng structs,
+	   followed by the smb_lkrng structs. They are all applied together,
+	   so that a failure leaves no locks changed. */
+	ranges = checked_malloc((num_ulocks + num_locks) *
+	                        sizeof(struct lock_spec));
+	for (i = 0; i < num_ulocks + num_locks; i++) {
+		ranges[i].lock_pid = SVAL(data, SMB_LPID_OFFSET(i));
+		ranges[i].offset = IVAL(data, SMB_LKOFF_OFFSET(i));
+		ranges[i].count = IVAL(data, SMB_LKLEN_OFFSET(i));
+	}
+
+	ok = do_locks(fnum, cnum, ranges, num_ulocks, ranges + num_ulocks,
+	              num_locks, (locktype & 1) ? F_RDLCK : F_WRLCK, wait,
+	              eclass, ecode);
+	free(ranges);
+
+	return ok;
+}
+
 /****************************************************************************
   reply to a lockingX request
 ****************************************************************************/
@@ -2682,62 +2807,49 @@ int reply_lockingX(char *inbuf, char *outbuf, int length, int bufsize)
 	unsigned char locktype = CVAL(inbuf, smb_vwv3);
 	uint16_t num_ulocks = SVAL(inbuf, smb_vwv6);
 	uint16_t num_locks = SVAL(inbuf, smb_vwv7);
-	uint32_t count, offset;
 
 	int cnum;
-	int i;
-	char *data;
-	uint32_t ecode = 0, dummy2;
-	int eclass = 0, dummy1;
+	uint32_t ecode = 0;
+	int eclass = 0;
+	bool wait;
 
 	cnum = SVAL(inbuf, smb_tid);
 
 	CHECK_FNUM(fnum, cnum);
 	CHECK_ERROR(fnum);
 
-	data = smb_buf(inbuf);
+	/* the ranges must all be in the data of the request */
+	if (10 * (num_ulocks + num_locks) > smb_buflen(inbuf) ||
+	    PTR_DIFF(smb_buf(inbuf), inbuf) + 10 * (num_ulocks + num_locks) >
+	        smb_len(inbuf) + 4) {
+		return ERROR_CODE(ERRSRV, ERRerror);
+	}
 
-	/* Check if this is an oplock break on a file
-	   we have granted an oplock on.
-	 */
+	/* Check if this is the client releasing an oplock in reply to an
+	   oplock break. No reply is sent unless locks were also requested. */
 	if (locktype & LOCKING_ANDX_OPLOCK_RELEASE) {
-		DEBUG("oplock break reply from client for "
-		      "fnum = %d. no oplock granted as not supported.\n",
-		      fnum);
-		return ERROR_CODE(ERRDOS, ERRlock);
+		oplock_release(fnum);
+		if (num_ulocks == 0 && num_locks == 0) {
+			return -1;
+		}
 	}
 
-	/* Data now points at the beginning of the list
-	   of smb_unlkrng structs */
-	for (i = 0; i < (int) num_ulocks; i++) {
-		count = IVAL(data, SMB_LKLEN_OFFSET(i));
-		offset = IVAL(data, SMB_LKOFF_OFFSET(i));
-		if (!do_unlock(fnum, cnum, count, offset, &eclass, &ecode))
+	/* the client giving up on a request that is waiting for its locks */
+	if (locktype & LOCKING_ANDX_CANCEL_LOCK) {
+		if (!cancel_blocking_lock(inbuf, fnum)) {
+			return ERROR_CODE(ERRDOS, ERRlock);
+		}
+	} else {
+		wait = blocking_lock_allowed(inbuf);
+		if (!lockingX_locks(inbuf, fnum, wait, &eclass, &ecode)) {
+			/* the reply is sent once the locks have been taken
+			   or the timeout has expired */
+			if (wait && ecode == ERRlock) {
+				push_blocking_lock(inbuf, fnum);
+				return -1;
+			}
 			return ERROR_CODE(eclass, ecode);
-	}
-
-	/* Now do any requested locks */
-	data += 10 * num_ulocks;
-	/* Data now points at the beginning of the list
-	   of smb_lkrng structs */
-	for (i = 0; i < (int) num_locks; i++) {
-		count = IVAL(data, SMB_LKLEN_OFFSET(i));
-		offset = IVAL(data, SMB_LKOFF_OFFSET(i));
-		if (!do_lock(fnum, cnum, count, offset,
-		             ((locktype & 1) ? F_RDLCK : F_WRLCK), &eclass,
-		             &ecode))
-			break;
-	}
-
-	/* If any of the above locks failed, then we must unlock
-	   all of the previous locks (X/Open spec). */
-	if (i != num_locks && num_locks != 0) {
-		for (; i >= 0; i--) {
-			count = IVAL(data, SMB_LKLEN_OFFSET(i));
-			offset = IVAL(data, SMB_LKOFF_OFFSET(i));
-			do_unlock(fnum, cnum, count, offset, &dummy1, &dummy2);
 		}
-		return ERROR_CODE(eclass, ecode);
 	}
 
 	set_message(outbuf, 2, 0, true);
@@ -2785,12 +2897,14 @@ int reply_writebmpx(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 
 	data = smb_base(inbuf) + smb_doff;
 
+	if (is_locked(fnum, SVAL(inbuf, smb_pid), tcount, startpos, F_WRLCK))
+		return ERROR_CODE(ERRDOS, ERRlock);
+
 	/* If this fails we need to send an SMBwriteC response,
 	   not an SMBwritebmpx - set this up now so we don't forget */
 	CVAL(outbuf, smb_com) = SMBwritec;
 
-	seek_file(fnum, startpos);
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if (nwritten < numtowrite)
 		return UNIX_ERROR_CODE(ERRHRD, ERRdiskfull);
@@ -2882,8 +2996,7 @@ int reply_writebs(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	if (wbms->wr_discard)
 		return -1; /* Just discard the packet */
 
-	seek_file(fnum, startpos);
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if (nwritten < numtowrite) {
 		if (write_through) {
@@ -2987,7 +3100,8 @@ int reply_getattrE(char *inbuf, char *outbuf, int dum_size, int dum_buffsize)
 	if (fstat(Files[fnum].fd_ptr->fd, &sbuf))
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 
-	mode = dos_mode(cnum, Files[fnum].name, &sbuf);
+	mode = dos_mode_fd(cnum, Files[fnum].name, Files[fnum].fd_ptr->fd,
+	                   &sbuf);
 
 	/* Convert the times into dos times. Set create
 	   date to be last modify date as UNIX doesn't save
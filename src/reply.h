@@ -9,6 +9,9 @@
  * FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 int reply_special(char *inbuf, char *outbuf);
 int reply_tcon(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
 int reply_tcon_and_X(char *inbuf, char *outbuf, int length, int bufsize);
@@ -54,6 +57,8 @@ int reply_rmdir(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
 int reply_mv(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
 int reply_copy(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
 int reply_setdir(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
+bool lockingX_locks(char *inbuf, int fnum, bool wait, int *eclass,
+                    uint32_t *ecode);
 int reply_lockingX(char *inbuf, char *outbuf, int length, int bufsize);
 int reply_readbmpx(char *inbuf, char *outbuf, int length, int bufsize);
 int reply_writebmpx(char *inbuf, char *outbuf, int dum_size, int dum_buffsize);
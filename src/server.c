@@ -12,6 +12,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -29,6 +30,7 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pwd.h>
 #include <strings.h>
 #include <syslog.h>
@@ -37,30 +39,42 @@
 
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "blocking.h"
 #include "byteorder.h"
 #include "config.h"
 #include "dir.h"
+#include "dirindex.h"
 #include "guards.h" /* IWYU pragma: keep */
 #include "ipc.h"
 #include "locking.h"
 #include "mangle.h"
+#include "message.h"
+#include "metacache.h"
+#include "notify.h"
+#include "oplock.h"
 #include "reply.h"
 #include "server.h"
+#include "shareindex.h"
 #include "shares.h"
 #include "smb.h"
+#include "statpool.h"
+#include "stats.h"
 #include "strfunc.h"
 #include "system.h"
 #include "timefunc.h"
 #include "trans2.h"
 #include "util.h"
 #include "version.h"
+#include "watch.h"
 
 #define SMB_ALIGNMENT 1
 #define SIGNAL_CAST   (void (*)(int))
@@ -73,6 +87,7 @@
 #define IDLE_CLOSED_TIMEOUT  (60)
 #define DPTR_IDLE_TIMEOUT    (120)
 #define SMBD_SELECT_LOOP     (10)
+#define FD_CACHE_TIMEOUT     (2)
 
 /* do you want smbd to send a 1 byte packet to nmbd to trigger it to start
    when smbd starts? */
@@ -81,8 +96,16 @@
 #define RUN_AS_USER    "nobody"
 #define DOSATTRIB_NAME "user.DOSATTRIB"
 
+/* number of entries in the DOS attribute cache */
+#define DOSATTRIB_CACHE_SIZE 8192
+
 #define MAX_MUX 50
 
+#define DEFAULT_LISTEN_BACKLOG 64
+
+/* maximum size of the prefork worker pool (when not in event mode) */
+#define MAX_WORKERS 1024
+
 static char **original_argv;
 static int original_argc;
 static bool allow_public_connections = false;
@@ -101,20 +124,125 @@ static int last_message = -1;
 
 static time_t smb_last_time = (time_t) 0;
 
-struct service_connection Connections[MAX_CONNECTIONS];
-struct open_file Files[MAX_OPEN_FILES];
+struct service_connection *Connections;
+
+/* the file slots of the current session, indexed by file handle; grown as
+   needed, up to max_open_files + 1 slots, since handle 0 is not used */
+struct open_file *Files;
+int num_file_slots = 0;
+static int max_open_files = DEFAULT_MAX_OPEN_FILES;
+
+/* in event mode, the number of clients that the open file limit allows to
+   have max_open_files files open at once, or 0 if there is no limit */
+static int max_full_sessions = 0;
+
+/* number of file slots allocated to begin with */
+#define INITIAL_FILE_SLOTS 64
 
 /*
  * Indirection for file fd's. Needed as POSIX locking is based on file/process,
  * not fd/process. Context:
  * <https://www.samba.org/samba/news/articles/low_point/tale_two_stds_os2.html>
  * TODO: The 2024 POSIX spec now includes OFD locks, so this can be replaced
+ *
+ * Each session keeps its open fds in a hash table keyed by dev and inode.
+ * This is the number of hash chains to begin with; a power of two.
+ */
+#define INITIAL_FD_CHAINS 64
+
+/*
+ * DOS programs and batch files often open, read and close the same file many
+ * times in a row. When the last handle to a file is closed, its fd is kept
+ * open for FD_CACHE_TIMEOUT seconds, so that opening the file again does not
+ * need another open(). This is how many fds each session keeps.
+ */
+#define FD_CACHE_SIZE 16
+
+/* fds kept in the caches of all sessions */
+static int num_cached_fds = 0;
+
+/*
+ * Everything we know about a single client. In the normal fork-per-connection
+ * mode a process only ever has one of these, but in event mode (-e) a single
+ * process serves many clients. The SMB handlers still use the globals (Client,
+ * Files, Connections etc.), so switch_session() is used to save the state of
+ * the old session and point the globals at the new one before serving a
+ * request. The in/out buffers are shared, since they are only in use while a
+ * request is being processed.
  */
-static struct open_fd FileFd[MAX_OPEN_FILES];
-static int max_file_fd_used = 0;
+struct session {
+	int client;
+	int protocol;
+	int max_send;
+	bool done_sesssetup;
+	int num_connections_open;
+	time_t last_time;
+	time_t last_packet;
+	char client_addr[32];
+	struct service_connection *connections;
+	struct open_file *files;
+	int num_file_slots;
+	int free_files, last_free_file; /* the free list of file slots */
+	int num_files_open;
+	struct open_fd **fd_chains;
+	int num_fd_chains, num_fds;
+	struct open_fd *fd_cache[FD_CACHE_SIZE]; /* oldest first */
+	int num_fd_cache;
+	void *dptrs;
+	void *notifies; /* TRANS2_FIND_NOTIFY_FIRST handles */
+	struct session_stats *stats; /* published statistics, or NULL */
+	char *partial; /* event mode: the start of a packet still arriving */
+	size_t partial_len;
+	struct session *next;
+};
+
+static struct session *current_session = NULL;
+
+/* true if running in single-process event mode */
+static bool event_mode = false;
+
+/* Set while a request is being processed in event mode, so that
+   exit_server() only ends the client's session, not the whole server */
+static jmp_buf *session_abort = NULL;
 
 const char *workgroup = "WORKGROUP";
 static const char *bind_addr = "0.0.0.0";
+static int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+
+/* size of the prefork worker pool; zero to fork for each connection */
+static int num_workers = 0;
+
+/* path of the socket that tumba_status connects to, or NULL */
+static const char *stats_path = NULL;
+
+/* if true, byte range locks are also taken as OFD locks */
+static bool unix_locks = false;
+
+/* entries in the metadata cache shared between processes, or 0 for none */
+static int metacache_size = 0;
+
+/* if true, directories in the shares are watched for changes */
+static bool watch_shares = false;
+
+/* if true, read-only shares are indexed at startup (see shareindex.c) */
+static bool index_shares = false;
+
+/* The parent tracks the prefork workers in memory shared with them, so that
+   they can mark themselves busy while serving a client. Workers also write
+   a byte to worker_pipe to wake up the parent when they become busy. */
+struct worker_slot {
+	volatile pid_t pid;
+	volatile bool busy;
+	time_t start_time;
+	int socket;
+};
+
+static struct worker_slot *worker_slots;
+static int num_worker_slots;
+static int *worker_sockets;
+static int num_worker_sockets;
+static int worker_pipe[2];
+static int worker_slot = -1;
 
 /*
  * Size of data we can send to client. Set
@@ -131,6 +259,9 @@ int max_recv = BUFFER_SIZE;
 /* a fnum to use when chaining */
 int chain_fnum = -1;
 
+/* max_send has been negotiated down by a session setup */
+bool done_sesssetup = false;
+
 /* number of open connections */
 static int num_connections_open = 0;
 
@@ -139,6 +270,11 @@ int unix_ERR_class = SMB_SUCCESS;
 int unix_ERR_code = 0;
 
 static int find_free_connection(int hash);
+static struct session *new_session(int client);
+static void switch_session(struct session *s);
+static void log_request_stats(void);
+static void check_stats_request(void);
+static void sig_usr1(int sig);
 
 /* for readability... */
 #define IS_DOS_READONLY(test_mode) (((test_mode) & aRONLY) != 0)
@@ -152,6 +288,8 @@ static int find_free_connection(int hash);
 ****************************************************************************/
 static void *dflt_sig(void)
 {
+	/* take down the whole server, even in event mode */
+	session_abort = NULL;
 	exit_server("caught signal");
 	return 0; /* Keep -Wall happy :-) */
 }
@@ -193,12 +331,32 @@ mode_t unix_mode(int cnum, int dosmode)
 	return result;
 }
 
-static int read_dosattrib(const char *path)
+/* DOS attributes read from xattrs are cached, to save a getxattr() call
+   every time a file is listed or queried. Entries are keyed by inode and
+   change time; setting the xattr updates the change time, so a stale entry
+   is never matched. */
+struct dosattrib_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+	int attrib;
+	bool valid;
+};
+
+static struct dosattrib_cache_entry dosattrib_cache[DOSATTRIB_CACHE_SIZE];
+
+static struct dosattrib_cache_entry *dosattrib_cache_slot(struct stat *st)
 {
-	char buf[5];
-	ssize_t nbytes;
+	uint32_t hash = (uint32_t) st->st_ino * 2654435761u ^
+	                (uint32_t) st->st_dev;
+
+	return &dosattrib_cache[hash % DOSATTRIB_CACHE_SIZE];
+}
 
-	nbytes = sys_getxattr(path, DOSATTRIB_NAME, buf, sizeof(buf));
+/* Parse the DOS attributes xattr, of which nbytes were read into buf; buf
+   must have space for one more byte. */
+int parse_dosattrib(char *buf, ssize_t nbytes)
+{
 	if (nbytes < 3 || nbytes > 4) {
 		return 0;
 	}
@@ -212,6 +370,85 @@ static int read_dosattrib(const char *path)
 	return strtol(buf + 2, NULL, 16) & (aARCH | aSYSTEM | aHIDDEN);
 }
 
+static void cache_dosattrib(struct stat *st, int attrib)
+{
+	struct dosattrib_cache_entry *entry = dosattrib_cache_slot(st);
+
+	/* The change time only has limited resolution, so if the file changed
+	   very recently it could change again without the time changing. */
+	if (st->st_ctim.tv_sec < time(NULL) - 1) {
+		entry->dev = st->st_dev;
+		entry->ino = st->st_ino;
+		entry->ctime = st->st_ctim;
+		entry->attrib = attrib;
+		entry->valid = true;
+		metacache_put_attrib(st, attrib);
+	}
+}
+
+/* DOS attribute cache hit and miss counts, for the session statistics */
+static unsigned long dosattrib_hits, dosattrib_misses;
+
+/* Read the DOS attributes of a file, using fd if it is not -1. */
+static int read_dosattrib(const char *path, int fd, struct stat *st)
+{
+	struct dosattrib_cache_entry *entry = dosattrib_cache_slot(st);
+	char buf[5];
+	ssize_t nbytes;
+	int result;
+
+	if (entry->valid && entry->dev == st->st_dev &&
+	    entry->ino == st->st_ino &&
+	    entry->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    entry->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+		dosattrib_hits++;
+		return entry->attrib;
+	}
+
+	/* another process may have read them already */
+	if (metacache_get_attrib(st, &result)) {
+		entry->dev = st->st_dev;
+		entry->ino = st->st_ino;
+		entry->ctime = st->st_ctim;
+		entry->attrib = result;
+		entry->valid = true;
+		dosattrib_hits++;
+		return result;
+	}
+
+	dosattrib_misses++;
+	if (fd != -1) {
+		nbytes = sys_fgetxattr(fd, DOSATTRIB_NAME, buf, sizeof(buf));
+	} else {
+		nbytes = sys_getxattr(path, DOSATTRIB_NAME, buf, sizeof(buf));
+	}
+	result = parse_dosattrib(buf, nbytes);
+	cache_dosattrib(st, result);
+
+	return result;
+}
+
+/* Read the DOS attributes xattr of a file without parsing or caching it.
+   This may be called from threads other than the main thread. */
+ssize_t read_dosattrib_raw(const char *path, char *buf, size_t size)
+{
+	return sys_getxattr(path, DOSATTRIB_NAME, buf, size);
+}
+
+/* Add DOS attributes read in advance with read_dosattrib_raw() to the
+   cache; st must have been read before the attributes were. */
+void prefetched_dosattrib(struct stat *st, char *buf, ssize_t nbytes)
+{
+	char tmp[5];
+
+	if (nbytes < 0 || nbytes >= (ssize_t) sizeof(tmp)) {
+		nbytes = -1;
+	} else {
+		memcpy(tmp, buf, nbytes);
+	}
+	cache_dosattrib(st, parse_dosattrib(tmp, nbytes));
+}
+
 static void write_dosattrib(const char *path, int attrib)
 {
 	struct stat st;
@@ -265,7 +502,15 @@ static void write_dosattrib(const char *path, int attrib)
 ****************************************************************************/
 int dos_mode(int cnum, char *path, struct stat *sbuf)
 {
-	int result = 0;
+	return dos_mode_fd(cnum, path, -1, sbuf);
+}
+
+/****************************************************************************
+  change a unix mode to a dos mode, for a file that is open as fd
+****************************************************************************/
+int dos_mode_fd(int cnum, char *path, int fd, struct stat *sbuf)
+{
+	int result = 0, attrib;
 
 	DEBUG("cnum=%d path=%s\n", cnum, path);
 
@@ -279,25 +524,31 @@ int dos_mode(int cnum, char *path, struct stat *sbuf)
 		result |= aRONLY;
 	}
 
-	result |= read_dosattrib(path);
+	if (!shareindex_attrib(CONN_SHARE(cnum), path, &attrib)) {
+		attrib = read_dosattrib(path, fd, sbuf);
+	}
+	result |= attrib;
 
 	if (S_ISDIR(sbuf->st_mode))
 		result = aDIR | (result & aRONLY);
 
-	DEBUG("returning ");
-
-	if (result & aHIDDEN)
-		DEBUG("h");
-	if (result & aRONLY)
-		DEBUG("r");
-	if (result & aSYSTEM)
-		DEBUG("s");
-	if (result & aDIR)
-		DEBUG("d");
-	if (result & aARCH)
-		DEBUG("a");
+	if (LOGLEVEL >= 4) {
+		char attrs[6], *p = attrs;
+
+		if (result & aHIDDEN)
+			*p++ = 'h';
+		if (result & aRONLY)
+			*p++ = 'r';
+		if (result & aSYSTEM)
+			*p++ = 's';
+		if (result & aDIR)
+			*p++ = 'd';
+		if (result & aARCH)
+			*p++ = 'a';
+		*p = '\0';
 
-	DEBUG("\n");
+		DEBUG("returning %s\n", attrs);
+	}
 
 	return result;
 }
@@ -332,6 +583,7 @@ int dos_chmod(int cnum, char *fname, int dosmode, struct stat *st)
 #ifdef S_ISVTX
 	mask |= S_ISVTX;
 #endif
+	dosattrib_cache_slot(st)->valid = false;
 	write_dosattrib(fname, dosmode);
 
 	unixmode |= (st->st_mode & mask);
@@ -375,113 +627,63 @@ bool set_filetime(int cnum, char *fname, time_t mtime)
 	return true;
 }
 
-/****************************************************************************
-check if two filenames are equal
-
-this needs to be careful about whether we are case sensitive
-****************************************************************************/
-static bool fname_equal(char *name1, char *name2)
-{
-	int l1 = strlen(name1);
-	int l2 = strlen(name2);
-
-	/* handle filenames ending in a single dot */
-	if (l1 - l2 == 1 && name1[l1 - 1] == '.' && lp_strip_dot()) {
-		bool ret;
-		name1[l1 - 1] = 0;
-		ret = fname_equal(name1, name2);
-		name1[l1 - 1] = '.';
-		return ret;
-	}
-
-	if (l2 - l1 == 1 && name2[l2 - 1] == '.' && lp_strip_dot()) {
-		bool ret;
-		name2[l2 - 1] = 0;
-		ret = fname_equal(name1, name2);
-		name2[l2 - 1] = '.';
-		return ret;
-	}
-
-	return strequal(name1, name2);
-}
-
-/****************************************************************************
-mangle the 2nd name and check if it is then equal to the first name
-****************************************************************************/
-static bool mangled_equal(char *name1, char *name2)
-{
-	pstring tmpname;
-
-	if (is_8_3(name2, true))
-		return false;
-
-	pstrcpy(tmpname, name2);
-	mangle_name_83(tmpname, sizeof(pstring) - 1);
-
-	return strequal(name1, tmpname);
-}
-
 /****************************************************************************
 scan a directory to find a filename, matching without case sensitivity
 
 If the name looks like a mangled name then try via the mangling functions
 ****************************************************************************/
-static bool scan_directory(char *path, char *name, int cnum, bool docache)
+static bool scan_directory(char *path, char *name, int cnum)
 {
-	void *cur_dir;
+	struct dir_version version;
 	char *dname;
-	bool mangled;
+	bool found;
 	pstring name2;
 
-	mangled = is_mangled(name);
-
 	/* handle null paths */
 	if (*path == 0)
 		path = ".";
 
-	if (docache &&
-	    (dname = dir_cache_check(path, name, CONN_SHARE(cnum)))) {
+	if (shareindex_lookup(CONN_SHARE(cnum), path, name, &found)) {
+		return found;
+	}
+
+	if (dir_cache_check(path, name, CONN_SHARE(cnum), &dname, &version)) {
+		if (dname == NULL)
+			return false;
 		pstrcpy(name, dname);
 		return true;
 	}
 
-	/*
-	 * The incoming name can be mangled, and if we de-mangle it
-	 * here it will not compare correctly against the filename (name2)
-	 * read from the directory and then mangled by the name_map_mangle()
-	 * call. We need to mangle both names or neither.
-	 * (JRA).
-	 */
-
-	/* open the directory */
-	if (!(cur_dir = open_dir(cnum, path))) {
-		DEBUG("scan dir didn't open dir [%s]\n", path);
+	pstrcpy(name2, name);
+	if (!dirindex_lookup(path, name2, CONN_SHARE(cnum))) {
+		DEBUG("%s not found in [%s]\n", name, path);
+		dir_cache_add(path, name, NULL, CONN_SHARE(cnum), &version);
 		return false;
 	}
 
-	/* now scan for matching names */
-	while ((dname = read_dir_name(cur_dir))) {
-		if (*dname == '.' &&
-		    (strequal(dname, ".") || strequal(dname, "..")))
-			continue;
+	/* we've found the file, change it's name and return */
+	dir_cache_add(path, name, name2, CONN_SHARE(cnum), &version);
+	pstrcpy(name, name2);
+	return true;
+}
 
-		pstrcpy(name2, dname);
-		name_map_mangle(name2, false, CONN_SHARE(cnum));
-
-		if ((mangled && mangled_equal(name, name2)) ||
-		    fname_equal(name, name2)) {
-			/* we've found the file, change it's name and return */
-			if (docache)
-				dir_cache_add(path, name, dname,
-				              CONN_SHARE(cnum));
-			pstrcpy(name, dname);
-			close_dir(cur_dir);
-			return true;
+/****************************************************************************
+stat a path in the share of the given connection, using the index of the
+share if it has one
+****************************************************************************/
+static int share_stat(int cnum, char *path, struct stat *st)
+{
+	bool found;
+
+	if (shareindex_stat(CONN_SHARE(cnum), path, st, &found)) {
+		if (!found) {
+			errno = ENOENT;
+			return -1;
 		}
+		return 0;
 	}
 
-	close_dir(cur_dir);
-	return false;
+	return stat(path, st);
 }
 
 /****************************************************************************
@@ -541,7 +743,7 @@ bool unix_convert(char *name, int cnum, pstring saved_last_component,
 		strnorm(name);
 
 	/* stat the name - if it exists then we are all done! */
-	if (stat(name, &st) == 0)
+	if (share_stat(cnum, name, &st) == 0)
 		return true;
 
 	DEBUG("name=%s cnum=%d\n", name, cnum);
@@ -567,7 +769,7 @@ bool unix_convert(char *name, int cnum, pstring saved_last_component,
 			pstrcpy(saved_last_component, end ? end + 1 : start);
 
 		/* check if the name exists up to this point */
-		if (stat(name, &st) == 0) {
+		if (share_stat(cnum, name, &st) == 0) {
 			/* it exists. it must either be a directory or this must
 			   be the last part of the path for it to be OK */
 			if (end && !(st.st_mode & S_IFDIR)) {
@@ -589,8 +791,7 @@ bool unix_convert(char *name, int cnum, pstring saved_last_component,
 
 			/* try to find this part of the path in the directory */
 			if (strchr(start, '?') || strchr(start, '*') ||
-			    !scan_directory(dirpath, start, cnum,
-			                    end ? true : false)) {
+			    !scan_directory(dirpath, start, cnum)) {
 				if (end) {
 					/* an intermediate part of the name
 					 * can't be found */
@@ -820,27 +1021,157 @@ static int fd_attempt_open(char *fname, int flags, int mode)
 	return fd;
 }
 
+/****************************************************************************
+fd support routines - the hash chain for a dev and inode
+****************************************************************************/
+static unsigned int fd_chain(dev_t dev, ino_t inode)
+{
+	uint64_t h = (uint64_t) dev * 0x9e3779b97f4a7c15ULL;
+
+	h ^= (uint64_t) inode;
+
+	return (unsigned int) (h ^ (h >> 29)) &
+	       (current_session->num_fd_chains - 1);
+}
+
+/****************************************************************************
+fd support routines - close the fds of a struct open_fd that is no longer
+used, and free it
+****************************************************************************/
+static void fd_free(struct open_fd *fd_ptr)
+{
+	struct open_fd **link;
+
+	if (fd_ptr->fd != -1)
+		close(fd_ptr->fd);
+	if (fd_ptr->fd_readonly != -1)
+		close(fd_ptr->fd_readonly);
+	if (fd_ptr->fd_writeonly != -1)
+		close(fd_ptr->fd_writeonly);
+
+	/* not in the hash table if the file was never opened */
+	if (fd_ptr->inode != (ino_t) -1) {
+		link = &current_session->fd_chains[fd_chain(fd_ptr->dev,
+		                                            fd_ptr->inode)];
+		while (*link != fd_ptr) {
+			link = &(*link)->next;
+		}
+		*link = fd_ptr->next;
+		--current_session->num_fds;
+	}
+	free(fd_ptr);
+}
+
+/****************************************************************************
+fd support routines - remove the entry at index i from the fd cache
+****************************************************************************/
+static struct open_fd *fd_cache_remove(int i)
+{
+	struct session *s = current_session;
+	struct open_fd *fd_ptr = s->fd_cache[i];
+
+	--s->num_fd_cache;
+	--num_cached_fds;
+	memmove(&s->fd_cache[i], &s->fd_cache[i + 1],
+	        (s->num_fd_cache - i) * sizeof(struct open_fd *));
+
+	return fd_ptr;
+}
+
+/****************************************************************************
+fd support routines - close the cached fds that have been kept for long
+enough, or all of them if all is true
+****************************************************************************/
+static void fd_cache_expire(bool all)
+{
+	struct session *s = current_session;
+	time_t now = time(NULL);
+
+	while (s->num_fd_cache > 0 &&
+	       (all || now - s->fd_cache[0]->close_time >= FD_CACHE_TIMEOUT)) {
+		fd_free(fd_cache_remove(0));
+	}
+}
+
+/****************************************************************************
+fd support routines - how long to wait for a request from the client, in
+milli seconds, before the oldest cached fd is due to be closed; at most
+timeout, unless it is zero (no timeout)
+****************************************************************************/
+static int fd_cache_wait(int timeout)
+{
+	struct session *s = current_session;
+	long long due;
+
+	if (s == NULL || s->num_fd_cache == 0) {
+		return timeout;
+	}
+
+	due = (s->fd_cache[0]->close_time + FD_CACHE_TIMEOUT - time(NULL)) *
+	      1000LL;
+	if (due < 1) {
+		due = 1;
+	}
+	if (timeout <= 0 || due < timeout) {
+		timeout = due;
+	}
+
+	return timeout;
+}
+
+/****************************************************************************
+fd support routines - take a cached fd out of the cache to be used again.
+Returns false, and closes it, if the file has changed since it was closed;
+the caller then opens the file again.
+****************************************************************************/
+static bool fd_cache_take(struct open_fd *fd_ptr, struct stat *sbuf)
+{
+	struct session *s = current_session;
+	int i;
+
+	for (i = 0; s->fd_cache[i] != fd_ptr; i++)
+		;
+	fd_cache_remove(i);
+
+	if (sbuf->st_mtim.tv_sec != fd_ptr->mtime.tv_sec ||
+	    sbuf->st_mtim.tv_nsec != fd_ptr->mtime.tv_nsec ||
+	    sbuf->st_ctim.tv_sec != fd_ptr->ctime.tv_sec ||
+	    sbuf->st_ctim.tv_nsec != fd_ptr->ctime.tv_nsec) {
+		DEBUG("cached fd %d is out of date\n", fd_ptr->fd);
+		fd_free(fd_ptr);
+		return false;
+	}
+
+	DEBUG("reusing cached fd %d\n", fd_ptr->fd);
+	return true;
+}
+
 /****************************************************************************
 fd support routines - attempt to find an already open file by dev
-and inode - increments the ref_count of the returned struct open_fd *.
+and inode, or one in the fd cache that has not changed since it was closed
+- increments the ref_count of the returned struct open_fd *.
 ****************************************************************************/
 static struct open_fd *fd_get_already_open(struct stat *sbuf)
 {
-	int i;
 	struct open_fd *fd_ptr;
 
 	if (sbuf == 0)
 		return 0;
 
-	for (i = 0; i <= max_file_fd_used; i++) {
-		fd_ptr = &FileFd[i];
-		if ((fd_ptr->ref_count > 0) &&
-		    (((uint32_t) sbuf->st_dev) == fd_ptr->dev) &&
-		    (((uint32_t) sbuf->st_ino) == fd_ptr->inode)) {
+	fd_ptr = current_session->fd_chains[fd_chain(sbuf->st_dev,
+	                                             sbuf->st_ino)];
+	for (; fd_ptr != NULL; fd_ptr = fd_ptr->next) {
+		if (sbuf->st_dev == fd_ptr->dev &&
+		    sbuf->st_ino == fd_ptr->inode) {
+			if (fd_ptr->ref_count == 0 &&
+			    !fd_cache_take(fd_ptr, sbuf)) {
+				return 0;
+			}
 			fd_ptr->ref_count++;
-			DEBUG("Re-used struct open_fd %d, dev = %x, inode "
-			      "= %x, ref_count = %d\n",
-			      i, fd_ptr->dev, fd_ptr->inode, fd_ptr->ref_count);
+			DEBUG("Re-used struct open_fd, dev = %lx, inode "
+			      "= %lx, ref_count = %d\n",
+			      (unsigned long) fd_ptr->dev,
+			      (unsigned long) fd_ptr->inode, fd_ptr->ref_count);
 			return fd_ptr;
 		}
 	}
@@ -848,37 +1179,59 @@ static struct open_fd *fd_get_already_open(struct stat *sbuf)
 }
 
 /****************************************************************************
-fd support routines - attempt to find a empty slot in the FileFd array.
-Increments the ref_count of the returned entry.
+fd support routines - allocate a new struct open_fd, with a ref_count of 1.
+It is added to the hash table by fd_set_inode() once the file is open.
 ****************************************************************************/
 static struct open_fd *fd_get_new(void)
 {
-	int i;
-	struct open_fd *fd_ptr;
+	struct open_fd *fd_ptr = checked_malloc(sizeof(struct open_fd));
+
+	fd_ptr->dev = (dev_t) -1;
+	fd_ptr->inode = (ino_t) -1;
+	fd_ptr->fd = -1;
+	fd_ptr->fd_readonly = -1;
+	fd_ptr->fd_writeonly = -1;
+	fd_ptr->real_open_flags = -1;
+	fd_ptr->locked = false;
+	fd_ptr->ref_count = 1;
+	fd_ptr->next = NULL;
+
+	return fd_ptr;
+}
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		fd_ptr = &FileFd[i];
-		if (fd_ptr->ref_count == 0) {
-			fd_ptr->dev = (uint32_t) -1;
-			fd_ptr->inode = (uint32_t) -1;
-			fd_ptr->fd = -1;
-			fd_ptr->fd_readonly = -1;
-			fd_ptr->fd_writeonly = -1;
-			fd_ptr->real_open_flags = -1;
-			fd_ptr->ref_count++;
-			/* Increment max used counter if neccessary, cuts down
-			   on search time when re-using */
-			if (i > max_file_fd_used)
-				max_file_fd_used = i;
-			DEBUG("Allocated new struct open_fd %d, dev = %x, "
-			      "inode = %x\n",
-			      i, fd_ptr->dev, fd_ptr->inode);
-			return fd_ptr;
+/****************************************************************************
+fd support routines - set the dev and inode of a newly opened file and add
+it to the hash table, which doubles in size when it gets full
+****************************************************************************/
+static void fd_set_inode(struct open_fd *fd_ptr, struct stat *sbuf)
+{
+	struct session *s = current_session;
+	struct open_fd **old_chains = s->fd_chains, *f, *next;
+	int old_num_chains = s->num_fd_chains;
+	unsigned int i;
+
+	fd_ptr->dev = sbuf->st_dev;
+	fd_ptr->inode = sbuf->st_ino;
+
+	if (s->num_fds >= s->num_fd_chains) {
+		s->num_fd_chains *= 2;
+		s->fd_chains = checked_calloc(s->num_fd_chains,
+		                              sizeof(struct open_fd *));
+		for (i = 0; i < old_num_chains; i++) {
+			for (f = old_chains[i]; f != NULL; f = next) {
+				next = f->next;
+				f->next = s->fd_chains[fd_chain(f->dev,
+				                                f->inode)];
+				s->fd_chains[fd_chain(f->dev, f->inode)] = f;
+			}
 		}
+		free(old_chains);
 	}
-	WARNING("ERROR! Out of file_fd structures - perhaps increase "
-	        "MAX_OPEN_FILES?\n");
-	return 0;
+
+	i = fd_chain(fd_ptr->dev, fd_ptr->inode);
+	fd_ptr->next = s->fd_chains[i];
+	s->fd_chains[i] = fd_ptr;
+	++s->num_fds;
 }
 
 /****************************************************************************
@@ -901,34 +1254,60 @@ static void fd_attempt_reopen(char *fname, int mode, struct open_fd *fd_ptr)
 	fd_ptr->real_open_flags = O_RDWR;
 }
 
+/****************************************************************************
+fd support routines - keep the fd of a file whose last handle has been
+closed, in case it is opened again soon. Returns false if it cannot be kept.
+An fd that locks have been taken through is not kept, since fcntl() locks
+on it (when there is no lock table, or locks are mirrored) would only be
+released by closing it.
+****************************************************************************/
+static bool fd_cache_add(struct open_fd *fd_ptr)
+{
+	struct session *s = current_session;
+	struct stat st;
+
+	if (fd_ptr->fd == -1 || fd_ptr->inode == (ino_t) -1 ||
+	    fd_ptr->locked || locking_fcntl_only() ||
+	    fstat(fd_ptr->fd, &st) != 0) {
+		return false;
+	}
+
+	if (s->num_fd_cache == FD_CACHE_SIZE) {
+		fd_free(fd_cache_remove(0));
+	}
+
+	/* to check that the file has not changed if it is opened again */
+	fd_ptr->mtime = st.st_mtim;
+	fd_ptr->ctime = st.st_ctim;
+	fd_ptr->close_time = time(NULL);
+	s->fd_cache[s->num_fd_cache++] = fd_ptr;
+	++num_cached_fds;
+
+	return true;
+}
+
 /****************************************************************************
 fd support routines - attempt to close the file referenced by this fd.
-Decrements the ref_count and returns it.
+Decrements the ref_count and returns it; when it reaches zero the fd is
+kept in the fd cache, or closed and freed.
 ****************************************************************************/
 static int fd_attempt_close(struct open_fd *fd_ptr)
 {
-	DEBUG("open_fd %d, fd = %d, dev = %x, "
-	      "inode = %x, open_flags = %d, ref_count = %d.\n",
-	      fd_ptr - &FileFd[0], fd_ptr->fd, fd_ptr->dev, fd_ptr->inode,
-	      fd_ptr->real_open_flags, fd_ptr->ref_count);
-	if (fd_ptr->ref_count > 0) {
-		fd_ptr->ref_count--;
-		if (fd_ptr->ref_count == 0) {
-			if (fd_ptr->fd != -1)
-				close(fd_ptr->fd);
-			if (fd_ptr->fd_readonly != -1)
-				close(fd_ptr->fd_readonly);
-			if (fd_ptr->fd_writeonly != -1)
-				close(fd_ptr->fd_writeonly);
-			fd_ptr->fd = -1;
-			fd_ptr->fd_readonly = -1;
-			fd_ptr->fd_writeonly = -1;
-			fd_ptr->real_open_flags = -1;
-			fd_ptr->dev = (uint32_t) -1;
-			fd_ptr->inode = (uint32_t) -1;
-		}
+	DEBUG("fd = %d, dev = %lx, inode = %lx, open_flags = %d, "
+	      "ref_count = %d.\n",
+	      fd_ptr->fd, (unsigned long) fd_ptr->dev,
+	      (unsigned long) fd_ptr->inode, fd_ptr->real_open_flags,
+	      fd_ptr->ref_count);
+	if (fd_ptr->ref_count > 1) {
+		return --fd_ptr->ref_count;
+	}
+
+	fd_ptr->ref_count = 0;
+	if (!fd_cache_add(fd_ptr)) {
+		fd_free(fd_ptr);
 	}
-	return fd_ptr->ref_count;
+
+	return 0;
 }
 
 /****************************************************************************
@@ -1014,7 +1393,7 @@ static void open_file(int fnum, int cnum, char *fname1, int flags, int mode,
 		 * Check it wasn't open for exclusive use.
 		 */
 		if ((flags & O_CREAT) && (flags & O_EXCL)) {
-			fd_ptr->ref_count--;
+			fd_attempt_close(fd_ptr);
 			errno = EEXIST;
 			return;
 		}
@@ -1043,7 +1422,7 @@ static void open_file(int fnum, int cnum, char *fname1, int flags, int mode,
 			      fd_ptr->real_open_flags, fname, strerror(EACCES),
 			      flags);
 			check_for_pipe(fname);
-			fd_ptr->ref_count--;
+			fd_attempt_close(fd_ptr);
 			return;
 		}
 
@@ -1109,16 +1488,20 @@ static void open_file(int fnum, int cnum, char *fname1, int flags, int mode,
 			sbuf = &statbuf;
 		}
 
-		/* Set the correct entries in fd_ptr. */
-		fd_ptr->dev = (uint32_t) sbuf->st_dev;
-		fd_ptr->inode = (uint32_t) sbuf->st_ino;
+		/* Set the correct entries in fd_ptr, if it is new. */
+		if (fd_ptr->inode == (ino_t) -1) {
+			fd_set_inode(fd_ptr, sbuf);
+		}
 
 		fsp->fd_ptr = fd_ptr;
+		fsp->dev = sbuf->st_dev;
+		fsp->ino = sbuf->st_ino;
 		Connections[cnum].num_files_open++;
+		current_session->num_files_open++;
 		fsp->mode = sbuf->st_mode;
 		gettimeofday(&fsp->open_time, NULL);
 		fsp->size = 0;
-		fsp->pos = -1;
+		fsp->pos = 0;
 		fsp->open = true;
 		fsp->can_lock = true;
 		fsp->can_read = ((flags & O_WRONLY) == 0);
@@ -1136,6 +1519,22 @@ static void open_file(int fnum, int cnum, char *fname1, int flags, int mode,
 	}
 }
 
+/****************************************************************************
+  add a file slot to the end of the free list
+****************************************************************************/
+static void push_free_file(int fnum)
+{
+	struct session *s = current_session;
+
+	Files[fnum].next_free = 0;
+	if (s->free_files == 0) {
+		s->free_files = fnum;
+	} else {
+		Files[s->last_free_file].next_free = fnum;
+	}
+	s->last_free_file = fnum;
+}
+
 /****************************************************************************
 close a file - possibly invalidating the read prediction
 
@@ -1149,14 +1548,17 @@ void close_file(int fnum, bool normal_close)
 	struct open_file *fs_p = &Files[fnum];
 	int cnum = fs_p->cnum;
 
-	Files[fnum].reserved = false;
+	remove_blocking_locks(fnum, normal_close);
 
 	fs_p->open = false;
 	Connections[cnum].num_files_open--;
+	current_session->num_files_open--;
 	free(fs_p->wbmpx_ptr);
 	fs_p->wbmpx_ptr = NULL;
 
+	release_file_locks(fnum);
 	fd_attempt_close(fs_p->fd_ptr);
+	oplock_remove_file(fnum);
 
 	DEBUG("closed file %s (numopen=%d)\n", fs_p->name,
 	      Connections[cnum].num_files_open);
@@ -1167,6 +1569,7 @@ void close_file(int fnum, bool normal_close)
 
 	/* we will catch bugs faster by zeroing this structure */
 	memset(fs_p, 0, sizeof(*fs_p));
+	push_free_file(fnum);
 }
 
 /****************************************************************************
@@ -1243,6 +1646,11 @@ void open_file_shared(int fnum, int cnum, char *fname, int share_mode, int ofun,
 	if (deny_mode == DENY_FCB)
 		deny_mode = DENY_DOS;
 
+	/* another client may be caching the file */
+	if (file_existed) {
+		oplock_break_others(sbuf.st_dev, sbuf.st_ino);
+	}
+
 	unixmode = unix_mode(cnum, dosmode);
 	DEBUG("calling open_file with flags=0x%X flags2=0x%X mode=0%o\n", flags,
 	      flags2, unixmode);
@@ -1257,6 +1665,12 @@ void open_file_shared(int fnum, int cnum, char *fname, int share_mode, int ofun,
 
 	if (fs_p->open) {
 		int open_mode = 0;
+
+		/* an oplock may have been granted to another client since
+		   the check above; none can be now that we are in the table */
+		oplock_add_file(fnum);
+		oplock_break_others(fs_p->dev, fs_p->ino);
+
 		switch (flags) {
 		case O_RDWR:
 			open_mode = 2;
@@ -1273,6 +1687,9 @@ void open_file_shared(int fnum, int cnum, char *fname, int share_mode, int ofun,
 		if (!file_existed || (flags & (O_CREAT | O_TRUNC)) != 0) {
 			write_dosattrib(fname, dosmode);
 		}
+		if (!file_existed) {
+			watch_changed(CONN_SHARE(cnum), fname);
+		}
 
 		fs_p->share_mode = (deny_mode << 4) | open_mode;
 
@@ -1299,39 +1716,24 @@ void open_file_shared(int fnum, int cnum, char *fname, int share_mode, int ofun,
 	}
 }
 
-/****************************************************************************
-seek a file. Try to avoid the seek if possible
-****************************************************************************/
-int seek_file(int fnum, uint32_t pos)
-{
-	uint32_t offset = 0;
-
-	Files[fnum].pos =
-	    (int) (lseek(Files[fnum].fd_ptr->fd, pos + offset, SEEK_SET) -
-	           offset);
-	return Files[fnum].pos;
-}
-
 /****************************************************************************
 read from a file
 ****************************************************************************/
-int read_file(int fnum, char *data, uint32_t pos, int n)
+int read_file(int fnum, char *data, off_t pos, int n)
 {
-	int ret = 0, readret;
+	int ret;
 
 	if (n <= 0)
-		return ret;
+		return 0;
 
-	if (seek_file(fnum, pos) != pos) {
-		DEBUG("Failed to seek to %d\n", pos);
-		return ret;
+	ret = pread(Files[fnum].fd_ptr->fd, data, n, pos);
+	if (ret < 0) {
+		DEBUG("Failed to read %d bytes at %lld: %s\n", n,
+		      (long long) pos, strerror(errno));
+		return 0;
 	}
 
-	if (n > 0) {
-		readret = read(Files[fnum].fd_ptr->fd, data, n);
-		if (readret > 0)
-			ret += readret;
-	}
+	Files[fnum].pos = pos + ret;
 
 	return ret;
 }
@@ -1339,8 +1741,10 @@ int read_file(int fnum, char *data, uint32_t pos, int n)
 /****************************************************************************
 write to a file
 ****************************************************************************/
-int write_file(int fnum, char *data, int n)
+int write_file(int fnum, char *data, off_t pos, int n)
 {
+	int ret;
+
 	if (!Files[fnum].can_write) {
 		errno = EPERM;
 		return 0;
@@ -1351,7 +1755,8 @@ int write_file(int fnum, char *data, int n)
 		Files[fnum].modified = true;
 		if (fstat(Files[fnum].fd_ptr->fd, &st) == 0) {
 			int dosmode =
-			    dos_mode(Files[fnum].cnum, Files[fnum].name, &st);
+			    dos_mode_fd(Files[fnum].cnum, Files[fnum].name,
+			                Files[fnum].fd_ptr->fd, &st);
 			if (!IS_DOS_ARCHIVE(dosmode)) {
 				dos_chmod(Files[fnum].cnum, Files[fnum].name,
 				          dosmode | aARCH, &st);
@@ -1359,7 +1764,12 @@ int write_file(int fnum, char *data, int n)
 		}
 	}
 
-	return write_data(Files[fnum].fd_ptr->fd, data, n);
+	ret = pwrite_data(Files[fnum].fd_ptr->fd, data, n, pos);
+	if (ret > 0) {
+		Files[fnum].pos = pos + ret;
+	}
+
+	return ret;
 }
 
 /****************************************************************************
@@ -1581,7 +1991,8 @@ static void drop_privileges(void)
 	}
 }
 
-static int open_server_socket(int type, int port, in_addr_t socket_addr)
+static int open_server_socket(int type, int port, in_addr_t socket_addr,
+                              bool reuseport)
 {
 	struct sockaddr_in sock;
 	int one = 1;
@@ -1594,6 +2005,12 @@ static int open_server_socket(int type, int port, in_addr_t socket_addr)
 	}
 
 	setsockopt(res, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one));
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		setsockopt(res, SOL_SOCKET, SO_REUSEPORT, (char *) &one,
+		           sizeof(one));
+	}
+#endif
 
 	sock.sin_family = AF_INET;
 	sock.sin_port = htons(port);
@@ -1614,7 +2031,7 @@ static int open_server_socket(int type, int port, in_addr_t socket_addr)
 
 /* is_private_peer checks if the connecting client comes either from a
  * localhost address or from one of the RFC 1918 private ranges. */
-static bool is_private_peer(void)
+static bool is_private_peer(int fd)
 {
 	struct sockaddr_in sockin;
 	socklen_t length = sizeof(sockin);
@@ -1629,7 +2046,7 @@ static bool is_private_peer(void)
 	    {inet_addr("127.0.0.1"), 8},
 	};
 
-	if (getpeername(Client, (struct sockaddr *) &sockin, &length) < 0) {
+	if (getpeername(fd, (struct sockaddr *) &sockin, &length) < 0) {
 		ERROR("is_private_peer: getpeername failed\n");
 		return false;
 	}
@@ -1671,7 +2088,8 @@ static void set_descriptive_argv(void)
 	size_t buf_len;
 	int i;
 
-	if (original_argc < 2) {
+	/* one process serves many clients in event mode */
+	if (original_argc < 2 || event_mode) {
 		return;
 	}
 	/* Clear all old args and replace with our own descriptive data about
@@ -1704,92 +2122,337 @@ static void set_descriptive_argv(void)
 }
 
 /****************************************************************************
-  open the socket communication
+  accept a connection on the listening socket. Returns -1 if there is nothing
+  to accept or if the peer is not allowed to connect; otherwise the peer's
+  address is saved to peer_addr.
 ****************************************************************************/
-static bool open_sockets(int port)
+static int accept_connection(int server_socket, char *peer_addr,
+                             size_t peer_addr_len)
 {
-	struct in_addr addr;
-	int server_socket;
+	struct sockaddr addr;
+	socklen_t in_addrlen = sizeof(addr);
+	int fd;
 
-	/* Stop zombies */
-	signal(SIGCHLD, SIGNAL_CAST sigchld_handler);
-
-	atexit(killkids);
+	fd = accept(server_socket, &addr, &in_addrlen);
 
-	/* open an incoming socket */
-	if (inet_aton(bind_addr, &addr) == 0) {
-		ERROR("open_sockets: failed to parse bind address %s\n",
-		      bind_addr);
-		return false;
-	}
-	server_socket = open_server_socket(SOCK_STREAM, port, addr.s_addr);
-	if (server_socket == -1) {
-		return false;
+	if (fd == -1) {
+		if (errno != EINTR && errno != EAGAIN) {
+			ERROR("accept_connection: accept: %s\n",
+			      strerror(errno));
+		}
+		return -1;
 	}
 
-	drop_privileges();
+	strlcpy(peer_addr, get_peer_addr(fd), peer_addr_len);
 
-	/* ready to listen */
-	if (listen(server_socket, 5) == -1) {
-		ERROR("open_sockets: listen: %s\n", strerror(errno));
-		close(server_socket);
-		return false;
+	/* The BSD sockets API does not provide any way to reject TCP
+	   connections, the best we can do is to accept the connection
+	   and then immediately close it. By default we only allow
+	   connections from local peers on the same private IP range. */
+	if (!is_private_peer(fd)) {
+		if (!allow_public_connections) {
+			ERROR("accept_connection: rejecting connection from "
+			      "public IP address %s\n",
+			      peer_addr);
+			close(fd);
+			return -1;
+		}
+		/* even if allowed, log a warning */
+		ERROR("accept_connection: warning: connection from "
+		      "public IP address %s\n",
+		      peer_addr);
 	}
 
-	/* now accept incoming connections - forking a new process
-	   for each incoming connection */
-	DEBUG("waiting for a connection\n");
-	while (1) {
-		const char *peer_addr;
-		fd_set listen_set;
-		int num;
-		struct sockaddr addr;
-		socklen_t in_addrlen = sizeof(addr);
+	return fd;
+}
+
+/****************************************************************************
+  open a socket and start listening on it
+****************************************************************************/
+static int open_listen_socket(int port, in_addr_t addr, bool reuseport)
+{
+	int server_socket;
+
+	server_socket = open_server_socket(SOCK_STREAM, port, addr, reuseport);
+	if (server_socket == -1) {
+		return -1;
+	}
+
+	if (listen(server_socket, listen_backlog) == -1) {
+		ERROR("open_listen_socket: listen: %s\n", strerror(errno));
+		close(server_socket);
+		return -1;
+	}
+
+	return server_socket;
+}
+
+static void event_loop(int server_socket);
+static void worker_loop(int server_socket);
+
+/****************************************************************************
+  the SIGCHLD handler used by the parent of the worker pool; it only needs
+  to interrupt select() so that dead workers are noticed straight away
+****************************************************************************/
+static void sigchld_wakeup(int sig)
+{
+}
+
+/****************************************************************************
+  fork a prefork worker process into the given slot
+****************************************************************************/
+static void start_worker(int slot)
+{
+	struct worker_slot *w = &worker_slots[slot];
+	pid_t pid;
+	int i;
+
+	w->busy = false;
+	w->start_time = time(NULL);
+
+	pid = fork();
+	if (pid == -1) {
+		ERROR("start_worker: fork: %s\n", strerror(errno));
+		return;
+	} else if (pid != 0) {
+		w->pid = pid;
+		return;
+	}
+
+	am_parent = 0;
+	worker_slot = slot;
+	signal(SIGCHLD, SIGNAL_CAST SIG_DFL);
+	/* a dead client shows up as a write error instead */
+	signal(SIGPIPE, SIGNAL_CAST SIG_IGN);
+
+	for (i = 0; i < num_worker_sockets; i++) {
+		if (worker_sockets[i] != w->socket) {
+			close(worker_sockets[i]);
+		}
+	}
+	close(worker_pipe[0]);
+	stats_close_socket();
+
+	close_low_fds();
+
+	if (event_mode) {
+		event_loop(w->socket);
+	} else {
+		worker_loop(w->socket);
+	}
+	exit(1);
+}
+
+/****************************************************************************
+  count the workers that are waiting for a connection
+****************************************************************************/
+static int idle_workers(void)
+{
+	int i, result = 0;
+
+	for (i = 0; i < num_worker_slots; i++) {
+		if (worker_slots[i].pid != 0 && !worker_slots[i].busy) {
+			++result;
+		}
+	}
+
+	return result;
+}
+
+/****************************************************************************
+  run the prefork worker pool. In event mode, each worker serves many
+  clients at once, so there is a fixed number of them and each gets its own
+  SO_REUSEPORT socket (where supported) so that the kernel spreads incoming
+  connections between them. Otherwise each worker serves one client at a
+  time; since a client may stay connected for hours, an idle worker must
+  never have connections queued behind a busy one, so the workers all accept
+  from the same socket and the pool grows and shrinks to keep num_workers
+  idle workers ready.
+****************************************************************************/
+static void run_workers(int port, in_addr_t addr)
+{
+	int i;
+
+	num_worker_slots = event_mode ? num_workers : MAX_WORKERS;
+	num_worker_sockets = event_mode ? num_workers : 1;
+
+	worker_slots = mmap(NULL, num_worker_slots * sizeof(struct worker_slot),
+	                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	                    -1, 0);
+	if (worker_slots == MAP_FAILED) {
+		ERROR("run_workers: mmap: %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(worker_slots, 0, num_worker_slots * sizeof(struct worker_slot));
+
+	worker_sockets = checked_calloc(num_worker_sockets, sizeof(int));
+	for (i = 0; i < num_worker_sockets; i++) {
+#ifdef SO_REUSEPORT
+		worker_sockets[i] = open_listen_socket(port, addr, true);
+#else
+		worker_sockets[i] = i == 0 ? open_listen_socket(port, addr, false)
+		                           : worker_sockets[0];
+#endif
+		if (worker_sockets[i] == -1) {
+			exit(1);
+		}
+	}
+	for (i = 0; i < num_worker_slots; i++) {
+		worker_slots[i].socket = worker_sockets[i % num_worker_sockets];
+	}
+
+	if (pipe(worker_pipe) != 0) {
+		ERROR("run_workers: pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	drop_privileges();
+
+	signal(SIGCHLD, sigchld_wakeup);
+
+	for (i = 0; i < num_workers; i++) {
+		start_worker(i);
+	}
+
+	while (true) {
+		struct timeval tv = {SMBD_SELECT_LOOP, 0};
+		char buf[32];
+		fd_set fds;
+		int status;
+		pid_t pid;
+
+		FD_ZERO(&fds);
+		FD_SET(worker_pipe[0], &fds);
+		if (stats_socket() != -1) {
+			FD_SET(stats_socket(), &fds);
+		}
+
+		/* woken when a worker picks up a connection */
+		if (select(MAX(worker_pipe[0], stats_socket()) + 1, &fds, NULL,
+		           NULL, &tv) > 0) {
+			if (FD_ISSET(worker_pipe[0], &fds) &&
+			    read(worker_pipe[0], buf, sizeof(buf)) < 0) {
+				DEBUG("run_workers: read: %s\n",
+				      strerror(errno));
+			}
+			if (stats_socket() != -1 &&
+			    FD_ISSET(stats_socket(), &fds)) {
+				stats_serve();
+			}
+		}
+
+		while ((pid = waitpid((pid_t) -1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < num_worker_slots; i++) {
+				if (worker_slots[i].pid == pid) {
+					worker_slots[i].pid = 0;
+					break;
+				}
+			}
+			if (status != 0) {
+				WARNING("worker process (pid %ld) terminated "
+				        "abnormally, status=%d\n",
+				        (long) pid, status);
+			}
+			/* event mode workers are always restarted; don't
+			   spin if they are dying straight away */
+			if (event_mode && i < num_worker_slots) {
+				if (time(NULL) - worker_slots[i].start_time <
+				    1) {
+					sleep(1);
+				}
+				start_worker(i);
+			}
+		}
+
+		if (event_mode) {
+			continue;
+		}
+
+		for (i = 0; i < num_worker_slots && idle_workers() < num_workers;
+		     i++) {
+			if (worker_slots[i].pid == 0) {
+				start_worker(i);
+			}
+		}
+	}
+}
+
+/****************************************************************************
+  open the socket communication
+****************************************************************************/
+static bool open_sockets(int port)
+{
+	struct in_addr addr;
+	int server_socket;
+
+	atexit(killkids);
+
+	/* open an incoming socket */
+	if (inet_aton(bind_addr, &addr) == 0) {
+		ERROR("open_sockets: failed to parse bind address %s\n",
+		      bind_addr);
+		return false;
+	}
+
+	if (num_workers > 0) {
+		run_workers(port, addr.s_addr);
+		return false;
+	}
+
+	/* Stop zombies */
+	signal(SIGCHLD, SIGNAL_CAST sigchld_handler);
+
+	server_socket = open_listen_socket(port, addr.s_addr, false);
+	if (server_socket == -1) {
+		return false;
+	}
+
+	drop_privileges();
+
+	if (event_mode) {
+		event_loop(server_socket);
+		exit(1);
+	}
+
+	switch_session(new_session(-1));
+
+	/* now accept incoming connections - forking a new process
+	   for each incoming connection */
+	DEBUG("waiting for a connection\n");
+	while (1) {
+		fstring peer_addr;
+		fd_set listen_set;
+		int num;
 
 		FD_ZERO(&listen_set);
 		FD_SET(server_socket, &listen_set);
+		if (stats_socket() != -1) {
+			FD_SET(stats_socket(), &listen_set);
+		}
 
-		num = select(server_socket + 1, &listen_set, NULL, NULL, NULL);
+		num = select(MAX(server_socket, stats_socket()) + 1,
+		             &listen_set, NULL, NULL, NULL);
 
 		if (num < 0 && errno == EINTR) {
 			continue;
 		}
 
+		if (stats_socket() != -1 &&
+		    FD_ISSET(stats_socket(), &listen_set)) {
+			stats_serve();
+		}
+
 		if (!FD_ISSET(server_socket, &listen_set)) {
 			continue;
 		}
 
-		Client = accept(server_socket, &addr, &in_addrlen);
-
-		if (Client == -1 && errno == EINTR)
-			continue;
+		Client = accept_connection(server_socket, peer_addr,
+		                           sizeof(peer_addr));
 
 		if (Client == -1) {
-			ERROR("open_sockets: accept: %s\n", strerror(errno));
 			continue;
 		}
 
-		peer_addr = get_peer_addr(Client);
-
-		/* The BSD sockets API does not provide any way to reject TCP
-		   connections, the best we can do is to accept the connection
-		   and then immediately close it. By default we only allow
-		   connections from local peers on the same private IP range. */
-		if (!is_private_peer()) {
-			if (!allow_public_connections) {
-				ERROR("open_sockets: rejecting connection from "
-				      "public IP address %s\n",
-				      peer_addr);
-				close(Client);
-				Client = -1;
-				continue;
-			}
-			/* even if allowed, log a warning */
-			ERROR("open_sockets: warning: connection from "
-			      "public IP address %s\n",
-			      peer_addr);
-		}
-
 		if (fork() == 0) {
 			/* save a copy of the client's address to include log
 			 * messages */
@@ -1801,8 +2464,9 @@ static bool open_sockets(int port)
 			signal(SIGPIPE, SIGNAL_CAST sig_pipe);
 			signal(SIGCHLD, SIGNAL_CAST SIG_DFL);
 
-			/* close the listening socket */
+			/* close the listening sockets */
 			close(server_socket);
+			stats_close_socket();
 
 			/* close our standard file descriptors */
 			close_low_fds();
@@ -1813,6 +2477,7 @@ static bool open_sockets(int port)
 			return true;
 		}
 		close(Client); /* The parent doesn't need this socket */
+		Client = -1;
 	}
 
 	return true;
@@ -1840,7 +2505,7 @@ static bool receive_smb(int fd, char *buffer, size_t buflen, int timeout)
 
 	if (len > buflen) {
 		ERROR("Invalid packet length! (%d bytes).\n", len);
-		exit(1);
+		exit_server("invalid packet length");
 	}
 
 	if (len > 0) {
@@ -1853,21 +2518,26 @@ static bool receive_smb(int fd, char *buffer, size_t buflen, int timeout)
 	return true;
 }
 
+/* SMBs that arrived from the client while waiting for an oplock break, to
+   be processed in order afterwards; once the queue is full, nothing more is
+   read from the client until it has been processed */
+#define MAX_PENDING_SMBS 16
+static char *pending_smbs[MAX_PENDING_SMBS];
+static int num_pending_smbs = 0;
+
 /****************************************************************************
-  Do a select on an two fd's - with timeout.
+  Do a select on the client socket and the message socket - with timeout.
 
-  If a local udp message has been pushed onto the
-  queue (this can only happen during oplock break
-  processing) return this first.
+  If an smb was received while waiting for an oplock to be released
+  elsewhere, return it first.
 
-  If a pending smb message has been pushed onto the
-  queue (this can only happen during oplock break
-  processing) return this next.
+  Blocking lock requests are tried again when locks are released, or when
+  they are due to be, and answered if they can be. Likewise, find notify
+  requests are answered when there are changes, or when they time out.
 
-  If the first smbfd is ready then read an smb from it.
-  if the second (loopback UDP) fd is ready then read a message
-  from it and setup the buffer header to identify the length
-  and from address.
+  If the client socket is ready then read an smb from it and set *got_smb.
+  If the message socket is ready then handle the message waiting on it, and
+  if there are changes to watched directories, read them.
   Returns false on timeout or error.
   Else returns true.
 
@@ -1876,24 +2546,56 @@ The timeout is in milli seconds
 static bool receive_message_or_smb(int smbfd, char *buffer, int buffer_len,
                                    int timeout, bool *got_smb)
 {
-	fd_set fds;
-	int selrtn;
-	struct timeval to;
+	struct pollfd fds[3];
+	int selrtn, msg_fd, wait;
 
 	smb_read_error = 0;
 
 	*got_smb = false;
 
-	do {
-		FD_ZERO(&fds);
-		FD_SET(smbfd, &fds);
-
-		to.tv_sec = timeout / 1000;
-		to.tv_usec = (timeout % 1000) * 1000;
+	if (num_pending_smbs > 0) {
+		memcpy(buffer, pending_smbs[0], smb_len(pending_smbs[0]) + 4);
+		free(pending_smbs[0]);
+		--num_pending_smbs;
+		memmove(pending_smbs, pending_smbs + 1,
+		        num_pending_smbs * sizeof(char *));
+		*got_smb = true;
+		return true;
+	}
 
-		selrtn = select(smbfd + 1, &fds, NULL, NULL,
-		                timeout > 0 ? &to : NULL);
-	} while (selrtn < 0 && errno == EINTR);
+	for (;;) {
+		process_blocking_locks();
+		process_notify_requests();
+		fd_cache_expire(false);
+		wait = fd_cache_wait(notify_wait(blocking_lock_wait(timeout)));
+		msg_fd = message_socket();
+
+		/* poll() rather than select(), since the message socket may
+		   be opened after many files and so have a large number */
+		fds[0].fd = smbfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = msg_fd;
+		fds[1].events = POLLIN;
+		fds[2].fd = notify_fd();
+		fds[2].events = POLLIN;
+		fds[0].revents = fds[1].revents = fds[2].revents = 0;
+
+		/* a negative fd is ignored by poll() */
+		selrtn = poll(fds, 3, wait > 0 ? wait : -1);
+
+		/* we may have been interrupted by SIGUSR1 */
+		check_stats_request();
+
+		if (selrtn == 0 && wait != timeout) {
+			/* woken early to try blocking locks again, or to
+			   close cached fds */
+			if (timeout > 0) {
+				timeout -= wait;
+			}
+		} else if (selrtn >= 0 || errno != EINTR) {
+			break;
+		}
+	}
 
 	/* Check if error */
 	if (selrtn == -1) {
@@ -1908,7 +2610,17 @@ static bool receive_message_or_smb(int smbfd, char *buffer, int buffer_len,
 		return false;
 	}
 
-	if (FD_ISSET(smbfd, &fds)) {
+	if (msg_fd != -1 && fds[1].revents != 0) {
+		message_receive();
+		return true;
+	}
+
+	if (fds[2].fd != -1 && fds[2].revents != 0) {
+		notify_receive();
+		return true;
+	}
+
+	if (fds[0].revents != 0) {
 		*got_smb = true;
 		return receive_smb(smbfd, buffer, buffer_len, 0);
 	} else {
@@ -1916,6 +2628,63 @@ static bool receive_message_or_smb(int smbfd, char *buffer, int buffer_len,
 	}
 }
 
+/****************************************************************************
+  wait for a message on the message socket while waiting for another process
+  to release an oplock; for at most the given time in milli seconds.
+
+  Oplock breaks for files this process has open are still passed on to the
+  client, and a client releasing an oplock is handled straight away, since
+  two processes may each be waiting for the other's client. Any other smb
+  from the client is kept to be processed later.
+****************************************************************************/
+void wait_for_oplock_message(int timeout)
+{
+	int msg_fd = message_socket();
+	struct pollfd fds[2];
+	char *buf;
+	int fnum;
+
+	/* a negative fd is ignored by poll() */
+	fds[0].fd = msg_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = num_pending_smbs < MAX_PENDING_SMBS ? Client : -1;
+	fds[1].events = POLLIN;
+	fds[0].revents = fds[1].revents = 0;
+
+	if (poll(fds, 2, timeout) <= 0) {
+		return;
+	}
+
+	if (fds[0].revents != 0) {
+		message_receive();
+	}
+
+	if (fds[1].revents == 0) {
+		return;
+	}
+
+	buf = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
+	if (!receive_smb(Client, buf, BUFFER_SIZE, 0)) {
+		free(buf);
+		exit_server("client went away while waiting for oplock break");
+	}
+
+	fnum = SVAL(buf, smb_vwv2);
+	if (CVAL(buf, 0) == 0x85) {
+		/* Keepalive packet. */
+		free(buf);
+	} else if (CVAL(buf, smb_com) == SMBlockingX &&
+	           CVAL(buf, smb_vwv0) == 0xFF &&
+	           (CVAL(buf, smb_vwv3) & LOCKING_ANDX_OPLOCK_RELEASE) != 0 &&
+	           SVAL(buf, smb_vwv6) == 0 && SVAL(buf, smb_vwv7) == 0 &&
+	           OPEN_FNUM(fnum)) {
+		oplock_release(fnum);
+		free(buf);
+	} else {
+		pending_smbs[num_pending_smbs++] = buf;
+	}
+}
+
 /****************************************************************************
 Get the next SMB packet, doing the local message processing automatically.
 ****************************************************************************/
@@ -2016,8 +2785,9 @@ int make_connection(char *service, char *dev)
 	pcon = &Connections[cnum];
 	bzero((char *) pcon, sizeof(*pcon));
 
-	pcon->read_only =
-	    share == ipc_service || !dir_world_writeable(share->path);
+	/* an indexed share must not change, or the index would be stale */
+	pcon->read_only = share == ipc_service || shareindex_enabled(share) ||
+	                  !dir_world_writeable(share->path);
 	pcon->num_files_open = 0;
 	pcon->lastused = time(NULL);
 	pcon->share = share;
@@ -2063,47 +2833,89 @@ int make_connection(char *service, char *dev)
 }
 
 /****************************************************************************
-  find first available file slot
+  grow the file table, adding the new slots to the free list. Returns false
+  if it is already as large as it can be.
 ****************************************************************************/
-int find_free_file(void)
+static bool grow_file_table(void)
 {
-	int i;
-	static int first_file;
+	struct session *s = current_session;
+	int old_slots = num_file_slots, new_slots, first, i;
+
+	if (old_slots > max_open_files) {
+		return false;
+	}
+	if (old_slots == 0) {
+		new_slots = INITIAL_FILE_SLOTS;
+	} else {
+		new_slots = old_slots * 2;
+	}
+	if (new_slots > max_open_files + 1) {
+		new_slots = max_open_files + 1;
+	}
+
+	Files = checked_realloc(Files, new_slots * sizeof(struct open_file));
+	memset(&Files[old_slots], 0,
+	       (new_slots - old_slots) * sizeof(struct open_file));
+	num_file_slots = new_slots;
+	s->files = Files;
+	s->num_file_slots = num_file_slots;
 
 	/* we want to give out file handles differently on each new
 	   connection because of a common bug in MS clients where they try to
 	   reuse a file descriptor from an earlier smb connection. This code
 	   increases the chance that the errant client will get an error rather
-	   than causing corruption */
-	if (first_file == 0) {
-		first_file = (getpid() ^ (int) time(NULL)) % MAX_OPEN_FILES;
-		if (first_file == 0)
-			first_file = 1;
+	   than causing corruption. Returning a file handle of 0 is a bad idea
+	   - so we start at 1 */
+	if (old_slots == 0) {
+		old_slots = 1;
+		first = 1 + (getpid() ^ (int) time(NULL)) % (new_slots - 1);
+	} else {
+		first = old_slots;
 	}
 
-	if (first_file >= MAX_OPEN_FILES)
-		first_file = 1;
+	for (i = 0; i < new_slots - old_slots; i++) {
+		push_free_file(old_slots + (first - old_slots + i) %
+		                               (new_slots - old_slots));
+	}
 
-	for (i = first_file; i < MAX_OPEN_FILES; i++)
-		if (!Files[i].open && !Files[i].reserved) {
-			memset(&Files[i], 0, sizeof(Files[i]));
-			first_file = i + 1;
-			Files[i].reserved = true;
-			return i;
-		}
+	DEBUG("file table grown to %d slots\n", new_slots);
 
-	/* returning a file handle of 0 is a bad idea - so we start at 1 */
-	for (i = 1; i < first_file; i++)
-		if (!Files[i].open && !Files[i].reserved) {
-			memset(&Files[i], 0, sizeof(Files[i]));
-			first_file = i + 1;
-			Files[i].reserved = true;
-			return i;
-		}
+	return true;
+}
 
-	WARNING("ERROR! Out of file structures - perhaps increase "
-	        "MAX_OPEN_FILES?\n");
-	return -1;
+/****************************************************************************
+  find an available file slot, taking it from the front of the free list
+****************************************************************************/
+int find_free_file(void)
+{
+	struct session *s = current_session;
+	int fnum;
+
+	if (s->free_files == 0 && !grow_file_table()) {
+		WARNING("Out of file structures - client has %d files open; "
+		        "perhaps increase the limit with -f?\n",
+		        max_open_files);
+		return -1;
+	}
+
+	fnum = s->free_files;
+	s->free_files = Files[fnum].next_free;
+
+	memset(&Files[fnum], 0, sizeof(Files[fnum]));
+	Files[fnum].reserved = true;
+
+	return fnum;
+}
+
+/****************************************************************************
+  give back a file slot returned by find_free_file() that was not opened
+****************************************************************************/
+void free_file(int fnum)
+{
+	if (Files[fnum].reserved && !Files[fnum].open) {
+		Files[fnum].reserved = false;
+		push_free_file(fnum);
+	}
 }
 
 /****************************************************************************
@@ -2408,7 +3220,7 @@ close all open files for a connection
 static void close_open_files(int cnum)
 {
 	int i;
-	for (i = 0; i < MAX_OPEN_FILES; i++)
+	for (i = 0; i < num_file_slots; i++)
 		if (Files[i].cnum == cnum && Files[i].open) {
 			close_file(i, false);
 		}
@@ -2430,6 +3242,7 @@ void close_cnum(int cnum)
 
 	close_open_files(cnum);
 	dptr_closecnum(cnum);
+	notify_closecnum(cnum);
 
 	Connections[cnum].open = false;
 	num_connections_open--;
@@ -2440,25 +3253,59 @@ void close_cnum(int cnum)
 }
 
 /****************************************************************************
-exit the server
+close all connections belonging to the current session, and its socket
 ****************************************************************************/
-void exit_server(char *reason)
+static void close_session(void)
 {
-	static int firsttime = 1;
+	struct dir_cache_stats stats;
 	int i;
 
-	if (!firsttime)
-		exit(0);
-	firsttime = 0;
+	if (current_session == NULL)
+		return;
 
 	DEBUG("Closing connections\n");
 	for (i = 0; i < MAX_CONNECTIONS; i++)
 		if (Connections[i].open)
 			close_cnum(i);
+
+	dir_cache_get_stats(&stats);
+	INFO("Directory cache: %lu hits (%lu shared), %lu misses, "
+	     "%lu evictions\n",
+	     stats.hits, stats.shared_hits, stats.misses, stats.evictions);
+	if (LOGLEVEL >= 3) {
+		log_request_stats();
+	}
+	stats_session_end(current_session->stats);
+	current_session->stats = NULL;
 	if (Client != -1) {
 		close(Client);
 		Client = -1;
 	}
+}
+
+/****************************************************************************
+exit the server
+****************************************************************************/
+void exit_server(char *reason)
+{
+	static int firsttime = 1;
+
+	/* In event mode, only the session for this client is ended and we
+	   jump back to the event loop. */
+	if (session_abort != NULL) {
+		jmp_buf *env = session_abort;
+
+		session_abort = NULL;
+		close_session();
+		INFO("Session closed (%s)\n", reason ? reason : "");
+		longjmp(*env, 1);
+	}
+
+	if (!firsttime)
+		exit(0);
+	firsttime = 0;
+
+	close_session();
 	if (!reason) {
 		int oldlevel = LOGLEVEL;
 		LOGLEVEL = 10;
@@ -2482,9 +3329,8 @@ are used by some brain-dead clients when printing, and I don't want to
 force write permissions on print services.
 */
 #define NEED_WRITE      (1 << 1)
-#define TIME_INIT       (1 << 2)
 #define ALLOWED_IN_IPC  (1 << 3)
-#define QUEUE_IN_OPLOCK (1 << 6)
+#define QUEUE_IN_OPLOCK (1 << 6) /* see wait_for_own_oplock_break() */
 
 /*
    define a list of possible SMB messages and their corresponding
@@ -2492,130 +3338,246 @@ force write permissions on print services.
    please feel free to contribute implementations!
 */
 
+/* Request latencies are counted in buckets by powers of two; bucket i counts
+   requests that took less than 2^(i+1) microseconds, except for the last,
+   which counts everything slower. */
+#define LATENCY_BUCKETS 24
+
 struct smb_message_struct {
-	int code;
 	char *name;
 	int (*fn)(char *, char *, int, int);
 	int flags;
-#if PROFILING
-	unsigned long time;
-#endif
-} smb_messages[] = {
+
+	/* statistics for the requests received by this process */
+	unsigned long count;
+	unsigned long long bytes_in, bytes_out;
+	unsigned long long total_usecs;
+	unsigned long latency[LATENCY_BUCKETS];
+};
+
+/* indexed by command code; commands with no name are unknown */
+static struct smb_message_struct smb_messages[256] = {
 
     /* CORE PROTOCOL */
 
-    {SMBnegprot, "SMBnegprot", reply_negprot, 0},
-    {SMBtcon, "SMBtcon", reply_tcon, 0},
-    {SMBtdis, "SMBtdis", reply_tdis, 0},
-    {SMBexit, "SMBexit", reply_exit, 0},
-    {SMBioctl, "SMBioctl", reply_ioctl, 0},
-    {SMBecho, "SMBecho", reply_echo, 0},
-    {SMBsesssetupX, "SMBsesssetupX", reply_sesssetup_and_X, 0},
-    {SMBtconX, "SMBtconX", reply_tcon_and_X, 0},
-    {SMBulogoffX, "SMBulogoffX", reply_ulogoffX,
-     0}, /* ulogoff doesn't give a valid TID */
-    {SMBgetatr, "SMBgetatr", reply_getatr, 0},
-    {SMBsetatr, "SMBsetatr", reply_setatr, NEED_WRITE},
-    {SMBchkpth, "SMBchkpth", reply_chkpth, 0},
-    {SMBsearch, "SMBsearch", reply_search, 0},
-    {SMBopen, "SMBopen", reply_open, QUEUE_IN_OPLOCK},
+    [SMBnegprot] = {"SMBnegprot", reply_negprot, 0},
+    [SMBtcon] = {"SMBtcon", reply_tcon, 0},
+    [SMBtdis] = {"SMBtdis", reply_tdis, 0},
+    [SMBexit] = {"SMBexit", reply_exit, 0},
+    [SMBioctl] = {"SMBioctl", reply_ioctl, 0},
+    [SMBecho] = {"SMBecho", reply_echo, 0},
+    [SMBsesssetupX] = {"SMBsesssetupX", reply_sesssetup_and_X, 0},
+    [SMBtconX] = {"SMBtconX", reply_tcon_and_X, 0},
+    /* ulogoff doesn't give a valid TID */
+    [SMBulogoffX] = {"SMBulogoffX", reply_ulogoffX, 0},
+    [SMBgetatr] = {"SMBgetatr", reply_getatr, 0},
+    [SMBsetatr] = {"SMBsetatr", reply_setatr, NEED_WRITE},
+    [SMBchkpth] = {"SMBchkpth", reply_chkpth, 0},
+    [SMBsearch] = {"SMBsearch", reply_search, 0},
+    [SMBopen] = {"SMBopen", reply_open, QUEUE_IN_OPLOCK},
 
     /* note that SMBmknew and SMBcreate are deliberately overloaded */
-    {SMBcreate, "SMBcreate", reply_mknew, 0},
-    {SMBmknew, "SMBmknew", reply_mknew, 0},
-
-    {SMBunlink, "SMBunlink", reply_unlink, NEED_WRITE | QUEUE_IN_OPLOCK},
-    {SMBread, "SMBread", reply_read, 0},
-    {SMBwrite, "SMBwrite", reply_write, 0},
-    {SMBclose, "SMBclose", reply_close, ALLOWED_IN_IPC},
-    {SMBmkdir, "SMBmkdir", reply_mkdir, NEED_WRITE},
-    {SMBrmdir, "SMBrmdir", reply_rmdir, NEED_WRITE},
-    {SMBdskattr, "SMBdskattr", reply_dskattr, 0},
-    {SMBmv, "SMBmv", reply_mv, NEED_WRITE | QUEUE_IN_OPLOCK},
+    [SMBcreate] = {"SMBcreate", reply_mknew, QUEUE_IN_OPLOCK},
+    [SMBmknew] = {"SMBmknew", reply_mknew, QUEUE_IN_OPLOCK},
+
+    [SMBunlink] = {"SMBunlink", reply_unlink, NEED_WRITE | QUEUE_IN_OPLOCK},
+    [SMBread] = {"SMBread", reply_read, 0},
+    [SMBwrite] = {"SMBwrite", reply_write, 0},
+    [SMBclose] = {"SMBclose", reply_close, ALLOWED_IN_IPC},
+    [SMBmkdir] = {"SMBmkdir", reply_mkdir, NEED_WRITE},
+    [SMBrmdir] = {"SMBrmdir", reply_rmdir, NEED_WRITE},
+    [SMBdskattr] = {"SMBdskattr", reply_dskattr, 0},
+    [SMBmv] = {"SMBmv", reply_mv, NEED_WRITE | QUEUE_IN_OPLOCK},
 
     /* this is a Pathworks specific call, allowing the
        changing of the root path */
-    {pSETDIR, "pSETDIR", reply_setdir, 0},
-
-    {SMBlseek, "SMBlseek", reply_lseek, 0},
-    {SMBflush, "SMBflush", reply_flush, 0},
-    {SMBctemp, "SMBctemp", reply_ctemp, QUEUE_IN_OPLOCK},
-    {SMBsplopen, "SMBsplopen", reply_printopen, QUEUE_IN_OPLOCK},
-    {SMBsplclose, "SMBsplclose", reply_printclose, 0},
-    {SMBsplretq, "SMBsplretq", reply_printqueue, 0},
-    {SMBsplwr, "SMBsplwr", reply_printwrite, 0},
-    {SMBlock, "SMBlock", reply_lock, 0},
-    {SMBunlock, "SMBunlock", reply_unlock, 0},
+    [(uint8_t) pSETDIR] = {"pSETDIR", reply_setdir, 0},
+
+    [SMBlseek] = {"SMBlseek", reply_lseek, 0},
+    [SMBflush] = {"SMBflush", reply_flush, 0},
+    [SMBctemp] = {"SMBctemp", reply_ctemp, QUEUE_IN_OPLOCK},
+    [SMBsplopen] = {"SMBsplopen", reply_printopen, QUEUE_IN_OPLOCK},
+    [SMBsplclose] = {"SMBsplclose", reply_printclose, 0},
+    [SMBsplretq] = {"SMBsplretq", reply_printqueue, 0},
+    [SMBsplwr] = {"SMBsplwr", reply_printwrite, 0},
+    [SMBlock] = {"SMBlock", reply_lock, 0},
+    [SMBunlock] = {"SMBunlock", reply_unlock, 0},
 
     /* CORE+ PROTOCOL FOLLOWS */
 
-    {SMBreadbraw, "SMBreadbraw", reply_readbraw, 0},
-    {SMBwritebraw, "SMBwritebraw", reply_writebraw, 0},
-    {SMBwriteclose, "SMBwriteclose", reply_writeclose, 0},
-    {SMBlockread, "SMBlockread", reply_lockread, 0},
-    {SMBwriteunlock, "SMBwriteunlock", reply_writeunlock, 0},
+    [SMBreadbraw] = {"SMBreadbraw", reply_readbraw, 0},
+    [SMBwritebraw] = {"SMBwritebraw", reply_writebraw, 0},
+    [SMBwriteclose] = {"SMBwriteclose", reply_writeclose, 0},
+    [SMBlockread] = {"SMBlockread", reply_lockread, 0},
+    [SMBwriteunlock] = {"SMBwriteunlock", reply_writeunlock, 0},
 
     /* LANMAN1.0 PROTOCOL FOLLOWS */
 
-    {SMBreadBmpx, "SMBreadBmpx", reply_readbmpx, 0},
-    {SMBreadBs, "SMBreadBs", NULL, 0},
-    {SMBwriteBmpx, "SMBwriteBmpx", reply_writebmpx, 0},
-    {SMBwriteBs, "SMBwriteBs", reply_writebs, 0},
-    {SMBwritec, "SMBwritec", NULL, 0},
-    {SMBsetattrE, "SMBsetattrE", reply_setattrE, NEED_WRITE},
-    {SMBgetattrE, "SMBgetattrE", reply_getattrE, 0},
-    {SMBtrans, "SMBtrans", reply_trans, ALLOWED_IN_IPC},
-    {SMBtranss, "SMBtranss", NULL, ALLOWED_IN_IPC},
-    {SMBioctls, "SMBioctls", NULL, 0},
-    {SMBcopy, "SMBcopy", reply_copy, NEED_WRITE | QUEUE_IN_OPLOCK},
-    {SMBmove, "SMBmove", NULL, NEED_WRITE | QUEUE_IN_OPLOCK},
-
-    {SMBopenX, "SMBopenX", reply_open_and_X, ALLOWED_IN_IPC | QUEUE_IN_OPLOCK},
-    {SMBreadX, "SMBreadX", reply_read_and_X, 0},
-    {SMBwriteX, "SMBwriteX", reply_write_and_X, 0},
-    {SMBlockingX, "SMBlockingX", reply_lockingX, 0},
-
-    {SMBffirst, "SMBffirst", reply_search, 0},
-    {SMBfunique, "SMBfunique", reply_search, 0},
-    {SMBfclose, "SMBfclose", reply_fclose, 0},
+    [SMBreadBmpx] = {"SMBreadBmpx", reply_readbmpx, 0},
+    [SMBreadBs] = {"SMBreadBs", NULL, 0},
+    [SMBwriteBmpx] = {"SMBwriteBmpx", reply_writebmpx, 0},
+    [SMBwriteBs] = {"SMBwriteBs", reply_writebs, 0},
+    [SMBwritec] = {"SMBwritec", NULL, 0},
+    [SMBsetattrE] = {"SMBsetattrE", reply_setattrE, NEED_WRITE},
+    [SMBgetattrE] = {"SMBgetattrE", reply_getattrE, 0},
+    [SMBtrans] = {"SMBtrans", reply_trans, ALLOWED_IN_IPC},
+    [SMBtranss] = {"SMBtranss", NULL, ALLOWED_IN_IPC},
+    [SMBioctls] = {"SMBioctls", NULL, 0},
+    [SMBcopy] = {"SMBcopy", reply_copy, NEED_WRITE | QUEUE_IN_OPLOCK},
+    [SMBmove] = {"SMBmove", NULL, NEED_WRITE | QUEUE_IN_OPLOCK},
+
+    [SMBopenX] = {"SMBopenX", reply_open_and_X,
+                  ALLOWED_IN_IPC | QUEUE_IN_OPLOCK},
+    [SMBreadX] = {"SMBreadX", reply_read_and_X, 0},
+    [SMBwriteX] = {"SMBwriteX", reply_write_and_X, 0},
+    [SMBlockingX] = {"SMBlockingX", reply_lockingX, 0},
+
+    [SMBffirst] = {"SMBffirst", reply_search, 0},
+    [SMBfunique] = {"SMBfunique", reply_search, 0},
+    [SMBfclose] = {"SMBfclose", reply_fclose, 0},
 
     /* LANMAN2.0 PROTOCOL FOLLOWS */
-    {SMBfindnclose, "SMBfindnclose", reply_findnclose, 0},
-    {SMBfindclose, "SMBfindclose", reply_findclose, 0},
-    {SMBtrans2, "SMBtrans2", reply_trans2, 0},
-    {SMBtranss2, "SMBtranss2", reply_transs2, 0},
+    [SMBfindnclose] = {"SMBfindnclose", reply_findnclose, 0},
+    [SMBfindclose] = {"SMBfindclose", reply_findclose, 0},
+    [SMBtrans2] = {"SMBtrans2", reply_trans2, QUEUE_IN_OPLOCK},
+    [SMBtranss2] = {"SMBtranss2", reply_transs2, 0},
 
     /* messaging routines */
-    {SMBsends, "SMBsends", NULL, 0},
-    {SMBsendstrt, "SMBsendstrt", NULL, 0},
-    {SMBsendend, "SMBsendend", NULL, 0},
-    {SMBsendtxt, "SMBsendtxt", NULL, 0},
+    [SMBsends] = {"SMBsends", NULL, 0},
+    [SMBsendstrt] = {"SMBsendstrt", NULL, 0},
+    [SMBsendend] = {"SMBsendend", NULL, 0},
+    [SMBsendtxt] = {"SMBsendtxt", NULL, 0},
 
     /* NON-IMPLEMENTED PARTS OF THE CORE PROTOCOL */
 
-    {SMBsendb, "SMBsendb", NULL, 0},
-    {SMBfwdname, "SMBfwdname", NULL, 0},
-    {SMBcancelf, "SMBcancelf", NULL, 0},
-    {SMBgetmac, "SMBgetmac", NULL, 0}};
+    [SMBsendb] = {"SMBsendb", NULL, 0},
+    [SMBfwdname] = {"SMBfwdname", NULL, 0},
+    [SMBcancelf] = {"SMBcancelf", NULL, 0},
+    [SMBgetmac] = {"SMBgetmac", NULL, 0},
+};
 
 /****************************************************************************
 return a string containing the function name of a SMB command
 ****************************************************************************/
 char *smb_fn_name(int type)
 {
-	static char *unknown_name = "SMBunknown";
-	static int num_smb_messages =
-	    sizeof(smb_messages) / sizeof(struct smb_message_struct);
-	int match;
+	if (type < 0 || type > 0xff || smb_messages[type].name == NULL)
+		return "SMBunknown";
 
-	for (match = 0; match < num_smb_messages; match++)
-		if (smb_messages[match].code == type)
-			break;
+	return smb_messages[type].name;
+}
 
-	if (match == num_smb_messages)
-		return unknown_name;
+/****************************************************************************
+count data sent or received while handling a request, other than the
+request packet itself, for the request statistics
+****************************************************************************/
+static unsigned long long request_bytes_in, request_bytes_out;
+
+void count_request_bytes(size_t bytes_in, size_t bytes_out)
+{
+	request_bytes_in += bytes_in;
+	request_bytes_out += bytes_out;
+}
+
+/****************************************************************************
+log the statistics for the requests received by this process
+****************************************************************************/
+static void log_request_stats(void)
+{
+	struct smb_message_struct *msg;
+	int i, b;
+
+	/* this is logged whatever the log level, since it is only done
+	   when asked for */
+	log_output(NULL, 0, 3, "Request statistics for process %ld:\n",
+	           (long) getpid());
+
+	for (i = 0; i < 256; i++) {
+		msg = &smb_messages[i];
+		if (msg->count == 0) {
+			continue;
+		}
+		log_output(NULL, 0, 3,
+		           "%s: %lu requests, %llu bytes in, %llu bytes out, "
+		           "%llu us average\n",
+		           smb_fn_name(i), msg->count, msg->bytes_in,
+		           msg->bytes_out, msg->total_usecs / msg->count);
+		log_output(NULL, 0, 3, "  latency (us):");
+		for (b = 0; b < LATENCY_BUCKETS; b++) {
+			if (msg->latency[b] == 0) {
+				continue;
+			} else if (b == 0) {
+				log_output(NULL, 0, 3, " <2:%lu", msg->latency[b]);
+			} else if (b == LATENCY_BUCKETS - 1) {
+				log_output(NULL, 0, 3, " %lu+:%lu", 1UL << b,
+				           msg->latency[b]);
+			} else {
+				log_output(NULL, 0, 3, " %lu-%lu:%lu", 1UL << b,
+				           (2UL << b) - 1, msg->latency[b]);
+			}
+		}
+		log_output(NULL, 0, 3, "\n");
+	}
+}
+
+/****************************************************************************
+log the request statistics if asked to by SIGUSR1
+****************************************************************************/
+static volatile sig_atomic_t stats_requested = 0;
+
+static void sig_usr1(int sig)
+{
+	stats_requested = 1;
+#ifndef DONT_REINSTALL_SIG
+	signal(SIGUSR1, sig_usr1);
+#endif
+}
+
+static void check_stats_request(void)
+{
+	int old_errno = errno;
 
-	return smb_messages[match].name;
+	if (stats_requested) {
+		stats_requested = 0;
+		log_request_stats();
+	}
+	errno = old_errno;
+}
+
+/****************************************************************************
+call the handler for a message, and return the response size
+****************************************************************************/
+static int call_handler(struct smb_message_struct *msg, char *inbuf,
+                        char *outbuf, int size, int bufsize)
+{
+	int cnum = SVAL(inbuf, smb_tid);
+	int flags = msg->flags;
+
+	if (!msg->fn) {
+		return reply_unknown(inbuf, outbuf);
+	}
+
+	/* Ensure this value is replaced in the incoming packet. */
+	SSVAL(inbuf, smb_uid, UID_FIELD_INVALID);
+
+	/* does it need write permission? */
+	if ((flags & NEED_WRITE) && !CAN_WRITE(cnum))
+		return ERROR_CODE(ERRSRV, ERRaccess);
+
+	/* load service specific parameters */
+	if (OPEN_CNUM(cnum) && !become_service(cnum)) {
+		return ERROR_CODE(ERRSRV, ERRaccess);
+	}
+
+	/* for the IPC service, only certain messages are allowed */
+	if (OPEN_CNUM(cnum) && CONN_SHARE(cnum) == ipc_service &&
+	    (flags & ALLOWED_IN_IPC) == 0) {
+		return ERROR_CODE(ERRSRV, ERRaccess);
+	}
+
+	last_inbuf = inbuf;
+
+	return msg->fn(inbuf, outbuf, size, bufsize);
 }
 
 /****************************************************************************
@@ -2626,17 +3588,12 @@ static int switch_message(int type, char *inbuf, char *outbuf, int size,
 {
 	static int pid = -1;
 	int outsize = 0;
-	static int num_smb_messages =
-	    sizeof(smb_messages) / sizeof(struct smb_message_struct);
-	int match;
+	struct smb_message_struct *msg = &smb_messages[type & 0xff];
+	struct timespec start, end;
+	unsigned long long usecs;
+	int b;
 
-#if PROFILING
-	struct timeval msg_start_time;
-	struct timeval msg_end_time;
-	static unsigned long total_time = 0;
-
-	getimeofday(&msg_start_time, NULL);
-#endif
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	if (pid == -1)
 		pid = getpid();
@@ -2650,67 +3607,24 @@ static int switch_message(int type, char *inbuf, char *outbuf, int size,
 		return -1;
 	}
 
-	for (match = 0; match < num_smb_messages; match++)
-		if (smb_messages[match].code == type)
-			break;
-
-	if (match == num_smb_messages) {
+	if (msg->name == NULL) {
 		ERROR("Unknown message type %d!\n", type);
 		outsize = reply_unknown(inbuf, outbuf);
 	} else {
-		DEBUG("switch message %s (pid %d)\n", smb_messages[match].name,
-		      pid);
-
-		if (smb_messages[match].fn) {
-			int cnum = SVAL(inbuf, smb_tid);
-			int flags = smb_messages[match].flags;
-			/* Ensure this value is replaced in the incoming packet.
-			 */
-			SSVAL(inbuf, smb_uid, UID_FIELD_INVALID);
-
-			/* does it need write permission? */
-			if ((flags & NEED_WRITE) && !CAN_WRITE(cnum))
-				return ERROR_CODE(ERRSRV, ERRaccess);
-
-			/* load service specific parameters */
-			if (OPEN_CNUM(cnum) && !become_service(cnum)) {
-				return ERROR_CODE(ERRSRV, ERRaccess);
-			}
-
-			/* for the IPC service, only certain messages are
-			 * allowed */
-			if (OPEN_CNUM(cnum) &&
-			    CONN_SHARE(cnum) == ipc_service &&
-			    (flags & ALLOWED_IN_IPC) == 0) {
-				return ERROR_CODE(ERRSRV, ERRaccess);
-			}
-
-			last_inbuf = inbuf;
-
-			outsize = smb_messages[match].fn(inbuf, outbuf, size,
-			                                 bufsize);
-		} else {
-			outsize = reply_unknown(inbuf, outbuf);
-		}
+		DEBUG("switch message %s (pid %d)\n", msg->name, pid);
+		outsize = call_handler(msg, inbuf, outbuf, size, bufsize);
 	}
 
-#if PROFILING
-	gettimeofday(&msg_end_time, NULL);
-	if (!(smb_messages[match].flags & TIME_INIT)) {
-		smb_messages[match].time = 0;
-		smb_messages[match].flags |= TIME_INIT;
+	/* the time for a chained request includes the requests after it */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	usecs = (end.tv_sec - start.tv_sec) * 1000000LL +
+	        (end.tv_nsec - start.tv_nsec) / 1000;
+	++msg->count;
+	msg->total_usecs += usecs;
+	for (b = 0; usecs >= 2 && b < LATENCY_BUCKETS - 1; b++) {
+		usecs >>= 1;
 	}
-	{
-		unsigned long this_time =
-		    (msg_end_time.tv_sec - msg_start_time.tv_sec) * 1e6 +
-		    (msg_end_time.tv_usec - msg_start_time.tv_usec);
-		smb_messages[match].time += this_time;
-		total_time += this_time;
-	}
-	DEBUG("TIME %s  %d usecs   %g pct\n", smb_fn_name(type),
-	      smb_messages[match].time,
-	      (100.0 * smb_messages[match].time) / total_time);
-#endif
+	++msg->latency[b];
 
 	return outsize;
 }
@@ -2812,24 +3726,12 @@ int chain_reply(char *inbuf, char *outbuf, int size, int bufsize)
 }
 
 /****************************************************************************
-  construct a reply to the incoming packet
+  fill in the header of a reply to a packet
 ****************************************************************************/
-static int construct_reply(char *inbuf, char *outbuf, int size, int bufsize)
+void construct_reply_common(char *inbuf, char *outbuf)
 {
-	int type = CVAL(inbuf, smb_com);
-	int outsize = 0;
-	int msg_type = CVAL(inbuf, 0);
-
-	smb_last_time = time(NULL);
-
-	chain_size = 0;
-	chain_fnum = -1;
-
 	bzero(outbuf, smb_size);
 
-	if (msg_type != 0)
-		return reply_special(inbuf, outbuf);
-
 	CVAL(outbuf, smb_com) = CVAL(inbuf, smb_com);
 	set_message(outbuf, 0, 0, true);
 
@@ -2845,6 +3747,28 @@ static int construct_reply(char *inbuf, char *outbuf, int size, int bufsize)
 	SSVAL(outbuf, smb_pid, SVAL(inbuf, smb_pid));
 	SSVAL(outbuf, smb_uid, SVAL(inbuf, smb_uid));
 	SSVAL(outbuf, smb_mid, SVAL(inbuf, smb_mid));
+}
+
+/****************************************************************************
+  construct a reply to the incoming packet
+****************************************************************************/
+static int construct_reply(char *inbuf, char *outbuf, int size, int bufsize)
+{
+	int type = CVAL(inbuf, smb_com);
+	int outsize = 0;
+	int msg_type = CVAL(inbuf, 0);
+
+	smb_last_time = time(NULL);
+
+	chain_size = 0;
+	chain_fnum = -1;
+
+	if (msg_type != 0) {
+		bzero(outbuf, smb_size);
+		return reply_special(inbuf, outbuf);
+	}
+
+	construct_reply_common(inbuf, outbuf);
 
 	outsize = switch_message(type, inbuf, outbuf, size, bufsize);
 
@@ -2855,6 +3779,31 @@ static int construct_reply(char *inbuf, char *outbuf, int size, int bufsize)
 	return outsize;
 }
 
+/****************************************************************************
+publish the statistics of the current session after a request, given the
+cache counters from before it
+****************************************************************************/
+static void update_session_stats(struct session_stats *s,
+                                 struct dir_cache_stats *dir_stats,
+                                 unsigned long attr_hits,
+                                 unsigned long attr_misses)
+{
+	struct dir_cache_stats now;
+
+	dir_cache_get_stats(&now);
+
+	s->connections = num_connections_open;
+	s->open_files = current_session->num_files_open;
+	s->dptrs = dptr_count();
+	s->requests++;
+	s->bytes_in += request_bytes_in;
+	s->bytes_out += request_bytes_out;
+	s->dir_cache_hits += now.hits - dir_stats->hits;
+	s->dir_cache_misses += now.misses - dir_stats->misses;
+	s->attr_cache_hits += dosattrib_hits - attr_hits;
+	s->attr_cache_misses += dosattrib_misses - attr_misses;
+}
+
 /****************************************************************************
   process an smb from the client - split out from the process() code so
   it can be used by the oplock break code.
@@ -2864,8 +3813,11 @@ static void process_smb(char *inbuf, char *outbuf)
 {
 	static int trans_num;
 	int msg_type = CVAL(inbuf, 0);
+	int type = CVAL(inbuf, smb_com);
 	int32_t len = smb_len(inbuf);
 	int nread = len + 4;
+	struct dir_cache_stats dir_stats;
+	unsigned long attr_hits, attr_misses;
 
 	DEBUG("got message type 0x%x of len 0x%x\n", msg_type, len);
 	DEBUG("Transaction %d of length %d\n", trans_num, nread);
@@ -2875,6 +3827,16 @@ static void process_smb(char *inbuf, char *outbuf)
 	else if (msg_type == 0x85)
 		return; /* Keepalive packet. */
 
+	request_bytes_in = nread;
+	request_bytes_out = 0;
+
+	if (current_session->stats == NULL) {
+		current_session->stats = stats_session_start(client_addr);
+	}
+	dir_cache_get_stats(&dir_stats);
+	attr_hits = dosattrib_hits;
+	attr_misses = dosattrib_misses;
+
 	nread = construct_reply(inbuf, outbuf, nread, max_send);
 
 	if (nread > 0) {
@@ -2887,9 +3849,84 @@ static void process_smb(char *inbuf, char *outbuf)
 		} else
 			send_smb(Client, outbuf);
 	}
+
+	/* bytes are counted against the first command of a chain */
+	if (msg_type == 0) {
+		smb_messages[type].bytes_in += request_bytes_in;
+		smb_messages[type].bytes_out += request_bytes_out;
+	}
+	if (current_session->stats != NULL) {
+		update_session_stats(current_session->stats, &dir_stats,
+		                     attr_hits, attr_misses);
+	}
 	trans_num++;
 }
 
+/****************************************************************************
+  wait for the client to give up an oplock on a file it is opening again,
+  for at most the given time in milli seconds; see oplock_break_others().
+
+  The client may write back what it has cached before it releases the
+  oplock or closes the file, so unlike in wait_for_oplock_message(), its
+  requests are processed while waiting, in buffers of their own, and the
+  reply being built is left alone. Requests that could open, rename or
+  delete files are kept to be processed later.
+****************************************************************************/
+void wait_for_own_oplock_break(int timeout)
+{
+	int saved_chain_fnum = chain_fnum, saved_chain_size = chain_size;
+	int saved_last_message = last_message;
+	struct pollfd fds[2];
+	char *inbuf, *outbuf;
+
+	/* requests are not processed ahead of ones kept earlier */
+	if (num_pending_smbs > 0) {
+		wait_for_oplock_message(timeout);
+		return;
+	}
+
+	/* other processes may be waiting for this one, as in
+	   wait_for_oplock_message() */
+	fds[0].fd = message_socket();
+	fds[0].events = POLLIN;
+	fds[1].fd = Client;
+	fds[1].events = POLLIN;
+	fds[0].revents = fds[1].revents = 0;
+
+	if (poll(fds, 2, timeout) <= 0) {
+		return;
+	}
+
+	if (fds[0].revents != 0) {
+		message_receive();
+	}
+
+	if (fds[1].revents == 0) {
+		return;
+	}
+
+	inbuf = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
+	if (!receive_smb(Client, inbuf, BUFFER_SIZE, 0)) {
+		free(inbuf);
+		exit_server("client went away while waiting for oplock break");
+	}
+
+	if (CVAL(inbuf, 0) == 0 &&
+	    (smb_messages[CVAL(inbuf, smb_com)].flags & QUEUE_IN_OPLOCK) != 0) {
+		pending_smbs[num_pending_smbs++] = inbuf;
+		return;
+	}
+
+	outbuf = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
+	process_smb(inbuf, outbuf);
+	free(inbuf);
+	free(outbuf);
+
+	chain_fnum = saved_chain_fnum;
+	chain_size = saved_chain_size;
+	last_message = saved_last_message;
+}
+
 /****************************************************************************
 send a single packet to a port on another machine
 ****************************************************************************/
@@ -2932,9 +3969,9 @@ static bool send_one_packet(char *buf, int len, struct in_addr ip, int port,
 }
 
 /****************************************************************************
-  process commands from the client
+  set up buffers etc. before serving any clients
 ****************************************************************************/
-static void process(void)
+static void process_init(void)
 {
 	InBuffer = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
 	OutBuffer = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
@@ -2954,7 +3991,53 @@ static void process(void)
 
 	/* re-initialise the timezone */
 	time_init();
+}
 
+/****************************************************************************
+  housekeeping for the current session when nothing has been received from
+  the client for idle_secs seconds. Returns false if the session has been
+  idle for long enough that it should be closed.
+****************************************************************************/
+static bool check_idle_session(int idle_secs)
+{
+	int i;
+	time_t t;
+	bool allidle = true;
+
+	t = time(NULL);
+
+	/* automatic timeout if all connections are closed */
+	if (num_connections_open == 0 && idle_secs >= IDLE_CLOSED_TIMEOUT) {
+		DEBUG("Closing idle connection\n");
+		return false;
+	}
+
+	/* check for connection timeouts */
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+		if (Connections[i].open) {
+			/* close dirptrs on connections that are idle */
+			if ((t - Connections[i].lastused) > DPTR_IDLE_TIMEOUT)
+				dptr_idlecnum(i);
+
+			if (Connections[i].num_files_open > 0 ||
+			    (t - Connections[i].lastused) <
+			        DEFAULT_SMBD_TIMEOUT)
+				allidle = false;
+		}
+
+	if (allidle && num_connections_open > 0) {
+		DEBUG("Closing idle connection 2\n");
+		return false;
+	}
+
+	return true;
+}
+
+/****************************************************************************
+  process commands from the client
+****************************************************************************/
+static void process(void)
+{
 	while (true) {
 		int counter;
 		bool got_smb = false;
@@ -2965,10 +4048,6 @@ static void process(void)
 		     !receive_message_or_smb(Client, InBuffer, BUFFER_SIZE,
 		                             SMBD_SELECT_LOOP * 1000, &got_smb);
 		     counter += SMBD_SELECT_LOOP) {
-			int i;
-			time_t t;
-			bool allidle = true;
-
 			if (counter > 365 * 3600) /* big number of seconds. */
 			{
 				counter = 0;
@@ -2985,32 +4064,7 @@ static void process(void)
 				return;
 			}
 
-			t = time(NULL);
-
-			/* automatic timeout if all connections are closed */
-			if (num_connections_open == 0 &&
-			    counter >= IDLE_CLOSED_TIMEOUT) {
-				DEBUG("Closing idle connection\n");
-				return;
-			}
-
-			/* check for connection timeouts */
-			for (i = 0; i < MAX_CONNECTIONS; i++)
-				if (Connections[i].open) {
-					/* close dirptrs on connections that are
-					 * idle */
-					if ((t - Connections[i].lastused) >
-					    DPTR_IDLE_TIMEOUT)
-						dptr_idlecnum(i);
-
-					if (Connections[i].num_files_open > 0 ||
-					    (t - Connections[i].lastused) <
-					        DEFAULT_SMBD_TIMEOUT)
-						allidle = false;
-				}
-
-			if (allidle && num_connections_open > 0) {
-				DEBUG("Closing idle connection 2\n");
+			if (!check_idle_session(counter)) {
 				return;
 			}
 		}
@@ -3021,38 +4075,579 @@ static void process(void)
 }
 
 /****************************************************************************
-  initialise connect, service and file structs
+  allocate and initialise the state for a new client session
 ****************************************************************************/
-static void init_structs(void)
+static struct session *new_session(int client)
 {
+	struct session *s = checked_calloc(1, sizeof(struct session));
 	int i;
 
+	s->client = client;
+	s->protocol = PROTOCOL_COREPLUS;
+	s->max_send = BUFFER_SIZE;
+	s->done_sesssetup = false;
+	s->num_connections_open = 0;
+	s->last_time = 0;
+	s->last_packet = time(NULL);
+
+	s->connections =
+	    checked_calloc(MAX_CONNECTIONS, sizeof(struct service_connection));
 	for (i = 0; i < MAX_CONNECTIONS; i++) {
-		Connections[i].open = false;
-		Connections[i].num_files_open = 0;
-		Connections[i].lastused = 0;
-		Connections[i].used = false;
-		string_init(&Connections[i].dirpath, "");
-		string_init(&Connections[i].connectpath, "");
+		s->connections[i].open = false;
+		s->connections[i].num_files_open = 0;
+		s->connections[i].lastused = 0;
+		s->connections[i].used = false;
+		string_init(&s->connections[i].dirpath, "");
+		string_init(&s->connections[i].connectpath, "");
+	}
+
+	/* the file table is allocated by find_free_file() when it is first
+	   needed */
+	s->files = NULL;
+	s->num_file_slots = 0;
+	s->free_files = 0;
+	s->num_files_open = 0;
+
+	s->num_fd_chains = INITIAL_FD_CHAINS;
+	s->fd_chains =
+	    checked_calloc(INITIAL_FD_CHAINS, sizeof(struct open_fd *));
+	s->num_fds = 0;
+
+	s->dptrs = dptr_table_new();
+	s->notifies = notify_table_new();
+
+	return s;
+}
+
+/****************************************************************************
+  make a session the current one, saving the state of the previous one
+****************************************************************************/
+static void switch_session(struct session *s)
+{
+	struct session *old = current_session;
+
+	if (s == old)
+		return;
+
+	if (old != NULL) {
+		old->client = Client;
+		old->protocol = Protocol;
+		old->max_send = max_send;
+		old->done_sesssetup = done_sesssetup;
+		old->num_connections_open = num_connections_open;
+		old->last_time = smb_last_time;
+		old->files = Files;
+		old->num_file_slots = num_file_slots;
+		strlcpy(old->client_addr, client_addr,
+		        sizeof(old->client_addr));
+	}
+
+	current_session = s;
+
+	Client = s->client;
+	Protocol = s->protocol;
+	max_send = s->max_send;
+	done_sesssetup = s->done_sesssetup;
+	num_connections_open = s->num_connections_open;
+	smb_last_time = s->last_time;
+	strlcpy(client_addr, s->client_addr, sizeof(client_addr));
+
+	Connections = s->connections;
+	Files = s->files;
+	num_file_slots = s->num_file_slots;
+	dptr_table_select(s->dptrs);
+	notify_table_select(s->notifies);
+}
+
+/****************************************************************************
+  free the current session. close_session() must already have been called.
+****************************************************************************/
+static void free_session(void)
+{
+	struct session *s = current_session;
+	int i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		string_free(&Connections[i].dirpath);
+		string_free(&Connections[i].connectpath);
+	}
+	for (i = 0; i < num_file_slots; i++) {
+		string_free(&Files[i].name);
+	}
+	fd_cache_expire(true);
+	dptr_table_free();
+	notify_table_free();
+
+	free(s->connections);
+	free(Files);
+	free(s->fd_chains);
+	free(s->partial);
+	free(s);
+
+	current_session = NULL;
+	Connections = NULL;
+	Files = NULL;
+	num_file_slots = 0;
+	client_addr[0] = '\0';
+}
+
+/****************************************************************************
+  serve connections one after another, in a prefork worker process
+****************************************************************************/
+static void worker_loop(int server_socket)
+{
+	process_init();
+
+	DEBUG("waiting for a connection\n");
+	while (true) {
+		fstring peer_addr;
+		jmp_buf env;
+		int fd;
+
+		fd = accept_connection(server_socket, peer_addr,
+		                       sizeof(peer_addr));
+		if (fd == -1) {
+			continue;
+		}
+
+		worker_slots[worker_slot].busy = true;
+		if (write(worker_pipe[1], "", 1) != 1) {
+			DEBUG("worker_loop: write: %s\n", strerror(errno));
+		}
+
+		switch_session(new_session(fd));
+		strlcpy(client_addr, peer_addr, sizeof(client_addr));
+		set_descriptive_argv();
+		set_keepalive_option(Client);
+
+		/* exit_server() only ends the session */
+		if (setjmp(env) == 0) {
+			session_abort = &env;
+			process();
+			session_abort = NULL;
+		}
+
+		close_session();
+		free_session();
+
+		/* shrink the pool if there are enough idle workers */
+		if (idle_workers() >= num_workers) {
+			exit(0);
+		}
+		worker_slots[worker_slot].busy = false;
+	}
+}
+
+#ifdef linux
+
+#include <sys/epoll.h>
+
+#define MAX_EPOLL_EVENTS 64
+
+/* In event mode, packets are only read from a client once they have arrived
+   in full, so that a client that stalls halfway through one doesn't hold up
+   every other client. Data that the server has asked for in the middle of a
+   request, and replies, can still block, so those socket reads and writes
+   time out after this many seconds, which ends the session. */
+#define EVENT_SOCKET_TIMEOUT 10
+
+/* all sessions being served in event mode */
+static struct session *sessions = NULL;
+static int num_sessions = 0;
+static int epoll_fd = -1;
+
+/* epoll data for the status socket; the server socket's is NULL */
+static int stats_event;
+
+/****************************************************************************
+  accept a new client in event mode
+****************************************************************************/
+static void new_client(int server_socket)
+{
+	struct timeval tv = {EVENT_SOCKET_TIMEOUT, 0};
+	struct epoll_event ev;
+	fstring peer_addr;
+	struct session *s;
+	int fd;
+
+	fd = accept_connection(server_socket, peer_addr, sizeof(peer_addr));
+	if (fd == -1) {
+		return;
+	}
+
+	set_keepalive_option(fd);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	s = new_session(fd);
+	strlcpy(s->client_addr, peer_addr, sizeof(s->client_addr));
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		ERROR("new_client: epoll_ctl: %s\n", strerror(errno));
+		switch_session(s);
+		close_session();
+		free_session();
+		return;
+	}
+
+	s->next = sessions;
+	sessions = s;
+
+	++num_sessions;
+	if (max_full_sessions > 0 && num_sessions == max_full_sessions + 1) {
+		WARNING("serving more than %d clients; they may not all be "
+		        "able to open %d files\n",
+		        max_full_sessions, max_open_files);
+	}
+
+	DEBUG("new client %s\n", peer_addr);
+}
+
+/****************************************************************************
+  end a client's session in event mode
+****************************************************************************/
+static void end_session(struct session *s)
+{
+	struct session **p;
+
+	for (p = &sessions; *p != s; p = &(*p)->next)
+		;
+	*p = s->next;
+	--num_sessions;
+
+	/* closing the socket also removes it from the epoll set */
+	switch_session(s);
+	close_session();
+	free_session();
+}
+
+/****************************************************************************
+  read what has arrived of a packet from a client in event mode, without
+  waiting for the rest. Returns 1 if InBuffer now holds the whole packet, 0
+  if the rest has yet to arrive, or -1 if the client has gone.
+****************************************************************************/
+static int read_client_packet(struct session *s)
+{
+	size_t len = s->partial_len, want;
+	ssize_t ret;
+
+	smb_read_error = 0;
+
+	if (s->partial != NULL) {
+		memcpy(InBuffer, s->partial, len);
+		free(s->partial);
+		s->partial = NULL;
+		s->partial_len = 0;
 	}
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		Files[i].open = false;
-		string_init(&Files[i].name, "");
+	for (;;) {
+		want = len < 4 ? 4 : smb_len(InBuffer) + 4;
+		if (want > BUFFER_SIZE + 4) {
+			ERROR("Invalid packet length! (%d bytes).\n",
+			      (int) want - 4);
+			smb_read_error = READ_ERROR;
+			return -1;
+		}
+		if (len == want) {
+			break;
+		}
+
+		ret = recv(s->client, InBuffer + len, want - len,
+		           MSG_DONTWAIT);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* keep what there is until the rest arrives */
+			if (len > 0) {
+				s->partial = checked_malloc(len);
+				memcpy(s->partial, InBuffer, len);
+				s->partial_len = len;
+			}
+			return 0;
+		}
+		if (ret <= 0) {
+			smb_read_error = ret == 0 ? READ_EOF : READ_ERROR;
+			return -1;
+		}
+		len += ret;
 	}
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		struct open_fd *fd_ptr = &FileFd[i];
-		fd_ptr->ref_count = 0;
-		fd_ptr->dev = (int32_t) -1;
-		fd_ptr->inode = (int32_t) -1;
-		fd_ptr->fd = -1;
-		fd_ptr->fd_readonly = -1;
-		fd_ptr->fd_writeonly = -1;
-		fd_ptr->real_open_flags = -1;
+	/* as receive_smb() does, so that short packets read as zeros */
+	if (len < smb_size + 100) {
+		bzero(InBuffer + len, smb_size + 100 - len);
 	}
 
-	init_dptrs();
+	return 1;
+}
+
+/****************************************************************************
+  read and process a packet from a client in event mode. Returns false if
+  the client's session has ended.
+****************************************************************************/
+static bool serve_client(struct session *s)
+{
+	jmp_buf env;
+
+	switch_session(s);
+
+	if (setjmp(env) != 0) {
+		/* exit_server() was called while processing the request */
+		return false;
+	}
+	session_abort = &env;
+
+	switch (read_client_packet(s)) {
+	case 0:
+		session_abort = NULL;
+		return true;
+	case -1:
+		session_abort = NULL;
+		if (smb_read_error == READ_EOF) {
+			DEBUG("end of file from client\n");
+		} else {
+			INFO("receive_smb error (%s), closing session\n",
+			     strerror(errno));
+		}
+		return false;
+	}
+
+	s->last_packet = time(NULL);
+	process_smb(InBuffer, OutBuffer);
+	session_abort = NULL;
+
+	return true;
+}
+
+/****************************************************************************
+  serve all clients from this process, using epoll to wait for requests
+****************************************************************************/
+static void event_loop(int server_socket)
+{
+	struct epoll_event ev, events[MAX_EPOLL_EVENTS];
+	time_t last_idle_check = time(NULL), last_fd_expire = 0;
+	int i, n;
+
+	/* POSIX locks belong to the process, so clients sharing a process
+	   would never see each others' locks */
+	if (!locking_use_ofd()) {
+		ERROR("event_loop: OFD locks not supported\n");
+		return;
+	}
+
+	/* a dead client shows up as a write error instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	fcntl(server_socket, F_SETFL,
+	      fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		ERROR("event_loop: epoll_create1: %s\n", strerror(errno));
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) != 0) {
+		ERROR("event_loop: epoll_ctl: %s\n", strerror(errno));
+		return;
+	}
+
+	ev.data.ptr = &stats_event;
+	if (stats_socket() != -1 &&
+	    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_socket(), &ev) != 0) {
+		ERROR("event_loop: epoll_ctl: %s\n", strerror(errno));
+		return;
+	}
+
+	process_init();
+
+	DEBUG("waiting for connections\n");
+	while (true) {
+		time_t t;
+
+		/* cached fds are closed to the nearest second */
+		n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS,
+		               num_cached_fds > 0 ? 1000 :
+		                                    SMBD_SELECT_LOOP * 1000);
+		check_stats_request();
+
+		if (n < 0 && errno != EINTR) {
+			ERROR("event_loop: epoll_wait: %s\n", strerror(errno));
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct session *s = events[i].data.ptr;
+
+			if (s == NULL) {
+				new_client(server_socket);
+			} else if (events[i].data.ptr == &stats_event) {
+				stats_serve();
+			} else if (!serve_client(s)) {
+				end_session(s);
+			}
+		}
+
+		t = time(NULL);
+		if (num_cached_fds > 0 && t != last_fd_expire) {
+			struct session *s;
+
+			for (s = sessions; s != NULL; s = s->next) {
+				if (s->num_fd_cache > 0) {
+					switch_session(s);
+					fd_cache_expire(false);
+				}
+			}
+			last_fd_expire = t;
+		}
+		if (t - last_idle_check >= SMBD_SELECT_LOOP) {
+			struct session *s, *next;
+
+			for (s = sessions; s != NULL; s = next) {
+				next = s->next;
+				switch_session(s);
+				if (!check_idle_session(t - s->last_packet)) {
+					end_session(s);
+				}
+			}
+			last_idle_check = t;
+		}
+	}
+}
+
+#else
+
+static void event_loop(int server_socket)
+{
+	ERROR("event_loop: event mode is not supported on this system\n");
+}
+
+#endif
+
+/****************************************************************************
+raise the limit on open file descriptors as far as we are allowed, since
+each client may have up to max_open_files files open. In event mode, one
+process serves many clients, so the limit is also worked out as the number
+of clients that can have that many files open at once.
+****************************************************************************/
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+	rlim_t wanted = (rlim_t) max_open_files + FD_CACHE_SIZE + 64;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		return;
+	}
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+			return;
+		}
+	}
+	if (rl.rlim_cur == RLIM_INFINITY) {
+		return;
+	}
+	if (rl.rlim_cur < wanted) {
+		WARNING("open file limit is %lu; clients may not be able to "
+		        "open %d files\n",
+		        (unsigned long) rl.rlim_cur, max_open_files);
+	}
+	if (!event_mode) {
+		return;
+	}
+	if (rl.rlim_cur < wanted) {
+		/* already warned above; a second client makes it worse */
+		max_full_sessions = 1;
+		return;
+	}
+	/* each client also has its socket */
+	max_full_sessions = (rl.rlim_cur - 64) /
+	                    (max_open_files + FD_CACHE_SIZE + 1);
+	NOTICE("open file limit is %lu, enough for %d clients per process "
+	       "with %d files open each\n",
+	       (unsigned long) rl.rlim_cur, max_full_sessions, max_open_files);
+}
+
+/****************************************************************************
+when started as root, switch the effective user and group to the ones the
+server will run as, so that what is set up next is done as that user. *pw
+is set to NULL if there was no need.
+****************************************************************************/
+static bool become_run_as_user(struct passwd **pw)
+{
+	*pw = NULL;
+	if (geteuid() != 0) {
+		return true;
+	}
+
+	*pw = getpwnam(RUN_AS_USER);
+	if (*pw == NULL || setegid((*pw)->pw_gid) != 0 ||
+	    seteuid((*pw)->pw_uid) != 0) {
+		ERROR("failed to switch to user %s\n", RUN_AS_USER);
+		return false;
+	}
+
+	return true;
+}
+
+/****************************************************************************
+switch back to root after become_run_as_user()
+****************************************************************************/
+static bool unbecome_run_as_user(struct passwd *pw)
+{
+	if (pw != NULL && (seteuid(0) != 0 || setegid(0) != 0)) {
+		ERROR("failed to switch back to root: %s\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/****************************************************************************
+index the read-only shares. This is done as the user that the server will
+run as, so that the index only has what the server would otherwise see.
+****************************************************************************/
+static bool index_readonly_shares(void)
+{
+	const struct share *share;
+	struct passwd *pw;
+	bool result = true;
+	int i;
+
+	if (!become_run_as_user(&pw)) {
+		return false;
+	}
+
+	for (i = 0; result && i < shares_count(); i++) {
+		share = get_share(i);
+		if (share != ipc_service && !dir_world_writeable(share->path)) {
+			result = shareindex_build(share);
+		}
+	}
+
+	return unbecome_run_as_user(pw) && result;
+}
+
+/****************************************************************************
+listen for status requests. The socket is created as the user that the
+server will run as, so that the server can still remove it when it exits.
+****************************************************************************/
+static bool open_stats_socket(void)
+{
+	struct passwd *pw;
+	bool result;
+
+	if (!become_run_as_user(&pw)) {
+		return false;
+	}
+
+	result = stats_init(stats_path);
+
+	return unbecome_run_as_user(pw) && result;
 }
 
 /****************************************************************************
@@ -3064,12 +4659,23 @@ static void usage(void)
 	      "correct?\n");
 
 	printf("Tumba version " VERSION "\n"
-	       "Usage: tumba_smbd [-a] [-p port] "
+	       "Usage: tumba_smbd [-aeILn] [-p port] "
 	       "[-d debuglevel] [-l log basename]\n"
 	       "                  <path> [paths...]\n\n"
 	       "   -a                allow connections from all addresses\n"
 	       "   -b addr           bind to given address\n"
+	       "   -c entries        set the size of the filename cache\n"
+	       "   -e                serve all clients from a single process\n"
+	       "   -f files          set the open files limit per client\n"
+	       "   -I                index the read-only shares at startup\n"
+	       "   -L                show locks to local processes too\n"
+	       "   -m entries        share a metadata cache between processes\n"
+	       "   -n                watch the shares for changes\n"
 	       "   -p port           listen on the specified port\n"
+	       "   -q backlog        set the listen queue length\n"
+	       "   -s path           answer tumba_status on the given socket\n"
+	       "   -t threads        set the number of metadata threads\n"
+	       "   -w workers        start a pool of worker processes\n"
 	       "   -d level          set the logging level\n"
 	       "   -l filename       write log messages to the given file\n"
 	       "\n");
@@ -3081,6 +4687,7 @@ static void usage(void)
 int main(int argc, char *argv[])
 {
 	int port = SMB_PORT;
+	int dir_cache_size;
 	int opt;
 
 #ifdef NEED_AUTH_PARAMETERS
@@ -3099,7 +4706,8 @@ int main(int argc, char *argv[])
 
 	original_argv = argv;
 	original_argc = argc;
-	while ((opt = getopt(argc, argv, "b:l:d:p:haW:")) != EOF) {
+	while ((opt = getopt(argc, argv, "b:c:f:l:d:m:p:q:s:t:w:haeILnW:")) !=
+	       EOF) {
 		switch (opt) {
 		case 'a':
 			allow_public_connections = true;
@@ -3107,6 +4715,46 @@ int main(int argc, char *argv[])
 		case 'b':
 			bind_addr = optarg;
 			break;
+		case 'c':
+			dir_cache_size = atoi(optarg);
+			if (dir_cache_size < 0 ||
+			    dir_cache_size > DIR_CACHE_MAX_SIZE) {
+				ERROR("-c must be between 0 and %d\n",
+				      DIR_CACHE_MAX_SIZE);
+				exit(1);
+			}
+			dir_cache_set_size(dir_cache_size);
+			break;
+		case 'e':
+			event_mode = true;
+			break;
+		case 'f':
+			max_open_files = atoi(optarg);
+			if (max_open_files < 1 ||
+			    max_open_files > MAX_OPEN_FILES_LIMIT) {
+				ERROR("-f must be between 1 and %d\n",
+				      MAX_OPEN_FILES_LIMIT);
+				exit(1);
+			}
+			break;
+		case 'I':
+			index_shares = true;
+			break;
+		case 'L':
+			unix_locks = true;
+			break;
+		case 'm':
+			metacache_size = atoi(optarg);
+			if (metacache_size < 0 ||
+			    metacache_size > METACACHE_MAX_SIZE) {
+				ERROR("-m must be between 0 and %d\n",
+				      METACACHE_MAX_SIZE);
+				exit(1);
+			}
+			break;
+		case 'n':
+			watch_shares = true;
+			break;
 		case 'l':
 			pstrcpy(debugf, optarg);
 			break;
@@ -3116,6 +4764,23 @@ int main(int argc, char *argv[])
 		case 'p':
 			port = atoi(optarg);
 			break;
+		case 'q':
+			listen_backlog = atoi(optarg);
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 't':
+			statpool_set_threads(atoi(optarg));
+			break;
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers < 0 || num_workers > MAX_WORKERS) {
+				ERROR("-w must be between 0 and %d\n",
+				      MAX_WORKERS);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -3145,23 +4810,58 @@ int main(int argc, char *argv[])
 
 	NOTICE("Tumba smbd version %s started\n", VERSION);
 
-	init_structs();
-
 #ifndef NO_SIGNAL_TEST
 	signal(SIGHUP, SIGNAL_CAST sig_hup);
+	signal(SIGUSR1, sig_usr1);
 #endif
 
 	/* Setup the signals that allow the debug log level
 	   to by dynamically changed. */
 	DEBUG("loaded services\n");
 
+	max_recv = MIN(lp_maxxmit(), BUFFER_SIZE);
+
+	if (stats_path != NULL && !open_stats_socket()) {
+		exit(1);
+	}
+
+	if (!locking_init(unix_locks)) {
+		exit(1);
+	}
+
+	if (metacache_size > 0 && !metacache_init(metacache_size)) {
+		exit(1);
+	}
+
+	if (watch_shares && !watch_init()) {
+		exit(1);
+	}
+
+	if (index_shares && !index_readonly_shares()) {
+		exit(1);
+	}
+
+	/* in event mode one process serves many clients, and could end up
+	   waiting for itself to release an oplock */
+	if (!event_mode && !oplock_init()) {
+		exit(1);
+	}
+
+	/* nor can a process serving many clients wait for locks, or for
+	   changes to directories */
+	if (!event_mode) {
+		blocking_locks_init();
+		notify_init();
+	}
+
+	raise_fd_limit();
+
 	if (!open_sockets(port))
 		exit(1);
 
 	drop_privileges();
 
-	max_recv = MIN(lp_maxxmit(), BUFFER_SIZE);
-
+	process_init();
 	process();
 
 	exit_server("normal exit");
@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "strfunc.h"
@@ -24,9 +25,11 @@
 /* set these to define the limits of the server. NOTE These are on a
    per-client basis. Thus any one machine can't connect to more than
    MAX_CONNECTIONS services, but any number of machines may connect at
-   one time. */
-#define MAX_CONNECTIONS 127
-#define MAX_OPEN_FILES  100
+   one time. The number of open files can be changed with -f, up to the
+   most that fit in a 16-bit file handle. */
+#define MAX_CONNECTIONS        127
+#define DEFAULT_MAX_OPEN_FILES 1024
+#define MAX_OPEN_FILES_LIMIT   65534
 
 /* Macro to cache an error in a struct bmpx_data */
 #define CACHE_ERROR_CODE(w, c, e)                                              \
@@ -46,7 +49,7 @@
 	unix_error_packet(inbuf, outbuf, defclass, deferror, __LINE__)
 
 /* these are useful macros for checking validity of handles */
-#define VALID_FNUM(fnum) (((fnum) >= 0) && ((fnum) < MAX_OPEN_FILES))
+#define VALID_FNUM(fnum) (((fnum) >= 0) && ((fnum) < num_file_slots))
 #define OPEN_FNUM(fnum)  (VALID_FNUM(fnum) && Files[fnum].open)
 #define VALID_CNUM(cnum) (((cnum) >= 0) && ((cnum) < MAX_CONNECTIONS))
 #define OPEN_CNUM(cnum)  (VALID_CNUM(cnum) && Connections[cnum].open)
@@ -75,12 +78,18 @@
  * locking is based on file and process, not file descriptor and process. */
 struct open_fd {
 	uint16_t ref_count;
-	uint32_t dev;
-	uint32_t inode;
+	dev_t dev;
+	ino_t inode;
 	int fd;
 	int fd_readonly;
 	int fd_writeonly;
 	int real_open_flags;
+	bool locked; /* byte range locks have been taken through the fd */
+	struct open_fd *next; /* in the hash chain for dev and inode */
+	/* set when the last handle is closed and the fd is kept in the
+	   cache in case the file is opened again */
+	struct timespec mtime, ctime;
+	time_t close_time;
 };
 
 /* Structure used when SMBwritebmpx is active */
@@ -96,7 +105,7 @@ struct bmpx_data {
 struct open_file {
 	int cnum;
 	struct open_fd *fd_ptr;
-	int pos;
+	off_t pos;
 	uint32_t size;
 	int mode;
 	struct bmpx_data *wbmpx_ptr;
@@ -108,6 +117,12 @@ struct open_file {
 	bool share_mode;
 	bool modified;
 	bool reserved;
+	int next_free; /* next slot in the free list, or 0 */
+	bool in_oplock_table;
+	bool oplock_break_sent;
+	uint32_t lock_id; /* identifies the handle in the lock table */
+	dev_t dev;
+	ino_t ino;
 	char *name;
 };
 
@@ -128,8 +143,10 @@ extern const char *workgroup;
 extern int chain_fnum;
 extern int max_send;
 extern int max_recv;
-extern struct open_file Files[];
-extern struct service_connection Connections[];
+extern bool done_sesssetup;
+extern struct open_file *Files;
+extern int num_file_slots;
+extern struct service_connection *Connections;
 
 /* Integers used to override error codes.  */
 extern int unix_ERR_class;
@@ -137,6 +154,10 @@ extern int unix_ERR_code;
 
 mode_t unix_mode(int cnum, int dosmode);
 int dos_mode(int cnum, char *path, struct stat *sbuf);
+int dos_mode_fd(int cnum, char *path, int fd, struct stat *sbuf);
+int parse_dosattrib(char *buf, ssize_t nbytes);
+ssize_t read_dosattrib_raw(const char *path, char *buf, size_t size);
+void prefetched_dosattrib(struct stat *st, char *buf, ssize_t nbytes);
 int dos_chmod(int cnum, char *fname, int dosmode, struct stat *st);
 bool set_filetime(int cnum, char *fname, time_t mtime);
 bool unix_convert(char *name, int cnum, pstring saved_last_component,
@@ -146,18 +167,22 @@ bool check_name(char *name, int cnum);
 void close_file(int fnum, bool normal_close);
 void open_file_shared(int fnum, int cnum, char *fname, int share_mode, int ofun,
                       int mode, int *Access, int *action);
-int seek_file(int fnum, uint32_t pos);
-int read_file(int fnum, char *data, uint32_t pos, int n);
-int write_file(int fnum, char *data, int n);
+int read_file(int fnum, char *data, off_t pos, int n);
+int write_file(int fnum, char *data, off_t pos, int n);
 int cached_error_packet(char *inbuf, char *outbuf, int fnum, int line);
 int unix_error_packet(char *inbuf, char *outbuf, int def_class,
                       uint32_t def_code, int line);
 int error_packet(char *inbuf, char *outbuf, int error_class,
                  uint32_t error_code, int line);
 bool receive_next_smb(int smbfd, char *inbuf, int bufsize, int timeout);
+void wait_for_oplock_message(int timeout);
+void wait_for_own_oplock_break(int timeout);
 int make_connection(char *service, char *dev);
 int find_free_file(void);
+void free_file(int fnum);
 void close_cnum(int cnum);
 void exit_server(char *reason);
 char *smb_fn_name(int type);
+void construct_reply_common(char *inbuf, char *outbuf);
 int chain_reply(char *inbuf, char *outbuf, int size, int bufsize);
+void count_request_bytes(size_t bytes_in, size_t bytes_out);
@@ -0,0 +1,892 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* A share that nothing ever changes, such as an archive, can be indexed
+   once when the server starts. The index holds every directory in the
+   share with its entries sorted by case-folded name, together with their
+   stat() results, DOS attributes and mangled 8.3 names, so that names can
+   be resolved and directories listed without any system calls and without
+   mangling names for every request. The index is built into memory that is
+   mapped before any server processes are forked, so all of them share the
+   same pages.
+
+   Nothing checks whether the share has changed since it was indexed; the
+   server has to be restarted to see any changes. Symbolic links to
+   directories are not followed, nor are directories that could not be
+   read: paths in them are left to the usual code. */
+
+#include "shareindex.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "mangle.h"
+#include "server.h"
+#include "shares.h"
+#include "smb.h"
+#include "strfunc.h"
+#include "util.h"
+
+/* the kinds of key in the index */
+#define KEY_NAME    0 /* name as it appears in directory listings */
+#define KEY_MANGLED 1 /* mangled 8.3 version of a long name */
+
+/* the results of looking up a path */
+#define PATH_FOUND   0
+#define PATH_MISSING 1
+#define PATH_UNKNOWN 2 /* the path is not in the index */
+
+struct index_dir {
+	uint32_t path; /* relative to the root of the share; "" for the root */
+	int first_entry, num_entries;
+	int first_key, num_keys;
+};
+
+struct index_entry {
+	uint32_t name;    /* preceded by its d_type, like in open_dir() */
+	uint32_t folded;  /* name folded to upper case */
+	uint32_t name_83; /* 8.3 name for listings, or 0 if name is 8.3 */
+	int attrib;       /* DOS attributes from the xattr */
+	struct stat st;
+};
+
+/* The keys of a directory are sorted by kind and then by folded name, so
+   that the first match of a search is the first entry with that name. */
+struct index_key {
+	uint32_t folded;
+	int kind;
+	int entry; /* relative to the first entry of the directory */
+};
+
+/* An index is a single mapping that starts with this header. The pointers
+   are valid in every server process since they are all forked after the
+   index is built. */
+struct shareindex {
+	size_t size;
+	struct index_entry root;
+	struct index_dir *dirs; /* sorted by path */
+	int num_dirs;
+	struct index_entry *entries;
+	int num_entries;
+	struct index_key *keys;
+	int num_keys;
+	char *strings;
+	size_t strings_len;
+};
+
+/* an entry of a directory being read, before it is added to the index */
+struct scan_entry {
+	char *name, *folded;
+	int d_type, attrib;
+	bool subdir; /* a real directory, not a link to one */
+	struct stat st;
+};
+
+struct scan_key {
+	char *folded;
+	int kind;
+	int entry;
+};
+
+static struct shareindex build;
+static int dirs_size, entries_size, keys_size;
+static size_t strings_size;
+
+static struct {
+	const struct share *share;
+	struct shareindex *index;
+} *indexes = NULL;
+static int num_indexes = 0;
+
+/****************************************************************************
+fold a name to upper case, matching the names that dirindex.c compares
+****************************************************************************/
+static void fold_name(char *name)
+{
+	unsigned char *p;
+
+	for (p = (unsigned char *) name; *p; p++) {
+		*p = toupper(*p);
+	}
+}
+
+/****************************************************************************
+copy a string into the string space of the index being built, preceded by
+the given byte if it is not -1. Returns the offset of the string.
+****************************************************************************/
+static uint32_t add_string(const char *s, int prefix)
+{
+	size_t len = strlen(s) + 2;
+	uint32_t result;
+
+	if (build.strings_len + len > strings_size) {
+		strings_size =
+		    MAX(strings_size * 2, build.strings_len + len + 65536);
+		build.strings = checked_realloc(build.strings, strings_size);
+	}
+	if (prefix >= 0) {
+		build.strings[build.strings_len++] = prefix;
+	}
+	result = build.strings_len;
+	memcpy(build.strings + result, s, strlen(s) + 1);
+	build.strings_len += strlen(s) + 1;
+
+	return result;
+}
+
+static int compare_scan_entries(const void *a, const void *b)
+{
+	const struct scan_entry *e1 = a, *e2 = b;
+	int result = strcmp(e1->folded, e2->folded);
+
+	return result != 0 ? result : strcmp(e1->name, e2->name);
+}
+
+static int compare_scan_keys(const void *a, const void *b)
+{
+	const struct scan_key *k1 = a, *k2 = b;
+	int result;
+
+	if (k1->kind != k2->kind) {
+		return k1->kind - k2->kind;
+	}
+	result = strcmp(k1->folded, k2->folded);
+
+	return result != 0 ? result : k1->entry - k2->entry;
+}
+
+static int dtype_of(mode_t mode)
+{
+	if (S_ISDIR(mode))
+		return DT_DIR;
+	if (S_ISREG(mode))
+		return DT_REG;
+	return DT_UNKNOWN;
+}
+
+/****************************************************************************
+read the DOS attributes of a file the same way dos_mode() does, but without
+going through the caches
+****************************************************************************/
+static int read_attrib(const char *path)
+{
+	char buf[5];
+	ssize_t nbytes;
+
+	nbytes = read_dosattrib_raw(path, buf, sizeof(buf) - 1);
+
+	return parse_dosattrib(buf, nbytes);
+}
+
+/****************************************************************************
+read the entries of a directory. Returns NULL if it cannot be read.
+****************************************************************************/
+static struct scan_entry *scan_dir(const char *path, struct stat *st,
+                                   struct stat *parent_st, int *count)
+{
+	struct scan_entry *entries = NULL, *e;
+	struct dirent *de;
+	struct stat lst;
+	int n = 0, size = 0;
+	pstring fullname;
+	DIR *d;
+
+	d = opendir(path);
+	if (d == NULL) {
+		WARNING("not indexing %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (n >= size) {
+			size = MAX(size * 2, 64);
+			entries = checked_realloc(
+			    entries, size * sizeof(struct scan_entry));
+		}
+		e = &entries[n];
+		e->attrib = 0;
+		e->subdir = false;
+
+		if (!strcmp(de->d_name, ".")) {
+			e->st = *st;
+		} else if (!strcmp(de->d_name, "..")) {
+			e->st = *parent_st;
+		} else {
+			if (fstatat(dirfd(d), de->d_name, &lst,
+			            AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+			/* dangling links are left out, as they are from
+			   listings */
+			if (S_ISLNK(lst.st_mode)) {
+				if (fstatat(dirfd(d), de->d_name, &e->st, 0) !=
+				    0) {
+					continue;
+				}
+			} else {
+				e->st = lst;
+				e->subdir = S_ISDIR(lst.st_mode);
+			}
+			snprintf(fullname, sizeof(fullname), "%s/%s", path,
+			         de->d_name);
+			e->attrib = read_attrib(fullname);
+		}
+
+		e->d_type = dtype_of(e->st.st_mode);
+		e->name = checked_strdup(de->d_name);
+		e->folded = checked_strdup(de->d_name);
+		fold_name(e->folded);
+		n++;
+	}
+
+	closedir(d);
+
+	qsort(entries, n, sizeof(struct scan_entry), compare_scan_entries);
+	*count = n;
+
+	return entries;
+}
+
+/****************************************************************************
+add a key for an entry of the directory being indexed; folds the key
+****************************************************************************/
+static void add_scan_key(struct scan_key **keys, int *num_keys, int *size,
+                         const char *key, int kind, int entry)
+{
+	struct scan_key *k;
+
+	if (*num_keys >= *size) {
+		*size = MAX(*size * 2, 64);
+		*keys = checked_realloc(*keys, *size * sizeof(struct scan_key));
+	}
+	k = &(*keys)[(*num_keys)++];
+	k->folded = checked_strdup(key);
+	fold_name(k->folded);
+	k->kind = kind;
+	k->entry = entry;
+}
+
+/****************************************************************************
+add a directory and its entries to the index being built
+****************************************************************************/
+static void add_dir(const char *relpath, struct scan_entry *entries, int n,
+                    const struct share *share)
+{
+	struct scan_key *keys = NULL;
+	struct index_entry *ie;
+	struct index_dir *d;
+	int i, len, num_keys = 0, size = 0;
+	pstring name2;
+
+	for (i = 0; i < n; i++) {
+		struct scan_entry *e = &entries[i];
+
+		if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) {
+			continue;
+		}
+
+		/* the same keys as dirindex.c uses */
+		pstrcpy(name2, e->name);
+		name_map_mangle(name2, false, share);
+		if (!is_8_3(name2, true)) {
+			pstring mangled;
+			pstrcpy(mangled, name2);
+			mangle_name_83(mangled, sizeof(pstring) - 1);
+			add_scan_key(&keys, &num_keys, &size, mangled,
+			             KEY_MANGLED, i);
+		}
+		add_scan_key(&keys, &num_keys, &size, name2, KEY_NAME, i);
+
+		/* "FOO." can be matched as "FOO" */
+		len = strlen(name2);
+		if (lp_strip_dot() && len > 1 && name2[len - 1] == '.') {
+			name2[len - 1] = 0;
+			add_scan_key(&keys, &num_keys, &size, name2, KEY_NAME,
+			             i);
+		}
+	}
+	qsort(keys, num_keys, sizeof(struct scan_key), compare_scan_keys);
+
+	if (build.num_dirs >= dirs_size) {
+		dirs_size = MAX(dirs_size * 2, 64);
+		build.dirs = checked_realloc(
+		    build.dirs, dirs_size * sizeof(struct index_dir));
+	}
+	d = &build.dirs[build.num_dirs++];
+	d->path = add_string(relpath, -1);
+	d->first_entry = build.num_entries;
+	d->num_entries = n;
+	d->first_key = build.num_keys;
+	d->num_keys = num_keys;
+
+	if (build.num_entries + n > entries_size) {
+		entries_size =
+		    MAX(entries_size * 2, build.num_entries + n + 64);
+		build.entries = checked_realloc(
+		    build.entries, entries_size * sizeof(struct index_entry));
+	}
+	for (i = 0; i < n; i++) {
+		ie = &build.entries[build.num_entries++];
+		ie->name = add_string(entries[i].name, entries[i].d_type);
+		ie->folded = add_string(entries[i].folded, -1);
+		ie->attrib = entries[i].attrib;
+		ie->st = entries[i].st;
+
+		/* as shown by get_dir_entry() and get_lanman2_dir_entry() */
+		pstrcpy(name2, entries[i].name);
+		name_map_mangle(name2, true, share);
+		ie->name_83 = strcmp(name2, entries[i].name) != 0 ?
+		                  add_string(name2, -1) :
+		                  0;
+	}
+
+	if (build.num_keys + num_keys > keys_size) {
+		keys_size = MAX(keys_size * 2, build.num_keys + num_keys + 64);
+		build.keys = checked_realloc(
+		    build.keys, keys_size * sizeof(struct index_key));
+	}
+	for (i = 0; i < num_keys; i++) {
+		struct index_key *k = &build.keys[build.num_keys++];
+		k->folded = add_string(keys[i].folded, -1);
+		k->kind = keys[i].kind;
+		k->entry = keys[i].entry;
+		free(keys[i].folded);
+	}
+	free(keys);
+}
+
+/****************************************************************************
+index a directory and everything below it
+****************************************************************************/
+static void index_tree(const char *path, const char *relpath,
+                       struct stat *st, struct stat *parent_st,
+                       const struct share *share)
+{
+	struct scan_entry *entries;
+	pstring subpath, subrelpath;
+	int i, n;
+
+	entries = scan_dir(path, st, parent_st, &n);
+	if (entries == NULL) {
+		return;
+	}
+
+	add_dir(relpath, entries, n, share);
+
+	for (i = 0; i < n; i++) {
+		/* leave out directories whose paths are too long */
+		if (entries[i].subdir &&
+		    strlen(path) + strlen(entries[i].name) + 2 <
+		        sizeof(pstring)) {
+			pstrcpy(subpath, path);
+			pstrcat(subpath, "/");
+			pstrcat(subpath, entries[i].name);
+			pstrcpy(subrelpath, relpath);
+			if (*relpath) {
+				pstrcat(subrelpath, "/");
+			}
+			pstrcat(subrelpath, entries[i].name);
+			index_tree(subpath, subrelpath, &entries[i].st, st,
+			           share);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		free(entries[i].name);
+		free(entries[i].folded);
+	}
+	free(entries);
+}
+
+static const char *sort_strings;
+
+static int compare_dirs(const void *a, const void *b)
+{
+	const struct index_dir *d1 = a, *d2 = b;
+
+	return strcmp(sort_strings + d1->path, sort_strings + d2->path);
+}
+
+/****************************************************************************
+copy the index that has been built into shared memory
+****************************************************************************/
+static struct shareindex *map_index(void)
+{
+	struct shareindex *idx;
+	size_t dirs_len, entries_len, keys_len, len;
+	char *p;
+
+	dirs_len = build.num_dirs * sizeof(struct index_dir);
+	entries_len = build.num_entries * sizeof(struct index_entry);
+	keys_len = build.num_keys * sizeof(struct index_key);
+	len = sizeof(struct shareindex) + dirs_len + entries_len + keys_len +
+	      build.strings_len;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	         -1, 0);
+	if (p == MAP_FAILED) {
+		ERROR("shareindex: mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	idx = (struct shareindex *) p;
+	*idx = build;
+	idx->size = len;
+	p += sizeof(struct shareindex);
+
+	/* struct shareindex, index_entry and index_dir are all multiples
+	   of the alignment of what follows them */
+	idx->entries = (struct index_entry *) p;
+	memcpy(p, build.entries, entries_len);
+	p += entries_len;
+	idx->dirs = (struct index_dir *) p;
+	memcpy(p, build.dirs, dirs_len);
+	p += dirs_len;
+	idx->keys = (struct index_key *) p;
+	memcpy(p, build.keys, keys_len);
+	p += keys_len;
+	idx->strings = p;
+	memcpy(p, build.strings, build.strings_len);
+
+	sort_strings = idx->strings;
+	qsort(idx->dirs, idx->num_dirs, sizeof(struct index_dir),
+	      compare_dirs);
+
+	if (mprotect(idx, len, PROT_READ) != 0) {
+		WARNING("shareindex: mprotect: %s\n", strerror(errno));
+	}
+
+	return idx;
+}
+
+/****************************************************************************
+build the index of a share. Must be called before any server processes
+are forked.
+****************************************************************************/
+bool shareindex_build(const struct share *share)
+{
+	struct shareindex *idx;
+	struct stat st, parent_st;
+	pstring parent;
+
+	snprintf(parent, sizeof(parent), "%s/..", share->path);
+	if (stat(share->path, &st) != 0 || stat(parent, &parent_st) != 0) {
+		ERROR("shareindex: %s: %s\n", share->path, strerror(errno));
+		return false;
+	}
+
+	memset(&build, 0, sizeof(build));
+	dirs_size = entries_size = keys_size = 0;
+	strings_size = 0;
+
+	/* offset 0 is an empty string, so that it can mean "none" */
+	add_string("", -1);
+	build.root.st = st;
+	index_tree(share->path, "", &st, &parent_st, share);
+
+	idx = map_index();
+	if (idx != NULL) {
+		NOTICE("indexed share %s: %d directories, %d entries "
+		       "(%lu KiB)\n",
+		       share->name, idx->num_dirs, idx->num_entries,
+		       (unsigned long) (idx->size / 1024));
+		indexes = checked_realloc(indexes,
+		                          (num_indexes + 1) * sizeof(*indexes));
+		indexes[num_indexes].share = share;
+		indexes[num_indexes].index = idx;
+		num_indexes++;
+	}
+
+	free(build.dirs);
+	free(build.entries);
+	free(build.keys);
+	free(build.strings);
+	memset(&build, 0, sizeof(build));
+
+	return idx != NULL;
+}
+
+static const struct shareindex *find_index(const struct share *share)
+{
+	int i;
+
+	for (i = 0; i < num_indexes; i++) {
+		if (indexes[i].share == share) {
+			return indexes[i].index;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+returns true if the given share has an index
+****************************************************************************/
+bool shareindex_enabled(const struct share *share)
+{
+	return find_index(share) != NULL;
+}
+
+/****************************************************************************
+turn a path relative to the root of the share, as used by the rest of the
+server ("./foo//bar", "foo/./bar", "."), into the form used in the index
+("foo/bar", ""). Returns false if the path is not inside the share.
+****************************************************************************/
+static bool normalize_path(const char *path, char *result)
+{
+	const char *p = path, *end;
+	size_t len = 0, n;
+
+	if (*path == '/') {
+		return false;
+	}
+
+	*result = '\0';
+	while (*p != '\0') {
+		end = strchr(p, '/');
+		n = end != NULL ? (size_t) (end - p) : strlen(p);
+
+		if (n == 0 || (n == 1 && p[0] == '.')) {
+			/* nothing to add */
+		} else if (n == 2 && p[0] == '.' && p[1] == '.') {
+			char *slash;
+			if (len == 0) {
+				return false;
+			}
+			slash = strrchr(result, '/');
+			len = slash != NULL ? (size_t) (slash - result) : 0;
+			result[len] = '\0';
+		} else {
+			if (len + n + 2 > sizeof(pstring)) {
+				return false;
+			}
+			if (len > 0) {
+				result[len++] = '/';
+			}
+			memcpy(result + len, p, n);
+			len += n;
+			result[len] = '\0';
+		}
+
+		p += n;
+		if (*p == '/') {
+			p++;
+		}
+	}
+
+	return true;
+}
+
+static const struct index_dir *find_dir(const struct shareindex *idx,
+                                        const char *path)
+{
+	int lo = 0, hi = idx->num_dirs, mid, cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strcmp(path, idx->strings + idx->dirs[mid].path);
+		if (cmp == 0) {
+			return &idx->dirs[mid];
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+find the entry with the given real name among count entries. Returns its
+index relative to first, or -1
+****************************************************************************/
+static int find_entry(const struct shareindex *idx, int first, int count,
+                      const char *name)
+{
+	const struct index_entry *e;
+	int lo = 0, hi = count, mid, cmp;
+	pstring folded;
+
+	pstrcpy(folded, name);
+	fold_name(folded);
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		e = &idx->entries[first + mid];
+		cmp = strcmp(folded, idx->strings + e->folded);
+		if (cmp == 0) {
+			cmp = strcmp(name, idx->strings + e->name);
+		}
+		if (cmp == 0) {
+			return mid;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return -1;
+}
+
+/****************************************************************************
+find the first entry with a key of the given kind matching an already
+folded name. Returns its index relative to the directory, or -1
+****************************************************************************/
+static int find_key(const struct shareindex *idx, const struct index_dir *d,
+                    int kind, const char *folded)
+{
+	const struct index_key *k;
+	int lo = 0, hi = d->num_keys, mid, cmp;
+
+	/* find the first key that is not less than the one wanted */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		k = &idx->keys[d->first_key + mid];
+		cmp = kind - k->kind;
+		if (cmp == 0) {
+			cmp = strcmp(folded, idx->strings + k->folded);
+		}
+		if (cmp <= 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	if (lo >= d->num_keys) {
+		return -1;
+	}
+	k = &idx->keys[d->first_key + lo];
+	if (k->kind != kind || strcmp(folded, idx->strings + k->folded) != 0) {
+		return -1;
+	}
+
+	return k->entry;
+}
+
+/****************************************************************************
+look up a normalized path. Returns one of the PATH_* values, and sets
+*entry if the path was found
+****************************************************************************/
+static int lookup_path(const struct shareindex *idx, char *path,
+                       const struct index_entry **entry)
+{
+	const struct index_dir *d;
+	const struct index_entry *parent;
+	char *slash, *name;
+	int i, result;
+
+	if (*path == '\0') {
+		*entry = &idx->root;
+		return PATH_FOUND;
+	}
+
+	slash = strrchr(path, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		name = slash + 1;
+		d = find_dir(idx, path);
+	} else {
+		name = path;
+		d = find_dir(idx, "");
+	}
+
+	if (d != NULL) {
+		i = find_entry(idx, d->first_entry, d->num_entries, name);
+		result = PATH_MISSING;
+		if (i >= 0) {
+			*entry = &idx->entries[d->first_entry + i];
+			result = PATH_FOUND;
+		}
+	} else if (slash == NULL) {
+		result = PATH_UNKNOWN;
+	} else {
+		/* the directory was not indexed: it may be a link to a
+		   directory, or may not exist at all */
+		result = lookup_path(idx, path, &parent);
+		if (result == PATH_FOUND) {
+			result = S_ISDIR(parent->st.st_mode) ? PATH_UNKNOWN :
+			                                       PATH_MISSING;
+		}
+	}
+
+	if (slash != NULL) {
+		*slash = '/';
+	}
+
+	return result;
+}
+
+/****************************************************************************
+stat a path relative to the root of an indexed share. Returns false if the
+index cannot answer, otherwise sets *found and, if found, *st.
+****************************************************************************/
+bool shareindex_stat(const struct share *share, const char *path,
+                     struct stat *st, bool *found)
+{
+	const struct shareindex *idx = find_index(share);
+	const struct index_entry *e;
+	pstring relpath;
+
+	if (idx == NULL || !normalize_path(path, relpath)) {
+		return false;
+	}
+
+	switch (lookup_path(idx, relpath, &e)) {
+	case PATH_FOUND:
+		*st = e->st;
+		*found = true;
+		return true;
+	case PATH_MISSING:
+		*found = false;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************
+look up a name in a directory of an indexed share, ignoring case, like
+dirindex_lookup() does. Returns false if the index cannot answer, otherwise
+sets *found and, if found, replaces name with the real name of the entry.
+****************************************************************************/
+bool shareindex_lookup(const struct share *share, const char *path, char *name,
+                       bool *found)
+{
+	const struct shareindex *idx = find_index(share);
+	const struct index_dir *d;
+	pstring relpath, folded;
+	int i1, i2 = -1, len;
+
+	if (idx == NULL || !normalize_path(path, relpath) ||
+	    (d = find_dir(idx, relpath)) == NULL) {
+		return false;
+	}
+
+	pstrcpy(folded, name);
+	fold_name(folded);
+	i1 = find_key(idx, d, KEY_NAME, folded);
+	if (is_mangled(name)) {
+		i2 = find_key(idx, d, KEY_MANGLED, folded);
+	}
+
+	/* "FOO." can match "FOO" */
+	len = strlen(folded);
+	if (i1 < 0 && i2 < 0 && lp_strip_dot() && len > 1 &&
+	    folded[len - 1] == '.') {
+		folded[len - 1] = 0;
+		i1 = find_key(idx, d, KEY_NAME, folded);
+	}
+
+	/* prefer the earlier entry */
+	if (i1 < 0 || (i2 >= 0 && i2 < i1)) {
+		i1 = i2;
+	}
+
+	*found = i1 >= 0;
+	if (*found) {
+		pstrcpy(name,
+		        idx->strings + idx->entries[d->first_entry + i1].name);
+	}
+
+	return true;
+}
+
+/****************************************************************************
+get the DOS attributes from the xattr of a file in an indexed share.
+Returns false if the index cannot answer.
+****************************************************************************/
+bool shareindex_attrib(const struct share *share, const char *path,
+                       int *attrib)
+{
+	const struct shareindex *idx = find_index(share);
+	const struct index_entry *e;
+	pstring relpath;
+
+	if (idx == NULL || !normalize_path(path, relpath) ||
+	    lookup_path(idx, relpath, &e) != PATH_FOUND) {
+		return false;
+	}
+
+	*attrib = e->attrib;
+	return true;
+}
+
+/****************************************************************************
+start listing a directory of an indexed share. Returns false if the
+directory is not in the index.
+****************************************************************************/
+bool shareindex_open_dir(const struct share *share, const char *path,
+                         struct shareindex_dir *dir)
+{
+	const struct shareindex *idx = find_index(share);
+	const struct index_dir *d;
+	pstring relpath;
+
+	if (idx == NULL || !normalize_path(path, relpath) ||
+	    (d = find_dir(idx, relpath)) == NULL) {
+		return false;
+	}
+
+	dir->index = idx;
+	dir->first = d->first_entry;
+	dir->count = d->num_entries;
+	return true;
+}
+
+/****************************************************************************
+get the name of entry i of a directory; it is preceded by its d_type
+****************************************************************************/
+const char *shareindex_dir_name(const struct shareindex_dir *dir, int i)
+{
+	const struct shareindex *idx = dir->index;
+
+	return idx->strings + idx->entries[dir->first + i].name;
+}
+
+/****************************************************************************
+find the entry of a directory with the given real name, or -1
+****************************************************************************/
+int shareindex_dir_find(const struct shareindex_dir *dir, const char *dname)
+{
+	return find_entry(dir->index, dir->first, dir->count, dname);
+}
+
+void shareindex_dir_stat(const struct shareindex_dir *dir, int i,
+                         struct stat *st)
+{
+	*st = dir->index->entries[dir->first + i].st;
+}
+
+/****************************************************************************
+get the name of entry i of a directory as shown to clients that need 8.3
+names, as name_map_mangle() would make it
+****************************************************************************/
+const char *shareindex_dir_name_83(const struct shareindex_dir *dir, int i)
+{
+	const struct shareindex *idx = dir->index;
+	const struct index_entry *e = &idx->entries[dir->first + i];
+
+	return idx->strings + (e->name_83 != 0 ? e->name_83 : e->name);
+}
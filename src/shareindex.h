@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+
+struct share;
+struct shareindex;
+struct stat;
+
+/* a directory in the index of a share, for listing its entries */
+struct shareindex_dir {
+	const struct shareindex *index;
+	int first, count; /* range of entries in the index */
+};
+
+bool shareindex_build(const struct share *share);
+bool shareindex_enabled(const struct share *share);
+bool shareindex_stat(const struct share *share, const char *path,
+                     struct stat *st, bool *found);
+bool shareindex_lookup(const struct share *share, const char *path, char *name,
+                       bool *found);
+bool shareindex_attrib(const struct share *share, const char *path,
+                       int *attrib);
+bool shareindex_open_dir(const struct share *share, const char *path,
+                         struct shareindex_dir *dir);
+const char *shareindex_dir_name(const struct shareindex_dir *dir, int i);
+int shareindex_dir_find(const struct shareindex_dir *dir, const char *dname);
+void shareindex_dir_stat(const struct shareindex_dir *dir, int i,
+                         struct stat *st);
+const char *shareindex_dir_name_83(const struct shareindex_dir *dir, int i);
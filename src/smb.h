@@ -83,6 +83,7 @@ implemented */
 #define ERRlock                 33 /* Lock request conflicts with existing lock */
 #define ERRfilexists            80  /* File in operation already exists */
 #define ERRcannotopen           110 /* Cannot open the file specified */
+#define ERRnotlocked            158 /* Range to unlock is not locked */
 #define ERRunknownlevel         124
 #define ERRbadpipe              230 /* Named pipe invalid */
 #define ERRpipebusy             231 /* All instances of pipe are busy */
@@ -420,6 +421,7 @@ enum protocol_types {
    structures. We cannot define these as actual structures
    due to possible differences in structure packing
    on different machines/compilers. */
+#define SMB_LPID_OFFSET(indx)  (10 * (indx))
 #define SMB_LKOFF_OFFSET(indx) (2 + (10 * (indx)))
 #define SMB_LKLEN_OFFSET(indx) (6 + (10 * (indx)))
 
@@ -443,6 +445,17 @@ enum protocol_types {
 #define LOCKING_ANDX_CANCEL_LOCK     0x8
 #define LOCKING_ANDX_LARGE_FILES     0x10
 
+/* Oplock requests, as returned by the macros below. */
+#define EXCLUSIVE_OPLOCK 1
+#define BATCH_OPLOCK     2
+
+#define CORE_OPLOCK_REQUEST(inbuf) ((CVAL(inbuf, smb_flg) & 0x60) >> 5)
+#define EXTENDED_OPLOCK_REQUEST(inbuf) ((SVAL(inbuf, smb_vwv2) & 0x6) >> 1)
+
+/* Set in replies to show an oplock was granted. */
+#define CORE_OPLOCK_GRANTED     (1 << 5)
+#define EXTENDED_OPLOCK_GRANTED 0x8000
+
 /***************************************************************
  End of OPLOCK section.
 ****************************************************************/
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Directory listings need the attributes of every file listed, and reading
+   them one at a time means waiting for each stat() and getxattr() in turn,
+   which is slow on network filesystems and disks that have to seek. This
+   module runs a small pool of threads that read the metadata of a batch of
+   files in advance, in the order the files are listed, so that the waits
+   overlap. Only one batch is active at a time, and the threads only make
+   system calls; all other state is left to the main thread. */
+
+#include "statpool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "util.h"
+
+#define MAX_THREADS 64
+
+/* job states */
+#define JOB_IDLE    0 /* not submitted, or cancelled before starting */
+#define JOB_QUEUED  1
+#define JOB_RUNNING 2
+#define JOB_DONE    3
+
+static int num_threads = STATPOOL_DEFAULT_THREADS;
+static int threads_started;
+static pid_t pool_pid;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* the active batch; jobs before next_job have been handed to threads */
+static struct stat_job *batch;
+static int batch_count, next_job, jobs_running;
+
+/****************************************************************************
+set the number of threads in the pool; 0 disables it
+****************************************************************************/
+void statpool_set_threads(int n)
+{
+	num_threads = MAX(0, MIN(n, MAX_THREADS));
+}
+
+static void run_job(struct stat_job *job)
+{
+	job->result = fstatat(job->dirfd, job->name, &job->st, 0);
+	job->error = errno;
+	job->attrib_len = -1;
+	if (job->result == 0) {
+		job->attrib_len =
+		    read_dosattrib_raw(job->path, job->attrib,
+		                       sizeof(job->attrib));
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct stat_job *job;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (next_job >= batch_count) {
+			pthread_cond_wait(&work_cond, &pool_lock);
+		}
+		job = &batch[next_job++];
+		job->state = JOB_RUNNING;
+		++jobs_running;
+		pthread_mutex_unlock(&pool_lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&pool_lock);
+		job->state = JOB_DONE;
+		--jobs_running;
+		pthread_cond_broadcast(&done_cond);
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+start the threads if they are not running already. Threads do not survive
+fork(), so a child process starts its own.
+****************************************************************************/
+static bool start_threads(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+
+	if (pool_pid == getpid()) {
+		return threads_started > 0;
+	}
+
+	pool_pid = getpid();
+	threads_started = 0;
+	batch = NULL;
+	batch_count = next_job = jobs_running = 0;
+	pthread_mutex_init(&pool_lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	while (threads_started < num_threads) {
+		if (pthread_create(&thread, NULL, worker_thread, NULL) != 0) {
+			WARNING("failed to start metadata thread\n");
+			break;
+		}
+		pthread_detach(thread);
+		++threads_started;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return threads_started > 0;
+}
+
+/* must be called with pool_lock held */
+static void cancel_batch(void)
+{
+	int i;
+
+	for (i = next_job; i < batch_count; i++) {
+		batch[i].state = JOB_IDLE;
+	}
+	batch_count = next_job;
+	while (jobs_running > 0) {
+		pthread_cond_wait(&done_cond, &pool_lock);
+	}
+	batch = NULL;
+	batch_count = next_job = 0;
+}
+
+/****************************************************************************
+start reading metadata for a batch of files, replacing any active batch.
+The jobs must stay allocated until the batch is cancelled. Returns false if
+the pool is not available, in which case the caller should read the
+metadata itself.
+****************************************************************************/
+bool statpool_submit(struct stat_job *jobs, int count)
+{
+	int i;
+
+	if (num_threads == 0 || count <= 0 || !start_threads()) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	if (batch != NULL) {
+		cancel_batch();
+	}
+	for (i = 0; i < count; i++) {
+		jobs[i].state = JOB_QUEUED;
+	}
+	batch = jobs;
+	batch_count = count;
+	next_job = 0;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	return true;
+}
+
+/****************************************************************************
+wait for a job to finish. Returns false if the job was cancelled before it
+ran, in which case its results are not valid.
+****************************************************************************/
+bool statpool_wait(struct stat_job *job)
+{
+	bool result;
+
+	pthread_mutex_lock(&pool_lock);
+	while (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+		pthread_cond_wait(&done_cond, &pool_lock);
+	}
+	result = job->state == JOB_DONE;
+	pthread_mutex_unlock(&pool_lock);
+
+	return result;
+}
+
+/****************************************************************************
+cancel a batch if it is still active. Jobs that have not started are not
+run; this waits for any that are running, so that the batch can be freed.
+****************************************************************************/
+void statpool_cancel(struct stat_job *jobs)
+{
+	if (pool_pid != getpid()) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	if (batch == jobs) {
+		cancel_batch();
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
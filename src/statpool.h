@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* default number of threads used to read file metadata */
+#define STATPOOL_DEFAULT_THREADS 4
+
+struct stat_job {
+	/* set by the caller */
+	int dirfd;
+	const char *name; /* name of the file, relative to dirfd */
+	const char *path; /* path of the file, for reading DOS attributes */
+
+	/* set by the pool once the job is done */
+	int state;
+	int result; /* return value of fstatat() */
+	int error;  /* errno, if it failed */
+	struct stat st;
+	char attrib[5];
+	ssize_t attrib_len;
+};
+
+void statpool_set_threads(int n);
+bool statpool_submit(struct stat_job *jobs, int count);
+bool statpool_wait(struct stat_job *job);
+void statpool_cancel(struct stat_job *jobs);
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Each client session publishes its counters in a segment of memory shared
+   by all the server processes. The parent process listens on a Unix domain
+   socket, and reports the counters for every session to anything that
+   connects; see tumba_status. Counters of sessions that have ended are
+   added to a set of totals, so the totals never go backwards. */
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "strfunc.h"
+#include "util.h"
+
+struct stats_segment {
+	/* totals for all sessions that have ended */
+	unsigned long long ended_sessions;
+	struct session_stats ended;
+
+	struct session_stats sessions[STATS_MAX_SESSIONS];
+};
+
+static struct stats_segment *segment = NULL;
+static int listen_fd = -1;
+static pstring listen_path;
+static pid_t listen_pid;
+
+static void remove_socket(void)
+{
+	if (listen_fd != -1 && getpid() == listen_pid) {
+		unlink(listen_path);
+	}
+}
+
+/****************************************************************************
+create the shared statistics segment and listen for status requests on a
+Unix domain socket at the given path. Must be called before any server
+processes are forked.
+****************************************************************************/
+bool stats_init(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		ERROR("stats_init: socket path too long: %s\n", socket_path);
+		return false;
+	}
+
+	segment = mmap(NULL, sizeof(struct stats_segment),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+	               0);
+	if (segment == MAP_FAILED) {
+		ERROR("stats_init: mmap: %s\n", strerror(errno));
+		segment = NULL;
+		return false;
+	}
+	memset(segment, 0, sizeof(struct stats_segment));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		ERROR("stats_init: socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+	unlink(socket_path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	    chmod(socket_path, 0600) != 0 || listen(fd, 5) != 0) {
+		ERROR("stats_init: failed to listen on %s: %s\n", socket_path,
+		      strerror(errno));
+		close(fd);
+		return false;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	listen_fd = fd;
+	listen_pid = getpid();
+	pstrcpy(listen_path, socket_path);
+	atexit(remove_socket);
+
+	return true;
+}
+
+/****************************************************************************
+the socket to wait on for status requests, or -1
+****************************************************************************/
+int stats_socket(void)
+{
+	return listen_fd;
+}
+
+/****************************************************************************
+close the status socket; for forked server processes, since only the
+parent answers status requests
+****************************************************************************/
+void stats_close_socket(void)
+{
+	if (listen_fd != -1) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+}
+
+/****************************************************************************
+start publishing statistics for a new client session. Returns NULL if
+statistics are not enabled or there is no room for another session.
+****************************************************************************/
+struct session_stats *stats_session_start(const char *client_addr)
+{
+	struct session_stats *s;
+	pid_t pid = getpid();
+	int i;
+
+	if (segment == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+		s = &segment->sessions[i];
+		if (s->pid == 0 && __sync_bool_compare_and_swap(&s->pid, 0, pid)) {
+			s->start_time = time(NULL);
+			strlcpy(s->client_addr, client_addr,
+			        sizeof(s->client_addr));
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+add the counters of a session to the totals, reset them and free its slot
+****************************************************************************/
+static void release_session(struct session_stats *s)
+{
+	struct session_stats *t = &segment->ended;
+
+	__sync_fetch_and_add(&segment->ended_sessions, 1);
+	__sync_fetch_and_add(&t->requests, s->requests);
+	__sync_fetch_and_add(&t->bytes_in, s->bytes_in);
+	__sync_fetch_and_add(&t->bytes_out, s->bytes_out);
+	__sync_fetch_and_add(&t->dir_cache_hits, s->dir_cache_hits);
+	__sync_fetch_and_add(&t->dir_cache_misses, s->dir_cache_misses);
+	__sync_fetch_and_add(&t->attr_cache_hits, s->attr_cache_hits);
+	__sync_fetch_and_add(&t->attr_cache_misses, s->attr_cache_misses);
+
+	s->connections = s->open_files = s->dptrs = 0;
+	s->requests = s->bytes_in = s->bytes_out = 0;
+	s->dir_cache_hits = s->dir_cache_misses = 0;
+	s->attr_cache_hits = s->attr_cache_misses = 0;
+	__sync_synchronize();
+	s->pid = 0;
+}
+
+/****************************************************************************
+stop publishing statistics for a session that has ended
+****************************************************************************/
+void stats_session_end(struct session_stats *s)
+{
+	if (s != NULL) {
+		release_session(s);
+	}
+}
+
+/****************************************************************************
+append formatted text to a report
+****************************************************************************/
+static void report_printf(char **buf, size_t *len, size_t *size,
+                          const char *fmt, ...) PRINTF_ATTRIBUTE(4, 5);
+
+static void report_printf(char **buf, size_t *len, size_t *size,
+                          const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+
+		if (n >= 0 && *len + n < *size) {
+			*len += n;
+			return;
+		}
+		*size *= 2;
+		*buf = checked_realloc(*buf, *size);
+	}
+}
+
+static void report_counters(char **buf, size_t *len, size_t *size,
+                            struct session_stats *s)
+{
+	report_printf(buf, len, size,
+	              " requests=%llu bytes_in=%llu bytes_out=%llu"
+	              " dir_cache_hits=%llu dir_cache_misses=%llu"
+	              " attr_cache_hits=%llu attr_cache_misses=%llu\n",
+	              s->requests, s->bytes_in, s->bytes_out,
+	              s->dir_cache_hits, s->dir_cache_misses,
+	              s->attr_cache_hits, s->attr_cache_misses);
+}
+
+/****************************************************************************
+answer a status request on the status socket. The reply is one line of
+"key=value" fields for the totals of ended sessions, then one for each
+active session.
+****************************************************************************/
+void stats_serve(void)
+{
+	struct timeval tv = {1, 0};
+	struct session_stats *s;
+	size_t len = 0, size = 4096;
+	char *buf;
+	int fd, i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	buf = checked_malloc(size);
+
+	report_printf(&buf, &len, &size, "time=%ld\n", (long) time(NULL));
+	report_printf(&buf, &len, &size, "ended sessions=%llu",
+	              segment->ended_sessions);
+	report_counters(&buf, &len, &size, &segment->ended);
+
+	for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+		s = &segment->sessions[i];
+		if (s->pid == 0) {
+			continue;
+		}
+		/* the process may have been killed before it could free
+		   its slot */
+		if (kill(s->pid, 0) != 0 && errno == ESRCH) {
+			release_session(s);
+			continue;
+		}
+		report_printf(&buf, &len, &size,
+		              "session id=%d pid=%ld start=%ld client=%s"
+		              " connections=%u open_files=%u dptrs=%u",
+		              i, (long) s->pid, (long) s->start_time,
+		              s->client_addr, s->connections, s->open_files,
+		              s->dptrs);
+		report_counters(&buf, &len, &size, s);
+	}
+
+	for (i = 0; i < len;) {
+		ssize_t n = send(fd, buf + i, len - i, MSG_NOSIGNAL);
+		if (n <= 0) {
+			DEBUG("stats_serve: send: %s\n", strerror(errno));
+			break;
+		}
+		i += n;
+	}
+
+	free(buf);
+	close(fd);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* maximum number of client sessions whose statistics are published */
+#define STATS_MAX_SESSIONS 1024
+
+/* Counters for a client session, in memory shared between all server
+   processes. Only the process serving the session writes to them. */
+struct session_stats {
+	volatile pid_t pid; /* 0 if the slot is free */
+	time_t start_time;
+	char client_addr[32];
+
+	/* current state */
+	unsigned int connections, open_files, dptrs;
+
+	/* totals since the session started */
+	unsigned long long requests, bytes_in, bytes_out;
+	unsigned long long dir_cache_hits, dir_cache_misses;
+	unsigned long long attr_cache_hits, attr_cache_misses;
+};
+
+bool stats_init(const char *socket_path);
+void stats_close_socket(void);
+int stats_socket(void);
+void stats_serve(void);
+struct session_stats *stats_session_start(const char *client_addr);
+void stats_session_end(struct session_stats *s);
@@ -11,11 +11,16 @@
 
 #include "system.h"
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utime.h>
 
 #include "guards.h" /* IWYU pragma: keep */
+#include "util.h"
 
 /*******************************************************************
 now for utime()
@@ -53,6 +58,12 @@ ssize_t sys_setxattr(const char *path, const char *name, void *value,
 	return setxattr(path, name, value, size, 0);
 }
 
+/* Different OSes have different versions of fgetxattr */
+ssize_t sys_fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	return fgetxattr(fd, name, value, size);
+}
+
 #elif defined(__FreeBSD__) || defined(__NetBSD__)
 
 #include <sys/extattr.h>
@@ -75,6 +86,12 @@ ssize_t sys_setxattr(const char *path, const char *name, void *value,
 	                        size);
 }
 
+/* Different OSes have different versions of fgetxattr */
+ssize_t sys_fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	return extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, name, value, size);
+}
+
 #else
 
 #include <errno.h>
@@ -96,4 +113,336 @@ ssize_t sys_setxattr(const char *path, const char *name, void *value,
 	return -1;
 }
 
+/* Different OSes have different versions of fgetxattr */
+ssize_t sys_fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
+
+/*******************************************************************
+copy count bytes at the given offset of fromfd to tofd through a buffer,
+for when sendfile() is unavailable
+********************************************************************/
+static ssize_t copy_file_data(int tofd, int fromfd, off_t offset,
+                              size_t count)
+{
+	char buf[16 * 1024];
+	size_t total = 0;
+
+	while (total < count) {
+		size_t chunk = count - total;
+		ssize_t nread, nwritten = 0;
+
+		if (chunk > sizeof(buf))
+			chunk = sizeof(buf);
+
+		nread = pread(fromfd, buf, chunk, offset + total);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			return nread < 0 ? -1 : (ssize_t) total;
+
+		while (nwritten < nread) {
+			ssize_t ret =
+			    write(tofd, buf + nwritten, nread - nwritten);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return -1;
+			nwritten += ret;
+		}
+
+		total += nread;
+	}
+
+	return total;
+}
+
+/*******************************************************************
+write all of a buffer to a socket. flags are passed to send()
+********************************************************************/
+static int send_all(int fd, const char *buf, size_t len, int flags)
+{
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t ret = send(fd, buf + total, len - total, flags);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		total += ret;
+	}
+
+	return 0;
+}
+
+/*******************************************************************
+read and discard count bytes from fd
+********************************************************************/
+static void discard_data(int fd, size_t count)
+{
+	char buf[16 * 1024];
+
+	while (count > 0) {
+		ssize_t ret =
+		    read(fd, buf, count < sizeof(buf) ? count : sizeof(buf));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		count -= ret;
+	}
+}
+
+/*******************************************************************
+receive count bytes from a socket into a file through a buffer. If a
+write to the file fails, the rest of the data is still read from the
+socket and discarded. Returns the number of bytes written to the file
+********************************************************************/
+static size_t copy_socket_data(int fromfd, int tofd, off_t offset,
+                               size_t count)
+{
+	char buf[16 * 1024];
+	size_t total = 0, written = 0;
+
+	while (total < count) {
+		size_t chunk = count - total;
+		ssize_t nread;
+
+		if (chunk > sizeof(buf))
+			chunk = sizeof(buf);
+
+		nread = read(fromfd, buf, chunk);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			break;
+		total += nread;
+
+		if (pwrite_data(tofd, buf, nread, offset + written) != nread) {
+			discard_data(fromfd, count - total);
+			return written;
+		}
+		written += nread;
+	}
+
+	return written;
+}
+
+/* sendfile() and splice() are system-specific as well: */
+#ifdef linux
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+
+/*******************************************************************
+send a header followed by count bytes of fromfd at the given offset,
+without copying the file data through user space. Returns the number of
+bytes of file data sent, which is less than count only if the end of the
+file was reached, or -1 on error.
+********************************************************************/
+ssize_t sys_sendfile(int tofd, int fromfd, const char *header, size_t hdr_len,
+                     off_t offset, size_t count)
+{
+	size_t total = 0;
+
+	/* with MSG_MORE the header goes out in the same segment as the
+	   start of the data */
+	if (hdr_len > 0 && send_all(tofd, header, hdr_len, MSG_MORE) != 0)
+		return -1;
+
+	while (total < count) {
+		ssize_t ret = sendfile(tofd, fromfd, &offset, count - total);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			/* not supported for this file; the header is already
+			   sent, so send the rest of the data the slow way */
+			ret = copy_file_data(tofd, fromfd, offset,
+			                     count - total);
+			return ret < 0 ? -1 : (ssize_t) (total + ret);
+		}
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
+
+/* pipe used to splice() data from the client socket into files */
+static int splice_pipe[2] = {-1, -1};
+static bool use_splice = true;
+
+/*******************************************************************
+empty n bytes out of splice_pipe, writing them to a file at the given
+offset if tofd is not -1. Returns the number of bytes written
+********************************************************************/
+static size_t empty_splice_pipe(int tofd, off_t offset, size_t n)
+{
+	char buf[16 * 1024];
+	size_t written = 0;
+
+	while (n > 0) {
+		ssize_t ret = read(splice_pipe[0], buf,
+		                   n < sizeof(buf) ? n : sizeof(buf));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		n -= ret;
+
+		if (tofd == -1)
+			continue;
+		if (pwrite_data(tofd, buf, ret, offset + written) != ret) {
+			tofd = -1;
+			continue;
+		}
+		written += ret;
+	}
+
+	return written;
+}
+
+/*******************************************************************
+receive count bytes from a socket into a file at the given offset,
+without copying the data through user space. If a write to the file
+fails, the rest of the data is still read from the socket and discarded.
+Returns the number of bytes written to the file
+********************************************************************/
+size_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count)
+{
+	size_t total = 0, written = 0;
+
+	if (use_splice && splice_pipe[0] == -1 && pipe(splice_pipe) != 0)
+		use_splice = false;
+	if (!use_splice)
+		return copy_socket_data(fromfd, tofd, offset, count);
+
+	while (total < count) {
+		ssize_t nread, ret;
+		off_t pos;
+
+		nread = splice(fromfd, NULL, splice_pipe[1], NULL,
+		               count - total, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			/* can't splice() from this socket; everything read
+			   so far is in the file, so read the rest the slow
+			   way */
+			use_splice = false;
+			return written +
+			       copy_socket_data(fromfd, tofd, offset + written,
+			                        count - total);
+		}
+		if (nread <= 0) {
+			discard_data(fromfd, count - total);
+			break;
+		}
+		total += nread;
+
+		while (nread > 0) {
+			pos = offset + written;
+			ret = splice(splice_pipe[0], NULL, tofd, &pos, nread,
+			             SPLICE_F_MOVE);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			written += ret;
+			nread -= ret;
+		}
+		if (nread == 0)
+			continue;
+
+		/* The rest of this chunk is stuck in the pipe. If the file
+		   doesn't support splice(), write it out the slow way and
+		   don't try splice() again. */
+		if (ret == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			size_t n = empty_splice_pipe(tofd, offset + written,
+			                             nread);
+			use_splice = false;
+			written += n;
+			if (n == nread) {
+				return written +
+				       copy_socket_data(fromfd, tofd,
+				                        offset + written,
+				                        count - total);
+			}
+		} else {
+			empty_splice_pipe(-1, 0, nread);
+		}
+		discard_data(fromfd, count - total);
+		break;
+	}
+
+	return written;
+}
+
+#else
+
+/*******************************************************************
+send a header followed by count bytes of fromfd at the given offset.
+Returns the number of bytes of file data sent, which is less than count
+only if the end of the file was reached, or -1 on error.
+********************************************************************/
+ssize_t sys_sendfile(int tofd, int fromfd, const char *header, size_t hdr_len,
+                     off_t offset, size_t count)
+{
+	if (hdr_len > 0 && send_all(tofd, header, hdr_len, 0) != 0)
+		return -1;
+
+	return copy_file_data(tofd, fromfd, offset, count);
+}
+
+/*******************************************************************
+receive count bytes from a socket into a file at the given offset. If a
+write to the file fails, the rest of the data is still read from the
+socket and discarded. Returns the number of bytes written to the file
+********************************************************************/
+size_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count)
+{
+	return copy_socket_data(fromfd, tofd, offset, count);
+}
+
+#endif
+
+/* inotify(7) is only on Linux, and its users check for it themselves: */
+#ifdef linux
+
+#include <sys/inotify.h>
+
+/*******************************************************************
+read inotify events from fd, passing each one to fn, until there are no
+more (if fd is non-blocking) or the read fails
+********************************************************************/
+void sys_inotify_read(int fd, void (*fn)(struct inotify_event *ev))
+{
+	char buf[65536]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			break;
+		}
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			fn(ev);
+		}
+	}
+}
+
 #endif
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+struct inotify_event;
 struct utimbuf;
 
 int sys_utime(char *fname, struct utimbuf *times);
@@ -19,3 +20,8 @@ ssize_t sys_getxattr(const char *path, const char *name, void *value,
                      size_t size);
 ssize_t sys_setxattr(const char *path, const char *name, void *value,
                      size_t size);
+ssize_t sys_fgetxattr(int fd, const char *name, void *value, size_t size);
+ssize_t sys_sendfile(int tofd, int fromfd, const char *header, size_t hdr_len,
+                     off_t offset, size_t count);
+size_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count);
+void sys_inotify_read(int fd, void (*fn)(struct inotify_event *ev));
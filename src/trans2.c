@@ -14,6 +14,7 @@
 
 #include "trans2.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -32,6 +33,8 @@
 #include "dir.h"
 #include "guards.h" /* IWYU pragma: keep */
 #include "mangle.h"
+#include "notify.h"
+#include "oplock.h"
 #include "server.h"
 #include "shares.h"
 #include "smb.h"
@@ -39,6 +42,7 @@
 #include "system.h"
 #include "timefunc.h"
 #include "util.h"
+#include "watch.h"
 
 /* what type of filesystem do we want this to show up as in a NT file
    manager window? */
@@ -199,6 +203,7 @@ static int call_trans2open(char *inbuf, char *outbuf, int bufsize, int cnum,
                            char **pparams, char **ppdata)
 {
 	char *params = *pparams;
+	int oplock_request = (SVAL(params, 0) & 0x6) >> 1;
 	int16_t open_mode = SVAL(params, 2);
 	int16_t open_attr = SVAL(params, 6);
 	int16_t open_ofun = SVAL(params, 12);
@@ -231,7 +236,7 @@ static int call_trans2open(char *inbuf, char *outbuf, int bufsize, int cnum,
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -243,7 +248,7 @@ static int call_trans2open(char *inbuf, char *outbuf, int bufsize, int cnum,
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		free_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -270,7 +275,9 @@ static int call_trans2open(char *inbuf, char *outbuf, int bufsize, int cnum,
 	SIVAL(params, 8, size);
 	SSVAL(params, 12, rmode);
 
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+	if (oplock_grant(fnum, oplock_request)) {
+		smb_action |= EXTENDED_OPLOCK_GRANTED;
+	}
 	SSVAL(params, 18, smb_action);
 	SIVAL(params, 20, inode);
 
@@ -280,6 +287,16 @@ static int call_trans2open(char *inbuf, char *outbuf, int bufsize, int cnum,
 	return -1;
 }
 
+/****************************************************************************
+  true if listing entries at the given info level needs their metadata
+****************************************************************************/
+static bool level_needs_stat(int info_level, int dirtype)
+{
+	return info_level != SMB_FIND_FILE_NAMES_INFO ||
+	       (dirtype & (aHIDDEN | aSYSTEM | aDIR)) !=
+	           (aHIDDEN | aSYSTEM | aDIR);
+}
+
 /****************************************************************************
   get a level dependent lanman2 dir entry.
 ****************************************************************************/
@@ -353,14 +370,32 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 			bool isdots =
 			    (strequal(fname, "..") || strequal(fname, "."));
 
+			int dtype = dir_entry_type(dname);
+
 			if (isrootdir && isdots)
 				continue;
 
+			/* directories always have the aDIR attribute */
+			if ((dirtype & aDIR) == 0 && dtype == DT_DIR)
+				continue;
+
 			pstrcpy(pathreal, Connections[cnum].dirpath);
 			if (needslash)
 				pstrcat(pathreal, "/");
 			pstrcat(pathreal, dname);
-			if (stat(pathreal, &sbuf) != 0) {
+
+			/* A names-only listing that accepts every attribute
+			   does not need anything from stat(). Symlinks are
+			   still checked, since dangling ones are skipped. */
+			if (!level_needs_stat(info_level, dirtype) &&
+			    dtype != DT_UNKNOWN && dtype != DT_LNK) {
+				DEBUG("found %s fname=%s\n", pathreal, fname);
+				found = true;
+				continue;
+			}
+
+			if (dir_entry_stat(Connections[cnum].dirptr, dname,
+			                   pathreal, &sbuf) != 0) {
 				DEBUG("Couldn't stat [%s] (%s)\n", pathreal,
 				      strerror(errno));
 				continue;
@@ -491,8 +526,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		SIVAL(p, 0, 0);
 		p += 4;
 		if (!was_8_3) {
-			pstrcpy(p + 2, fname);
-			name_map_mangle(p + 2, true, CONN_SHARE(cnum));
+			dir_entry_name_83(Connections[cnum].dirptr, dname,
+			                  p + 2, CONN_SHARE(cnum));
 		} else
 			*(p + 2) = 0;
 		strupper(p + 2);
@@ -728,6 +763,13 @@ static int call_trans2findfirst(char *inbuf, char *outbuf, int bufsize,
 	space_remaining = max_data_bytes;
 	out_of_space = false;
 
+	/* read the metadata of the entries we expect to return in advance */
+	if (level_needs_stat(info_level, dirtype)) {
+		dir_prefetch(Connections[cnum].dirptr,
+		             Connections[cnum].dirpath, mask, dirtype,
+		             MIN(maxentries, max_data_bytes / DIRLEN_GUESS + 1));
+	}
+
 	for (i = 0; (i < maxentries) && !finished && !out_of_space; i++) {
 
 		/* this is a heuristic to avoid seeking the dirptr except when
@@ -751,6 +793,8 @@ static int call_trans2findfirst(char *inbuf, char *outbuf, int bufsize,
 		space_remaining = max_data_bytes - PTR_DIFF(p, pdata);
 	}
 
+	dir_prefetch_end(Connections[cnum].dirptr);
+
 	/* Check if we can close the dirptr */
 	if (close_after_first || (finished && close_if_end)) {
 		dptr_close(dptr_num);
@@ -901,6 +945,7 @@ static int call_trans2findnext(char *inbuf, char *outbuf, int length,
 
 		int current_pos, start_pos;
 		char *dname = NULL;
+		pstring name;
 		void *dirptr = Connections[cnum].dirptr;
 		start_pos = tell_dir(dirptr);
 		for (current_pos = start_pos; current_pos >= 0; current_pos--) {
@@ -916,10 +961,12 @@ static int call_trans2findnext(char *inbuf, char *outbuf, int length,
 			 * here.
 			 */
 
-			if (dname != NULL)
-				name_map_mangle(dname, false, CONN_SHARE(cnum));
+			if (dname != NULL) {
+				pstrcpy(name, dname);
+				name_map_mangle(name, false, CONN_SHARE(cnum));
+			}
 
-			if (dname && strcsequal(resume_name, dname)) {
+			if (dname && strcsequal(resume_name, name)) {
 				seek_dir(dirptr, current_pos + 1);
 				DEBUG("got match at pos %d\n", current_pos + 1);
 				break;
@@ -943,11 +990,13 @@ static int call_trans2findnext(char *inbuf, char *outbuf, int length,
 				 * here.
 				 */
 
-				if (dname != NULL)
-					name_map_mangle(dname, false,
+				if (dname != NULL) {
+					pstrcpy(name, dname);
+					name_map_mangle(name, false,
 					                CONN_SHARE(cnum));
+				}
 
-				if (dname && strcsequal(resume_name, dname)) {
+				if (dname && strcsequal(resume_name, name)) {
 					seek_dir(dirptr, current_pos + 1);
 					DEBUG("got match at pos %d\n",
 					      current_pos + 1);
@@ -957,6 +1006,13 @@ static int call_trans2findnext(char *inbuf, char *outbuf, int length,
 		}
 	}
 
+	/* read the metadata of the entries we expect to return in advance */
+	if (level_needs_stat(info_level, dirtype)) {
+		dir_prefetch(Connections[cnum].dirptr,
+		             Connections[cnum].dirpath, mask, dirtype,
+		             MIN(maxentries, max_data_bytes / DIRLEN_GUESS + 1));
+	}
+
 	for (i = 0; (i < (int) maxentries) && !finished && !out_of_space; i++) {
 		/* this is a heuristic to avoid seeking the dirptr except when
 		   absolutely necessary. It allows for a filename of about 40
@@ -979,6 +1035,8 @@ static int call_trans2findnext(char *inbuf, char *outbuf, int length,
 		space_remaining = max_data_bytes - PTR_DIFF(p, pdata);
 	}
 
+	dir_prefetch_end(Connections[cnum].dirptr);
+
 	/* Check if we can close the dirptr */
 	if (close_after_request || (finished && close_if_end)) {
 		dptr_close(dptr_num); /* This frees up the saved mask */
@@ -1157,7 +1215,9 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, int length,
 	char *fname;
 	pstring short_name;
 	char *p;
-	int l, pos;
+	int l;
+	off_t pos;
+	int fd = -1;
 	bool bad_path = false;
 
 	if (tran_call == TRANSACT2_QFILEINFO) {
@@ -1173,7 +1233,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, int length,
 			      strerror(errno));
 			return UNIX_ERROR_CODE(ERRDOS, ERRbadfid);
 		}
-		pos = lseek(Files[fnum].fd_ptr->fd, 0, SEEK_CUR);
+		pos = Files[fnum].pos;
+		fd = Files[fnum].fd_ptr->fd;
 	} else {
 		/* qpathinfo */
 		info_level = SVAL(params, 0);
@@ -1207,7 +1268,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, int length,
 	else
 		p++;
 	l = strlen(p);
-	mode = dos_mode(cnum, fname, &sbuf);
+	mode = dos_mode_fd(cnum, fname, fd, &sbuf);
 	size = sbuf.st_size;
 	if (mode & aDIR)
 		size = 0;
@@ -1336,6 +1397,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, int length,
 			SIVAL(pdata, 0, 0xd01BF);
 		pdata += 4;
 		SIVAL(pdata, 0, pos); /* current offset */
+		SIVAL(pdata, 4, (uint64_t) pos >> 32);
 		pdata += 8;
 		SIVAL(pdata, 0,
 		      mode); /* is this the right sort of mode info? */
@@ -1578,6 +1640,10 @@ static int call_trans2mkdir(char *inbuf, char *outbuf, int length, int bufsize,
 	if (check_name(directory, cnum))
 		ret = mkdir(directory, unix_mode(cnum, aDIR));
 
+	if (ret == 0) {
+		watch_changed(CONN_SHARE(cnum), directory);
+	}
+
 	if (ret < 0) {
 		DEBUG("error (%s)\n", strerror(errno));
 		if ((errno == ENOENT) && bad_path) {
@@ -1596,17 +1662,160 @@ static int call_trans2mkdir(char *inbuf, char *outbuf, int length, int bufsize,
 	return -1;
 }
 
+/****************************************************************************
+  put a level 1 or 2 entry for a file that has changed into a find notify
+  reply. A file that has gone is given no attributes, and "." is the
+  directory itself. Returns the length of
+  the entry, 0 if the file does not have the attributes asked for, or -1 if
+  there is not enough space.
+****************************************************************************/
+static int get_find_notify_entry(struct notify_handle *h, char *name,
+                                 int info_level, char *p, int space)
+{
+	int cnum = h->cnum;
+	uint32_t size = 0, mdate = 0, adate = 0, cdate = 0;
+	pstring path, fname;
+	struct stat sbuf;
+	int mode = 0, len;
+
+	snprintf(path, sizeof(path), "%s/%s", h->path, name);
+	if (stat(path, &sbuf) == 0) {
+		mode = dos_mode(cnum, path, &sbuf);
+		/* the directory itself stands for lost changes, and is always
+		   reported */
+		if (strcmp(name, ".") != 0 &&
+		    !dir_check_ftype(cnum, mode, &sbuf, h->attr))
+			return 0;
+		size = sbuf.st_size;
+		mdate = sbuf.st_mtime;
+		adate = sbuf.st_atime;
+		cdate = get_create_time(&sbuf);
+		if (mode & aDIR)
+			size = 0;
+	}
+
+	pstrcpy(fname, name);
+	name_map_mangle(fname, false, CONN_SHARE(cnum));
+	len = strlen(fname);
+
+	switch (info_level) {
+	case 1:
+		if (l1_achName + len + 1 > space)
+			return -1;
+		put_dos_date2(p, l1_fdateCreation, cdate);
+		put_dos_date2(p, l1_fdateLastAccess, adate);
+		put_dos_date2(p, l1_fdateLastWrite, mdate);
+		SIVAL(p, l1_cbFile, size);
+		SIVAL(p, l1_cbFileAlloc, ROUNDUP(size, 1024));
+		SSVAL(p, l1_attrFile, mode);
+		SCVAL(p, l1_cchName, len);
+		memcpy(p + l1_achName, fname, len + 1);
+		return l1_achName + len + 1;
+
+	default:
+		if (l2_achName + len + 1 > space)
+			return -1;
+		put_dos_date2(p, l2_fdateCreation, cdate);
+		put_dos_date2(p, l2_fdateLastAccess, adate);
+		put_dos_date2(p, l2_fdateLastWrite, mdate);
+		SIVAL(p, l2_cbFile, size);
+		SIVAL(p, l2_cbFileAlloc, ROUNDUP(size, 1024));
+		SSVAL(p, l2_attrFile, mode);
+		SIVAL(p, l2_cbList, 0); /* No extended attributes */
+		SCVAL(p, l2_cchName, len);
+		memcpy(p + l2_achName, fname, len + 1);
+		return l2_achName + len + 1;
+	}
+}
+
+/****************************************************************************
+  send the reply to a TRANS2_FINDNOTIFYNEXT, with the changes recorded on
+  its handle. Changes that do not fit are left for the next request.
+****************************************************************************/
+static void find_notify_reply(char *outbuf, int bufsize,
+                              struct notify_handle *h, int max_entries,
+                              int info_level, int max_data)
+{
+	char params[4];
+	char *pdata;
+	int i, len, data_size = 0, count = 0;
+
+	if (max_entries < 1)
+		max_entries = 1;
+
+	pdata = checked_malloc(max_data + 1);
+
+	for (i = 0; i < h->num_names && count < max_entries; i++) {
+		len = get_find_notify_entry(h, h->names[i], info_level,
+		                            pdata + data_size,
+		                            max_data - data_size);
+		if (len < 0)
+			break;
+		data_size += len;
+		if (len > 0)
+			count++;
+	}
+
+	/* changes whose names were not kept are reported as one change to
+	   the directory itself, so that the client looks at all of it */
+	if (i == h->num_names && h->num_lost > 0 && count < max_entries) {
+		len = get_find_notify_entry(h, ".", info_level,
+		                            pdata + data_size,
+		                            max_data - data_size);
+		if (len > 0) {
+			data_size += len;
+			count++;
+			i += h->num_lost;
+		}
+	}
+	notify_consume(h, i);
+
+	DEBUG("handle=%d changes=%d data_size=%d\n", h->handle, count,
+	      data_size);
+
+	SSVAL(params, 0, MIN(count, 0xFFFF)); /* Number of changes */
+	SSVAL(params, 2, 0);                   /* No EA errors */
+
+	send_trans2_replies(outbuf, bufsize, params, 4, pdata, data_size);
+
+	free(pdata);
+}
+
+/****************************************************************************
+  send the reply to a TRANS2_FINDNOTIFYNEXT request that was waiting for
+  changes on its handle (see notify.c)
+****************************************************************************/
+void send_find_notify_reply(char *inbuf, struct notify_handle *h)
+{
+	char *outbuf = checked_malloc(BUFFER_SIZE);
+
+	construct_reply_common(inbuf, outbuf);
+	if (Protocol >= PROTOCOL_NT1) {
+		uint16_t flg2 = SVAL(outbuf, smb_flg2);
+		SSVAL(outbuf, smb_flg2, flg2 | 0x40); /* IS_LONG_NAME */
+	}
+
+	find_notify_reply(outbuf, BUFFER_SIZE, h, h->max_entries,
+	                  h->info_level, h->max_data);
+
+	free(outbuf);
+}
+
 /****************************************************************************
   reply to a TRANS2_FINDNOTIFYFIRST (start monitoring a directory for changes)
-  We don't actually do this - we just send a null response.
 ****************************************************************************/
 static int call_trans2findnotifyfirst(char *inbuf, char *outbuf, int length,
                                       int bufsize, int cnum, char **pparams,
                                       char **ppdata)
 {
-	static uint16_t fnf_handle = 257;
 	char *params = *pparams;
+	uint16_t dirtype = SVAL(params, 0);
 	uint16_t info_level = SVAL(params, 4);
+	pstring directory;
+	pstring mask;
+	bool bad_path = false;
+	int handle;
+	char *p;
 
 	DEBUG("info_level=%d\n", info_level);
 
@@ -1618,17 +1827,42 @@ static int call_trans2findnotifyfirst(char *inbuf, char *outbuf, int length,
 		return ERROR_CODE(ERRDOS, ERRunknownlevel);
 	}
 
+	pstrcpy(directory, params + 10); /* Directory path with wildcard
+	                                   mask appended */
+
+	unix_convert(directory, cnum, 0, &bad_path);
+	if (!check_name(directory, cnum)) {
+		if ((errno == ENOENT) && bad_path) {
+			unix_ERR_class = ERRDOS;
+			unix_ERR_code = ERRbadpath;
+		}
+
+		return ERROR_CODE(ERRDOS, ERRbadpath);
+	}
+
+	p = strrchr(directory, '/');
+	if (p == NULL) {
+		pstrcpy(mask, directory);
+		pstrcpy(directory, ".");
+	} else {
+		pstrcpy(mask, p + 1);
+		*p = 0;
+	}
+	mask_convert(mask);
+
+	DEBUG("dir=%s, mask = %s\n", directory, mask);
+
+	handle = notify_open(cnum, directory, mask, dirtype);
+	if (handle < 0) {
+		return UNIX_ERROR_CODE(ERRDOS, ERRbadpath);
+	}
+
 	params = *pparams = checked_realloc(*pparams, 6);
 
-	SSVAL(params, 0, fnf_handle);
+	SSVAL(params, 0, handle);
 	SSVAL(params, 2, 0); /* No changes */
 	SSVAL(params, 4, 0); /* No EA errors */
 
-	fnf_handle++;
-
-	if (fnf_handle == 0)
-		fnf_handle = 257;
-
 	send_trans2_replies(outbuf, bufsize, params, 6, *ppdata, 0);
 
 	return -1;
@@ -1636,20 +1870,48 @@ static int call_trans2findnotifyfirst(char *inbuf, char *outbuf, int length,
 
 /****************************************************************************
   reply to a TRANS2_FINDNOTIFYNEXT (continue monitoring a directory for
-  changes). Currently this does nothing.
+  changes). If there have been none, the request may wait for some.
 ****************************************************************************/
 static int call_trans2findnotifynext(char *inbuf, char *outbuf, int length,
                                      int bufsize, int cnum, char **pparams,
                                      char **ppdata)
 {
-	char *params;
+	char *params = *pparams;
+	int handle = SVAL(params, 0);
+	int max_entries = SVAL(params, 2);
+	int info_level = SVAL(params, 4);
+	uint32_t timeout = IVAL(params, 6);
+	int max_data = SVAL(inbuf, smb_mdrcnt);
+	struct notify_handle *h;
 
-	params = *pparams = checked_realloc(*pparams, 4);
+	DEBUG("handle=%d max_entries=%d info_level=%d timeout=%u\n", handle,
+	      max_entries, info_level, timeout);
 
-	SSVAL(params, 0, 0); /* No changes */
-	SSVAL(params, 2, 0); /* No EA errors */
+	switch (info_level) {
+	case 1:
+	case 2:
+		break;
+	default:
+		return ERROR_CODE(ERRDOS, ERRunknownlevel);
+	}
+
+	h = notify_find(handle, cnum);
+	if (h == NULL) {
+		return ERROR_CODE(ERRDOS, ERRbadfid);
+	}
+
+	/* pick up changes not yet read, in case there is no need to wait */
+	notify_receive();
+
+	if (h->num_names == 0 && h->num_lost == 0 && timeout != 0 &&
+	    notify_wait_allowed(inbuf)) {
+		push_notify_request(inbuf, h, timeout, max_entries, info_level,
+		                    max_data);
+		return -1;
+	}
 
-	send_trans2_replies(outbuf, bufsize, params, 4, *ppdata, 0);
+	find_notify_reply(outbuf, bufsize, h, max_entries, info_level,
+	                  max_data);
 
 	return -1;
 }
@@ -1690,9 +1952,9 @@ int reply_findnclose(char *inbuf, char *outbuf, int length, int bufsize)
 
 	DEBUG("cnum = %d, dptr_num = %d\n", cnum, dptr_num);
 
-	/* We never give out valid handles for a
-	   findnotifyfirst - so any dptr_num is ok here.
-	   Just ignore it. */
+	/* a request waiting on the handle is answered; there may be no such
+	   handle if it could not be watched, which is ok too */
+	notify_close(dptr_num);
 
 	outsize = set_message(outbuf, 0, 0, true);
 
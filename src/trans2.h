@@ -225,7 +225,10 @@ Byte offset   Type     name                description
 
 #define NT_FILE_ATTRIBUTE_NORMAL 0x80
 
+struct notify_handle;
+
 void mask_convert(char *mask);
+void send_find_notify_reply(char *inbuf, struct notify_handle *h);
 int reply_findclose(char *inbuf, char *outbuf, int length, int bufsize);
 int reply_findnclose(char *inbuf, char *outbuf, int length, int bufsize);
 int reply_transs2(char *inbuf, char *outbuf, int length, int bufsize);
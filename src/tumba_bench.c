@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_bench is a small SMB client for measuring the time the server
+   takes to handle requests. It connects to a share as a guest, then sends
+   the same request over and over, one at a time, and reports the rate and
+   the round trip time. Given the pid of the process serving it (for
+   example a server running with -e), it also reports the CPU time the
+   server used per request, read from /proc/<pid>/schedstat. */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "smb.h"
+#include "strfunc.h"
+
+/* name of the file created in the share for the getatr and lock tests */
+#define BENCH_FILE "TUMBABEN.DAT"
+
+/* the client pid sent in requests and lock ranges */
+#define BENCH_PID 1234
+
+static const char *progname;
+static int server_fd = -1;
+static uint16_t tid, uid, mid;
+static char inbuf[BUFFER_SIZE + 4], outbuf[BUFFER_SIZE + 4];
+
+/****************************************************************************
+start building a request in outbuf, returning a pointer to its data area
+****************************************************************************/
+static char *new_request(int cmd, int num_words)
+{
+	memset(outbuf, 0, smb_size + num_words * 2);
+	memcpy(outbuf + 4, "\377SMB", 4);
+	CVAL(outbuf, smb_com) = cmd;
+	CVAL(outbuf, smb_flg) = 0x08; /* case insensitive paths */
+	SSVAL(outbuf, smb_flg2, 1);
+	SSVAL(outbuf, smb_tid, tid);
+	SSVAL(outbuf, smb_pid, BENCH_PID);
+	SSVAL(outbuf, smb_uid, uid);
+	SSVAL(outbuf, smb_mid, ++mid);
+	CVAL(outbuf, smb_wct) = num_words;
+
+	return outbuf + smb_size + num_words * 2;
+}
+
+static bool read_all(char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(server_fd, buf, len);
+		if (n <= 0) {
+			fprintf(stderr, "%s: connection lost: %s\n", progname,
+			        n == 0 ? "end of file" : strerror(errno));
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/****************************************************************************
+send the request in outbuf, whose data ends at end, and read the reply into
+inbuf
+****************************************************************************/
+static bool call(const char *end)
+{
+	int wct = CVAL(outbuf, smb_wct);
+	int num_bytes = end - (outbuf + smb_size + wct * 2);
+	size_t len = smb_size + wct * 2 + num_bytes - 4;
+	size_t done = 0;
+	ssize_t n;
+
+	SSVAL(outbuf, smb_vwv + wct * 2, num_bytes);
+	outbuf[0] = 0;
+	outbuf[1] = (len >> 16) & 1;
+	outbuf[2] = (len >> 8) & 0xff;
+	outbuf[3] = len & 0xff;
+
+	while (done < len + 4) {
+		n = write(server_fd, outbuf + done, len + 4 - done);
+		if (n <= 0) {
+			fprintf(stderr, "%s: write: %s\n", progname,
+			        strerror(errno));
+			return false;
+		}
+		done += n;
+	}
+
+	/* skip any session keepalives */
+	do {
+		if (!read_all(inbuf, 4)) {
+			return false;
+		}
+		len = ((PVAL(inbuf, 1) & 1) << 16) | (PVAL(inbuf, 2) << 8) |
+		      PVAL(inbuf, 3);
+		if (len < smb_size - 4 || !read_all(inbuf + 4, len)) {
+			return false;
+		}
+	} while (CVAL(inbuf, 0) == 0x85);
+
+	if (CVAL(inbuf, smb_rcls) != 0) {
+		fprintf(stderr, "%s: command 0x%02x failed: class %d code %d\n",
+		        progname, CVAL(outbuf, smb_com), CVAL(inbuf, smb_rcls),
+		        SVAL(inbuf, smb_err));
+		return false;
+	}
+
+	return true;
+}
+
+static bool connect_server(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s: %s\n", progname, host,
+		        gai_strerror(err));
+		return false;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		server_fd =
+			socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (server_fd < 0) {
+			continue;
+		}
+		if (connect(server_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(server_fd);
+		server_fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (server_fd < 0) {
+		fprintf(stderr, "%s: failed to connect to %s port %s\n",
+		        progname, host, port);
+		return false;
+	}
+
+	return true;
+}
+
+/****************************************************************************
+negotiate the protocol, log on as a guest and connect to the share
+****************************************************************************/
+static bool start_session(const char *share)
+{
+	static const char dialects[] = "\002PC NETWORK PROGRAM 1.0\0"
+	                               "\002NT LM 0.12";
+	static const char logon[] = "\0GUEST\0WORKGROUP\0Unix\0tumba_bench";
+	char *p;
+
+	p = new_request(SMBnegprot, 0);
+	memcpy(p, dialects, sizeof(dialects));
+	if (!call(p + sizeof(dialects))) {
+		return false;
+	}
+
+	p = new_request(SMBsesssetupX, 10);
+	CVAL(outbuf, smb_vwv0) = 0xff;
+	SSVAL(outbuf, smb_vwv2, 0xffff);
+	SSVAL(outbuf, smb_vwv3, 2);
+	SSVAL(outbuf, smb_vwv7, 1);
+	memcpy(p, logon, sizeof(logon));
+	if (!call(p + sizeof(logon))) {
+		return false;
+	}
+	uid = SVAL(inbuf, smb_uid);
+
+	p = new_request(SMBtconX, 4);
+	CVAL(outbuf, smb_vwv0) = 0xff;
+	SSVAL(outbuf, smb_vwv3, 1);
+	*p++ = '\0';
+	p += snprintf(p, sizeof(pstring), "\\\\HOST\\%s", share) + 1;
+	memcpy(p, "?????", 6);
+	if (!call(p + 6)) {
+		return false;
+	}
+	tid = SVAL(inbuf, smb_tid);
+
+	return true;
+}
+
+/****************************************************************************
+create the file used by the getatr and lock tests, returning its fnum
+****************************************************************************/
+static int create_bench_file(void)
+{
+	char *p;
+
+	p = new_request(SMBopenX, 15);
+	CVAL(outbuf, smb_vwv0) = 0xff;
+	SSVAL(outbuf, smb_vwv3, 2);    /* read/write access */
+	SSVAL(outbuf, smb_vwv4, 0x16); /* search attributes */
+	SSVAL(outbuf, smb_vwv8, 0x12); /* create or truncate */
+	p += strlcpy(p, BENCH_FILE, sizeof(pstring)) + 1;
+	if (!call(p)) {
+		return -1;
+	}
+
+	return SVAL(inbuf, smb_vwv2);
+}
+
+static void remove_bench_file(int fnum)
+{
+	char *p;
+
+	p = new_request(SMBclose, 3);
+	SSVAL(outbuf, smb_vwv0, fnum);
+	call(p);
+
+	p = new_request(SMBunlink, 1);
+	SSVAL(outbuf, smb_vwv0, 0x16);
+	*p++ = 4;
+	p += strlcpy(p, BENCH_FILE, sizeof(pstring)) + 1;
+	call(p);
+}
+
+static int bench_fnum = -1;
+
+static bool do_echo(int i)
+{
+	char *p;
+
+	p = new_request(SMBecho, 1);
+	SSVAL(outbuf, smb_vwv0, 1);
+	*p++ = 'x';
+	return call(p);
+}
+
+static bool do_getatr(int i)
+{
+	char *p;
+
+	p = new_request(SMBgetatr, 0);
+	*p++ = 4;
+	p += strlcpy(p, "\\" BENCH_FILE, sizeof(pstring)) + 1;
+	return call(p);
+}
+
+static bool do_chkpth(int i)
+{
+	char *p;
+
+	p = new_request(SMBchkpth, 0);
+	*p++ = 4;
+	p += strlcpy(p, "\\", sizeof(pstring)) + 1;
+	return call(p);
+}
+
+/****************************************************************************
+lock and unlock a 16-byte range in turn, moving through 64 ranges
+****************************************************************************/
+static bool do_lock(int i)
+{
+	bool unlock = (i & 1) != 0;
+	char *p;
+
+	p = new_request(SMBlockingX, 8);
+	CVAL(outbuf, smb_vwv0) = 0xff;
+	SSVAL(outbuf, smb_vwv2, bench_fnum);
+	SSVAL(outbuf, smb_vwv6, unlock ? 1 : 0);
+	SSVAL(outbuf, smb_vwv7, unlock ? 0 : 1);
+	SSVAL(p, 0, BENCH_PID);
+	SIVAL(p, 2, ((i / 2) % 64) * 16);
+	SIVAL(p, 6, 16);
+	return call(p + 10);
+}
+
+static const struct {
+	const char *name;
+	bool (*fn)(int i);
+} tests[] = {
+	{"echo", do_echo},
+	{"getatr", do_getatr},
+	{"chkpth", do_chkpth},
+	{"lock", do_lock},
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(*tests))
+
+/****************************************************************************
+return the CPU time used by a process in nanoseconds, or -1 if unknown
+****************************************************************************/
+static long long process_cpu_time(long pid)
+{
+	char path[64];
+	long long result;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%ld/schedstat", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fscanf(fp, "%lld", &result) != 1) {
+		result = -1;
+	}
+	fclose(fp);
+
+	return result;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/****************************************************************************
+run one test, after a short warm-up, and print the results
+****************************************************************************/
+static bool run_test(int t, int count, long server_pid)
+{
+	long long cpu_start = -1, cpu_end = -1;
+	double start, elapsed;
+	int i;
+
+	/* an even number, so that no lock is left held */
+	for (i = 0; i < count / 20 * 2; i++) {
+		if (!tests[t].fn(i)) {
+			return false;
+		}
+	}
+
+	if (server_pid > 0) {
+		cpu_start = process_cpu_time(server_pid);
+	}
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (!tests[t].fn(i)) {
+			return false;
+		}
+	}
+	elapsed = now() - start;
+	if (server_pid > 0) {
+		cpu_end = process_cpu_time(server_pid);
+	}
+
+	printf("%-8s %9.0f requests/s %8.1f us round trip", tests[t].name,
+	       count / elapsed, elapsed / count * 1e6);
+	/* the process may have gone away */
+	if (cpu_start >= 0 && cpu_end >= cpu_start) {
+		printf(" %7.2f us server CPU",
+		       (cpu_end - cpu_start) / 1e3 / count);
+	}
+	printf("\n");
+
+	return true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	        "Usage: %s [-p port] [-n count] [-P pid] <host> <share> "
+	        "[test...]\n\n",
+	        progname);
+	fprintf(stderr, "   -p port           port to connect to (default "
+	                "%d)\n"
+	                "   -n count          number of requests for each "
+	                "test (default 20000)\n"
+	                "   -P pid            pid of the server process, to "
+	                "report its CPU time\n\n"
+	                "Tests: echo getatr chkpth lock (default: all)\n",
+	        SMB_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	bool selected[NUM_TESTS];
+	long server_pid = 0;
+	int count = 20000;
+	fstring port;
+	int opt, i, t;
+	bool ok = true;
+
+	progname = argv[0];
+	snprintf(port, sizeof(port), "%d", SMB_PORT);
+
+	while ((opt = getopt(argc, argv, "p:n:P:h")) != EOF) {
+		switch (opt) {
+		case 'p':
+			strlcpy(port, optarg, sizeof(port));
+			break;
+		case 'n':
+			count = atoi(optarg);
+			if (count < 1) {
+				fprintf(stderr, "%s: -n must be at least 1\n",
+				        progname);
+				exit(1);
+			}
+			break;
+		case 'P':
+			server_pid = atol(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind + 2 > argc) {
+		usage();
+		exit(1);
+	}
+
+	memset(selected, optind + 2 == argc, sizeof(selected));
+	for (i = optind + 2; i < argc; i++) {
+		for (t = 0; t < NUM_TESTS; t++) {
+			if (!strcmp(argv[i], tests[t].name)) {
+				selected[t] = true;
+				break;
+			}
+		}
+		if (t == NUM_TESTS) {
+			fprintf(stderr, "%s: unknown test: %s\n", progname,
+			        argv[i]);
+			exit(1);
+		}
+	}
+
+	if (!connect_server(argv[optind], port) ||
+	    !start_session(argv[optind + 1])) {
+		exit(1);
+	}
+
+	bench_fnum = create_bench_file();
+	if (bench_fnum < 0) {
+		exit(1);
+	}
+
+	/* lock requests go in lock/unlock pairs */
+	count += count & 1;
+
+	for (t = 0; ok && t < NUM_TESTS; t++) {
+		if (selected[t]) {
+			ok = run_test(t, count, server_pid);
+		}
+	}
+
+	remove_bench_file(bench_fnum);
+	close(server_fd);
+
+	return ok ? 0 : 1;
+}
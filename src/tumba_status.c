@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_status connects to the status socket of a running tumba_smbd (see
+   the -s option) and shows a table of the client sessions being served.
+   The server only reports counters, so request rates are worked out by
+   taking two samples a short interval apart. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "strfunc.h"
+
+#define MAX_SESSIONS 1024
+
+struct counters {
+	unsigned long long requests, bytes_in, bytes_out;
+	unsigned long long dir_cache_hits, dir_cache_misses;
+	unsigned long long attr_cache_hits, attr_cache_misses;
+};
+
+struct session {
+	int id;
+	long pid, start;
+	char client[32];
+	unsigned long connections, open_files, dptrs;
+	struct counters c;
+};
+
+struct sample {
+	long time;
+	unsigned long long ended_sessions;
+	struct counters ended;
+	struct session sessions[MAX_SESSIONS];
+	int num_sessions;
+};
+
+static const char *progname;
+
+/****************************************************************************
+find a "key=value" field in a line of the status report
+****************************************************************************/
+static const char *find_field(const char *line, const char *key)
+{
+	size_t keylen = strlen(key);
+	const char *p = line;
+
+	while ((p = strstr(p, key)) != NULL) {
+		if ((p == line || p[-1] == ' ') && p[keylen] == '=') {
+			return p + keylen + 1;
+		}
+		p += keylen;
+	}
+
+	return NULL;
+}
+
+static unsigned long long number_field(const char *line, const char *key)
+{
+	const char *p = find_field(line, key);
+
+	return p == NULL ? 0 : strtoull(p, NULL, 10);
+}
+
+static void read_counters(const char *line, struct counters *c)
+{
+	c->requests = number_field(line, "requests");
+	c->bytes_in = number_field(line, "bytes_in");
+	c->bytes_out = number_field(line, "bytes_out");
+	c->dir_cache_hits = number_field(line, "dir_cache_hits");
+	c->dir_cache_misses = number_field(line, "dir_cache_misses");
+	c->attr_cache_hits = number_field(line, "attr_cache_hits");
+	c->attr_cache_misses = number_field(line, "attr_cache_misses");
+}
+
+static void add_counters(struct counters *total, const struct counters *c)
+{
+	total->requests += c->requests;
+	total->bytes_in += c->bytes_in;
+	total->bytes_out += c->bytes_out;
+	total->dir_cache_hits += c->dir_cache_hits;
+	total->dir_cache_misses += c->dir_cache_misses;
+	total->attr_cache_hits += c->attr_cache_hits;
+	total->attr_cache_misses += c->attr_cache_misses;
+}
+
+/****************************************************************************
+read the status report from the server
+****************************************************************************/
+static bool read_sample(const char *path, struct sample *sample)
+{
+	struct sockaddr_un addr;
+	char line[1024];
+	FILE *stream;
+	int fd;
+
+	memset(sample, 0, sizeof(struct sample));
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long: %s\n", progname,
+		        path);
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 ||
+	    connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "%s: failed to connect to %s: %s\n", progname,
+		        path, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+
+	stream = fdopen(fd, "r");
+	while (fgets(line, sizeof(line), stream) != NULL) {
+		if (!strncmp(line, "time=", 5)) {
+			sample->time = strtol(line + 5, NULL, 10);
+		} else if (!strncmp(line, "ended ", 6)) {
+			sample->ended_sessions = number_field(line, "sessions");
+			read_counters(line, &sample->ended);
+		} else if (!strncmp(line, "session ", 8) &&
+		           sample->num_sessions < MAX_SESSIONS) {
+			struct session *s =
+			    &sample->sessions[sample->num_sessions++];
+			const char *client = find_field(line, "client");
+
+			s->id = number_field(line, "id");
+			s->pid = number_field(line, "pid");
+			s->start = number_field(line, "start");
+			if (client != NULL) {
+				strlcpy(s->client, client, sizeof(s->client));
+				s->client[strcspn(s->client, " \n")] = '\0';
+			}
+			s->connections = number_field(line, "connections");
+			s->open_files = number_field(line, "open_files");
+			s->dptrs = number_field(line, "dptrs");
+			read_counters(line, &s->c);
+		}
+	}
+	fclose(stream);
+
+	return true;
+}
+
+/****************************************************************************
+find a session in an earlier sample
+****************************************************************************/
+static struct session *find_session(struct sample *sample, struct session *s)
+{
+	int i;
+
+	for (i = 0; i < sample->num_sessions; i++) {
+		struct session *s2 = &sample->sessions[i];
+		if (s2->id == s->id && s2->pid == s->pid &&
+		    s2->start == s->start) {
+			return s2;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+format a byte count for display
+****************************************************************************/
+static char *format_bytes(char *buf, size_t buf_len, unsigned long long n)
+{
+	static const char units[] = "KMGTP";
+	double value = n;
+	int i;
+
+	if (n < 1024) {
+		snprintf(buf, buf_len, "%llu", n);
+		return buf;
+	}
+	for (i = 0; value >= 1024 && i < (int) sizeof(units) - 1; i++) {
+		value /= 1024;
+	}
+	snprintf(buf, buf_len, "%.1f%c", value, units[i - 1]);
+	return buf;
+}
+
+/****************************************************************************
+format a cache hit rate for display
+****************************************************************************/
+static char *format_hit_rate(char *buf, size_t buf_len,
+                             unsigned long long hits,
+                             unsigned long long misses)
+{
+	if (hits + misses == 0) {
+		snprintf(buf, buf_len, "-");
+	} else {
+		snprintf(buf, buf_len, "%.0f%%", 100.0 * hits / (hits + misses));
+	}
+	return buf;
+}
+
+static void print_row(const char *pid, const char *client, const char *conns,
+                      const char *files, const char *dptrs,
+                      struct counters *c, double rate)
+{
+	char rate_buf[16], in_buf[16], out_buf[16], dir_buf[8], attr_buf[8];
+
+	if (rate < 0) {
+		snprintf(rate_buf, sizeof(rate_buf), "-");
+	} else {
+		snprintf(rate_buf, sizeof(rate_buf), "%.1f", rate);
+	}
+
+	printf("%7s %-21s %5s %5s %5s %10llu %8s %9s %9s %5s %5s\n", pid,
+	       client, conns, files, dptrs, c->requests, rate_buf,
+	       format_bytes(in_buf, sizeof(in_buf), c->bytes_in),
+	       format_bytes(out_buf, sizeof(out_buf), c->bytes_out),
+	       format_hit_rate(dir_buf, sizeof(dir_buf), c->dir_cache_hits,
+	                       c->dir_cache_misses),
+	       format_hit_rate(attr_buf, sizeof(attr_buf), c->attr_cache_hits,
+	                       c->attr_cache_misses));
+}
+
+/****************************************************************************
+show the sessions in the newest sample, with request rates worked out
+from the older one if there is one
+****************************************************************************/
+static void show_sample(struct sample *sample, struct sample *prev,
+                        double elapsed)
+{
+	struct counters total = sample->ended, prev_total;
+	char pid[16], conns[16], files[16], dptrs[16];
+	unsigned long total_conns = 0, total_files = 0, total_dptrs = 0;
+	int i;
+
+	printf("%7s %-21s %5s %5s %5s %10s %8s %9s %9s %5s %5s\n", "PID",
+	       "CLIENT", "CONNS", "FILES", "DIRS", "REQUESTS", "REQ/S",
+	       "RECEIVED", "SENT", "DIR%", "ATTR%");
+
+	for (i = 0; i < sample->num_sessions; i++) {
+		struct session *s = &sample->sessions[i];
+		struct session *old = NULL;
+		double rate = -1;
+
+		if (prev != NULL) {
+			old = find_session(prev, s);
+			rate = (s->c.requests -
+			        (old != NULL ? old->c.requests : 0)) /
+			       elapsed;
+		}
+
+		snprintf(pid, sizeof(pid), "%ld", s->pid);
+		snprintf(conns, sizeof(conns), "%lu", s->connections);
+		snprintf(files, sizeof(files), "%lu", s->open_files);
+		snprintf(dptrs, sizeof(dptrs), "%lu", s->dptrs);
+		print_row(pid, s->client, conns, files, dptrs, &s->c, rate);
+
+		add_counters(&total, &s->c);
+		total_conns += s->connections;
+		total_files += s->open_files;
+		total_dptrs += s->dptrs;
+	}
+
+	snprintf(conns, sizeof(conns), "%lu", total_conns);
+	snprintf(files, sizeof(files), "%lu", total_files);
+	snprintf(dptrs, sizeof(dptrs), "%lu", total_dptrs);
+
+	if (prev != NULL) {
+		/* requests of sessions that ended count towards the totals
+		   of both samples, so the rate never goes negative */
+		prev_total = prev->ended;
+		for (i = 0; i < prev->num_sessions; i++) {
+			add_counters(&prev_total, &prev->sessions[i].c);
+		}
+		print_row("total", "", conns, files, dptrs, &total,
+		          (total.requests - prev_total.requests) / elapsed);
+	} else {
+		print_row("total", "", conns, files, dptrs, &total, -1);
+	}
+
+	printf("\n%d active sessions, %llu ended\n", sample->num_sessions,
+	       sample->ended_sessions);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-i secs] <socket>\n\n", progname);
+	fprintf(stderr, "   -i secs           interval between the two "
+	                "samples used to\n"
+	                "                     work out request rates; 0 "
+	                "shows no rates\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct sample samples[2];
+	int interval = 1;
+	int opt;
+
+	progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "i:h")) != EOF) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind + 1 != argc) {
+		usage();
+		exit(1);
+	}
+
+	if (!read_sample(argv[optind], &samples[0])) {
+		exit(1);
+	}
+	if (interval <= 0) {
+		show_sample(&samples[0], NULL, 0);
+		exit(0);
+	}
+
+	sleep(interval);
+	if (!read_sample(argv[optind], &samples[1])) {
+		exit(1);
+	}
+	show_sample(&samples[1], &samples[0], interval);
+
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -29,10 +30,12 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "byteorder.h"
 #include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
 #include "smb.h"
 #include "timefunc.h"
 
@@ -47,9 +50,6 @@ int LOGLEVEL = 1;
 
 int Protocol = PROTOCOL_COREPLUS;
 
-/* these are some file handles where debug info will be stored */
-FILE *dbf = NULL;
-
 /* the client file descriptor */
 int Client = -1;
 
@@ -62,7 +62,40 @@ fstring local_machine = "";
 
 int smb_read_error = 0;
 
-static bool log_start_of_line = true;
+/* Log messages are formatted in memory and written to the log file in
+   batches by a separate thread, so that logging does not cost a system call
+   for every message. If the log file cannot keep up and the buffer fills,
+   messages are dropped rather than holding up the server. */
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+/* the log thread is woken once this much is waiting to be written */
+#define LOG_BATCH_SIZE (8 * 1024)
+
+/* the longest time a message waits in the buffer, in seconds */
+#define LOG_FLUSH_SECS 1
+
+static int log_fd = -1;
+
+/* the line being built; a message that does not end with a newline is kept
+   here until the rest of the line is logged */
+static char log_line[4096];
+static size_t log_line_len;
+
+/* log_head and log_tail count the bytes ever added to and written from the
+   buffer; the difference between them is the amount waiting */
+static char log_buffer[LOG_BUFFER_SIZE];
+static size_t log_head, log_tail;
+static unsigned long log_dropped;
+static bool log_urgent;
+
+/* set while logging, so that a signal handler that logs does not deadlock */
+static volatile sig_atomic_t in_log_output;
+
+static pid_t log_pid;
+static bool log_thread_started;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
 
 /*******************************************************************
   get ready for syslog stuff
@@ -106,6 +139,223 @@ static void syslog_output(int level, char *format_str, va_list ap)
 	syslog(priority, "%s", msgbuf);
 }
 
+/*******************************************************************
+write out everything waiting in the log buffer. Must be called with
+log_write_lock held, so that nothing is written twice.
+********************************************************************/
+static void write_log_buffer(void)
+{
+	size_t start, end, ofs, len;
+	ssize_t n;
+
+	pthread_mutex_lock(&log_lock);
+	start = log_tail;
+	end = log_head;
+	pthread_mutex_unlock(&log_lock);
+
+	while (start < end) {
+		ofs = start % LOG_BUFFER_SIZE;
+		len = MIN(end - start, LOG_BUFFER_SIZE - ofs);
+		n = write(log_fd, log_buffer + ofs, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			/* nothing else can be done with it */
+			break;
+		}
+		start += n;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	log_tail = end;
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void *log_thread(void *arg)
+{
+	struct timespec deadline;
+
+	for (;;) {
+		pthread_mutex_lock(&log_lock);
+		while (log_head == log_tail) {
+			pthread_cond_wait(&log_cond, &log_lock);
+		}
+
+		/* wait a while for more, so that it can all be written
+		   together */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += LOG_FLUSH_SECS;
+		while (!log_urgent && log_head - log_tail < LOG_BATCH_SIZE &&
+		       pthread_cond_timedwait(&log_cond, &log_lock,
+		                              &deadline) == 0)
+			;
+		log_urgent = false;
+		pthread_mutex_unlock(&log_lock);
+
+		pthread_mutex_lock(&log_write_lock);
+		write_log_buffer();
+		pthread_mutex_unlock(&log_write_lock);
+	}
+
+	return NULL;
+}
+
+/*******************************************************************
+write out any log messages waiting in the buffer. Called at exit.
+********************************************************************/
+void log_flush(void)
+{
+	if (log_fd == -1 || log_pid != getpid() || in_log_output) {
+		return;
+	}
+
+	in_log_output = 1;
+	pthread_mutex_lock(&log_write_lock);
+	write_log_buffer();
+	pthread_mutex_unlock(&log_write_lock);
+	in_log_output = 0;
+}
+
+/*******************************************************************
+start the log thread. Threads do not survive fork(), so a child process
+starts its own; anything left in the buffer belongs to the parent.
+********************************************************************/
+static void start_log_thread(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+
+	if (log_pid == 0) {
+		atexit(log_flush);
+	}
+
+	log_pid = getpid();
+	log_head = log_tail = 0;
+	log_dropped = 0;
+	log_urgent = false;
+	pthread_mutex_init(&log_lock, NULL);
+	pthread_mutex_init(&log_write_lock, NULL);
+	pthread_cond_init(&log_cond, NULL);
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	log_thread_started =
+	    pthread_create(&thread, NULL, log_thread, NULL) == 0;
+	if (log_thread_started) {
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* must be called with log_lock held */
+static bool append_log_buffer(const char *s, size_t len)
+{
+	size_t ofs, n;
+
+	if (len > LOG_BUFFER_SIZE - (log_head - log_tail)) {
+		return false;
+	}
+
+	ofs = log_head % LOG_BUFFER_SIZE;
+	n = MIN(len, LOG_BUFFER_SIZE - ofs);
+	memcpy(log_buffer + ofs, s, n);
+	memcpy(log_buffer, s + n, len - n);
+	log_head += len;
+
+	return true;
+}
+
+/*******************************************************************
+the time at the start of each log line; only formatted once a second
+********************************************************************/
+static const char *log_timestamp(void)
+{
+	static time_t last_time = -1;
+	static fstring buf;
+	time_t t = time(NULL);
+
+	if (t != last_time) {
+		fstrcpy(buf, timestring());
+		last_time = t;
+	}
+
+	return buf;
+}
+
+/*******************************************************************
+add complete lines to the log buffer. Urgent messages are written out
+straight away.
+********************************************************************/
+static void queue_log_line(const char *line, size_t len, bool urgent)
+{
+	size_t before;
+	char note[128];
+	int n;
+
+	if (log_pid != getpid()) {
+		start_log_thread();
+	}
+
+	if (!log_thread_started) {
+		if (write(log_fd, line, len) < 0) {
+			/* nowhere to report it */
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	before = log_head - log_tail;
+
+	if (log_dropped > 0) {
+		n = snprintf(note, sizeof(note),
+		             "%s log buffer full, %lu messages dropped\n",
+		             log_timestamp(), log_dropped);
+		if (append_log_buffer(note, n)) {
+			log_dropped = 0;
+		}
+	}
+	if (log_dropped > 0 || !append_log_buffer(line, len)) {
+		++log_dropped;
+	}
+
+	if (urgent) {
+		log_urgent = true;
+	}
+	if (urgent || before == 0 ||
+	    (before < LOG_BATCH_SIZE &&
+	     log_head - log_tail >= LOG_BATCH_SIZE)) {
+		pthread_cond_signal(&log_cond);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*******************************************************************
+format text onto the end of the line being built, truncating it if it
+does not fit
+********************************************************************/
+static void log_line_vprintf(const char *format_str, va_list ap)
+{
+	int n = vsnprintf(log_line + log_line_len,
+	                  sizeof(log_line) - log_line_len, format_str, ap);
+
+	if (n > 0) {
+		log_line_len = MIN(log_line_len + n, sizeof(log_line) - 1);
+	}
+}
+
+static void log_line_printf(const char *format_str, ...)
+    PRINTF_ATTRIBUTE(1, 2);
+
+static void log_line_printf(const char *format_str, ...)
+{
+	va_list ap;
+
+	va_start(ap, format_str);
+	log_line_vprintf(format_str, ap);
+	va_end(ap);
+}
+
 /*******************************************************************
 write an debug message on the debugfile. This is called by the LOG
 macro
@@ -117,18 +367,22 @@ int log_output(const char *funcname, int linenum, int level, char *format_str,
 	int old_errno = errno;
 	size_t n;
 
-	if (!dbf) {
+	if (in_log_output) {
+		return 0;
+	}
+
+	if (log_fd == -1) {
 		int oldumask = umask(022);
-		dbf = fopen(debugf, "a");
+		log_fd = open(debugf, O_WRONLY | O_APPEND | O_CREAT, 0666);
 		umask(oldumask);
-		if (dbf) {
-			setbuf(dbf, NULL);
-		} else {
+		if (log_fd == -1) {
 			errno = old_errno;
 			return 0;
 		}
 	}
 
+	in_log_output = 1;
+
 	/* we do not pass debug messages to syslog */
 	if (level < 4) {
 		va_start(ap, format_str);
@@ -136,28 +390,30 @@ int log_output(const char *funcname, int linenum, int level, char *format_str,
 		va_end(ap);
 	}
 
-	if (log_start_of_line) {
-		log_start_of_line = false;
-		fprintf(dbf, "%s ", timestring());
+	if (log_line_len == 0) {
+		log_line_printf("%s ", log_timestamp());
 
 		if (client_addr[0] != '\0') {
-			fprintf(dbf, "[%s] ", client_addr);
+			log_line_printf("[%s] ", client_addr);
 		}
 		if (funcname != NULL) {
-			fprintf(dbf, "%s (#%d): ", funcname, linenum);
+			log_line_printf("%s (#%d): ", funcname, linenum);
 		}
 	}
 
 	va_start(ap, format_str);
-	vfprintf(dbf, format_str, ap);
+	log_line_vprintf(format_str, ap);
 	va_end(ap);
-	fflush(dbf);
 
 	n = strlen(format_str);
-	if (n > 0 && format_str[strlen(format_str) - 1] == '\n') {
-		log_start_of_line = true;
+	if (n > 0 && format_str[n - 1] == '\n') {
+		/* a truncated line still needs to end with a newline */
+		log_line[log_line_len - 1] = '\n';
+		queue_log_line(log_line, log_line_len, level <= 1);
+		log_line_len = 0;
 	}
 
+	in_log_output = 0;
 	errno = old_errno;
 
 	return 0;
@@ -562,6 +818,27 @@ int write_data(int fd, char *buffer, int N)
 	return total;
 }
 
+/****************************************************************************
+  write data to a fd at the given offset
+****************************************************************************/
+int pwrite_data(int fd, char *buffer, int N, off_t pos)
+{
+	int total = 0;
+	int ret;
+
+	while (total < N) {
+		ret = pwrite(fd, buffer + total, N - total, pos + total);
+
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			return total;
+
+		total += ret;
+	}
+	return total;
+}
+
 /****************************************************************************
 read 4 bytes of a smb packet and return the smb length of the packet
 store the result in the buffer
@@ -631,10 +908,11 @@ bool send_smb(int fd, char *buffer)
 		if (ret <= 0) {
 			ERROR("Error writing %d bytes to client. %d. Exiting\n",
 			      len, ret);
-			exit(1);
+			exit_server("error writing to client");
 		}
 		nwritten += ret;
 	}
+	count_request_bytes(0, len);
 
 	return true;
 }
@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "strfunc.h"
 
@@ -55,6 +56,7 @@ extern char client_addr[32];
 void setup_logging(char *pname);
 int log_output(const char *funcname, int linenum, int level, char *format_str,
                ...) PRINTF_ATTRIBUTE(4, 5);
+void log_flush(void);
 bool file_exist(char *fname, struct stat *sbuf);
 bool directory_exist(char *dname, struct stat *st);
 uint32_t file_size(char *file_name);
@@ -69,6 +71,7 @@ int smb_offset(char *p, char *buf);
 void close_low_fds(void);
 int read_data(int fd, char *buffer, int N);
 int write_data(int fd, char *buffer, int N);
+int pwrite_data(int fd, char *buffer, int N, off_t pos);
 int read_smb_length_return_keepalive(int fd, char *inbuf, int timeout);
 int read_smb_length(int fd, char *inbuf, int timeout);
 bool send_smb(int fd, char *buffer);
@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Cached information about a directory has to be checked before it is
+   used, in case the directory has been changed by another client or on the
+   Unix side; normally that means a stat() to see if the modification time
+   has changed. With this module, every directory in the shares is watched
+   with inotify(7) by a thread in the main server process, which keeps a
+   generation counter for each directory in a table in memory shared by all
+   the server processes. The counter is increased whenever anything in the
+   directory changes, so a cache can instead check that the counter still
+   has the value it had when the information was read.
+
+   The table is keyed by share and the path of the directory relative to the
+   share, which is "." for the top directory. A directory that is not in the
+   table, for example because the limit on inotify watches was reached, is
+   not being watched, and caches must check it the old way. Changes that the
+   server makes itself are also passed on straight away with watch_changed(),
+   rather than waiting for the thread to see them. */
+
+#include "watch.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "shares.h"
+#include "util.h"
+
+/* number of entries in the shared table; must be a power of two */
+#define WATCH_TABLE_SIZE 65536
+
+struct watch_entry {
+	uint64_t key;     /* 0 if the entry is empty */
+	uint32_t gen;     /* increased when the directory changes */
+	uint32_t watched; /* true while the directory is being watched */
+};
+
+/* Entries are only ever added by the watch thread, and are never removed;
+   a directory that is no longer watched just has watched cleared. */
+static struct watch_entry *table = NULL;
+
+static uint64_t dir_key(const struct share *share, const char *path,
+                        size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char *p;
+	size_t i;
+
+	p = (const unsigned char *) &share;
+	for (i = 0; i < sizeof(share); i++) {
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	}
+	p = (const unsigned char *) path;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	}
+
+	return hash != 0 ? hash : 1;
+}
+
+static struct watch_entry *find_entry(uint64_t key)
+{
+	unsigned int i = key & (WATCH_TABLE_SIZE - 1);
+	uint64_t k;
+
+	while ((k = __atomic_load_n(&table[i].key, __ATOMIC_ACQUIRE)) != 0) {
+		if (k == key) {
+			return &table[i];
+		}
+		i = (i + 1) & (WATCH_TABLE_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+static void bump_entry(struct watch_entry *e)
+{
+	__atomic_add_fetch(&e->gen, 1, __ATOMIC_RELEASE);
+}
+
+/****************************************************************************
+get the generation counter of the directory path in a share. Returns false
+if the directory is not being watched for changes.
+****************************************************************************/
+bool watch_generation(const struct share *share, const char *path,
+                      uint32_t *gen)
+{
+	struct watch_entry *e;
+
+	if (table == NULL) {
+		return false;
+	}
+	if (*path == '\0') {
+		path = ".";
+	}
+	e = find_entry(dir_key(share, path, strlen(path)));
+	if (e == NULL || !__atomic_load_n(&e->watched, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	*gen = __atomic_load_n(&e->gen, __ATOMIC_ACQUIRE);
+	return true;
+}
+
+/****************************************************************************
+note that the server has changed the file or directory path in a share, so
+that caches see it straight away. The directory containing it changes, and
+if it is a directory, so does its own entry.
+****************************************************************************/
+void watch_changed(const struct share *share, const char *path)
+{
+	struct watch_entry *e;
+	const char *slash;
+	size_t len;
+
+	if (table == NULL) {
+		return;
+	}
+
+	/* some callers build paths like "./name" or ".//name" */
+	while (path[0] == '.' && path[1] == '/') {
+		for (path++; *path == '/'; path++)
+			;
+	}
+
+	slash = strrchr(path, '/');
+	for (len = slash != NULL ? slash - path : 0;
+	     len > 0 && path[len - 1] == '/'; len--)
+		;
+	if (len == 0) {
+		e = find_entry(dir_key(share, ".", 1));
+	} else {
+		e = find_entry(dir_key(share, path, len));
+	}
+	if (e != NULL) {
+		bump_entry(e);
+	}
+
+	e = find_entry(dir_key(share, path, strlen(path)));
+	if (e != NULL) {
+		bump_entry(e);
+	}
+}
+
+#ifdef linux
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "smb.h"
+#include "strfunc.h"
+#include "system.h"
+
+#define WATCH_MASK                                                             \
+	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |  \
+	 IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW |          \
+	 IN_EXCL_UNLINK)
+
+/* number of hash chains for finding watched directories by watch
+   descriptor; must be a power of two */
+#define WATCH_DIR_CHAINS 4096
+
+/* A watched directory; only used by the watch thread, once it has
+   started */
+struct watch_dir {
+	int wd;
+	const struct share *share;
+	char *path; /* relative to the share */
+	struct watch_entry *entry;
+	struct watch_dir *next;
+};
+
+static int inotify_fd = -1;
+static struct watch_dir *watch_dirs[WATCH_DIR_CHAINS];
+static unsigned int num_entries, num_watched;
+
+/* set if the limit on watches was reached, to be logged by watch_init() */
+static bool out_of_watches;
+
+static struct watch_dir *find_watch_dir(int wd)
+{
+	struct watch_dir *d;
+
+	for (d = watch_dirs[wd & (WATCH_DIR_CHAINS - 1)]; d != NULL;
+	     d = d->next) {
+		if (d->wd == wd) {
+			return d;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+get the entry for a directory, adding it if there is none. Returns NULL if
+the table is full.
+****************************************************************************/
+static struct watch_entry *add_entry(const struct share *share,
+                                     const char *path)
+{
+	uint64_t key = dir_key(share, path, strlen(path));
+	struct watch_entry *e = find_entry(key);
+	unsigned int i;
+
+	if (e != NULL) {
+		return e;
+	}
+	/* one entry is always left empty, so that searches end */
+	if (num_entries >= WATCH_TABLE_SIZE - 1) {
+		return NULL;
+	}
+
+	for (i = key & (WATCH_TABLE_SIZE - 1); table[i].key != 0;
+	     i = (i + 1) & (WATCH_TABLE_SIZE - 1))
+		;
+	e = &table[i];
+	e->gen = 0;
+	e->watched = false;
+	__atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+	++num_entries;
+
+	return e;
+}
+
+static void unwatch_dir(struct watch_dir *d, bool rm_watch)
+{
+	struct watch_dir **link;
+
+	if (rm_watch) {
+		inotify_rm_watch(inotify_fd, d->wd);
+	}
+	__atomic_store_n(&d->entry->watched, false, __ATOMIC_RELEASE);
+	bump_entry(d->entry);
+
+	for (link = &watch_dirs[d->wd & (WATCH_DIR_CHAINS - 1)]; *link != d;
+	     link = &(*link)->next)
+		;
+	*link = d->next;
+	--num_watched;
+
+	free(d->path);
+	free(d);
+}
+
+/****************************************************************************
+stop watching the directory path in a share and everything below it
+****************************************************************************/
+static void unwatch_tree(const struct share *share, const char *path)
+{
+	size_t len = strlen(path);
+	struct watch_dir *d, *next;
+	int i;
+
+	for (i = 0; i < WATCH_DIR_CHAINS; i++) {
+		for (d = watch_dirs[i]; d != NULL; d = next) {
+			next = d->next;
+			if (d->share == share &&
+			    strncmp(d->path, path, len) == 0 &&
+			    (d->path[len] == '\0' || d->path[len] == '/')) {
+				unwatch_dir(d, true);
+			}
+		}
+	}
+}
+
+/****************************************************************************
+start watching the directory path in a share, and everything below it
+****************************************************************************/
+static void watch_tree(const struct share *share, const char *path)
+{
+	struct watch_entry *e;
+	struct watch_dir *d;
+	struct dirent *de;
+	pstring fullpath, subpath;
+	DIR *dir;
+	int wd;
+
+	snprintf(fullpath, sizeof(fullpath), "%s/%s", share->path, path);
+
+	wd = inotify_add_watch(inotify_fd, fullpath, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			out_of_watches = true;
+		}
+		return;
+	}
+
+	/* the same directory may be reached twice, if it is created while
+	   its parent is being read */
+	d = find_watch_dir(wd);
+	if (d != NULL && d->share == share && strcmp(d->path, path) == 0) {
+		return;
+	} else if (d != NULL) {
+		unwatch_dir(d, false);
+	}
+
+	e = add_entry(share, path);
+	if (e == NULL) {
+		inotify_rm_watch(inotify_fd, wd);
+		return;
+	}
+
+	d = checked_malloc(sizeof(struct watch_dir));
+	d->wd = wd;
+	d->share = share;
+	d->path = checked_strdup(path);
+	d->entry = e;
+	d->next = watch_dirs[wd & (WATCH_DIR_CHAINS - 1)];
+	watch_dirs[wd & (WATCH_DIR_CHAINS - 1)] = d;
+	++num_watched;
+
+	/* anything cached before the watch was added may be out of date */
+	bump_entry(e);
+	__atomic_store_n(&e->watched, true, __ATOMIC_RELEASE);
+
+	dir = opendir(fullpath);
+	if (dir == NULL) {
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
+			continue;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		if (!strcmp(path, ".")) {
+			pstrcpy(subpath, de->d_name);
+		} else {
+			snprintf(subpath, sizeof(subpath), "%s/%s", path,
+			         de->d_name);
+		}
+		/* IN_ONLYDIR makes this fail if it is not a directory */
+		watch_tree(share, subpath);
+	}
+	closedir(dir);
+}
+
+static void handle_event(struct inotify_event *ev)
+{
+	struct watch_dir *d, *next;
+	pstring path;
+	int i;
+
+	if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+		/* events were lost, so anything may have changed */
+		for (i = 0; i < WATCH_DIR_CHAINS; i++) {
+			for (d = watch_dirs[i]; d != NULL; d = next) {
+				next = d->next;
+				bump_entry(d->entry);
+			}
+		}
+		return;
+	}
+
+	d = find_watch_dir(ev->wd);
+	if (d == NULL) {
+		return;
+	}
+	if ((ev->mask & (IN_IGNORED | IN_DELETE_SELF)) != 0) {
+		unwatch_dir(d, false);
+		return;
+	}
+
+	bump_entry(d->entry);
+
+	if (ev->len == 0 || (ev->mask & IN_ISDIR) == 0) {
+		return;
+	}
+	if (!strcmp(d->path, ".")) {
+		pstrcpy(path, ev->name);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s", d->path, ev->name);
+	}
+	if ((ev->mask & (IN_MOVED_FROM | IN_DELETE)) != 0) {
+		unwatch_tree(d->share, path);
+	}
+	if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+		watch_tree(d->share, path);
+	}
+}
+
+static void *watch_thread(void *arg)
+{
+	int i;
+
+	/* the descriptor is blocking, so this only returns if reading it
+	   fails */
+	sys_inotify_read(inotify_fd, handle_event);
+
+	/* nothing can be trusted any more */
+	for (i = 0; i < WATCH_TABLE_SIZE; i++) {
+		__atomic_store_n(&table[i].watched, false, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+start watching all the shares for changes. Must be called after all the
+shares have been added, and before any server processes are forked.
+
+This is done here rather than from add_share() as each share is added:
+the shares array is reallocated by add_share(), and the share pointers are
+part of the keys in the shared table, so they are only stable once the
+last share has been added. The watch_dir list also holds share pointers.
+****************************************************************************/
+bool watch_init(void)
+{
+	const struct share *share;
+	sigset_t all, old;
+	pthread_t thread;
+	int i, result;
+
+	table = mmap(NULL, WATCH_TABLE_SIZE * sizeof(struct watch_entry),
+	             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		ERROR("watch_init: mmap: %s\n", strerror(errno));
+		table = NULL;
+		return false;
+	}
+
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		ERROR("watch_init: inotify_init1: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < shares_count(); i++) {
+		share = get_share(i);
+		if (share != ipc_service) {
+			watch_tree(share, ".");
+		}
+	}
+
+	NOTICE("watching %u directories for changes\n", num_watched);
+	if (out_of_watches) {
+		WARNING("the limit on inotify watches was reached, so some "
+		        "directories are not watched; see "
+		        "/proc/sys/fs/inotify/max_user_watches\n");
+	}
+	if (num_entries >= WATCH_TABLE_SIZE - 1) {
+		WARNING("only the first %d directories are watched\n",
+		        WATCH_TABLE_SIZE - 1);
+	}
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	result = pthread_create(&thread, NULL, watch_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (result != 0) {
+		ERROR("watch_init: failed to start thread\n");
+		return false;
+	}
+	pthread_detach(thread);
+
+	return true;
+}
+
+#else
+
+bool watch_init(void)
+{
+	ERROR("watch_init: watching for changes is not supported on this "
+	      "system\n");
+	return false;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct share;
+
+bool watch_init(void);
+bool watch_generation(const struct share *share, const char *path,
+                      uint32_t *gen);
+void watch_changed(const struct share *share, const char *path);